@@ -0,0 +1,389 @@
+/**
+ * Headless decode benchmark. Demuxes and decodes the first video and audio stream of the input files
+ * into a null sink (optionally through a filter graph and a conversion to YUV 4:2:0) and reports the
+ * speed for each codec. The video is decoded several times with 1 up to N threads to see how well the
+ * decoder scales. The audio is decoded in a run of its own, so every run of the thread sweep does the same
+ * work.
+ *
+ * This is the upper bound av_encode can reach for a file (without x264 and FAAC).
+ *
+ * Usage: av_bench [-t max-threads] [-f filters] [-c] file...
+ */
+
+// For clock_gettime() and getopt()
+#define _XOPEN_SOURCE 600
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/avutil.h>
+#include <libswscale/swscale.h>
+
+#include <libavfilter/avfilter.h>
+#include <libavfilter/avfiltergraph.h>
+#include <libavfilter/vsrc_buffer.h>
+#include <libavfilter/vsink_buffer.h>
+
+void print_av_error(char *prefix, int error){
+	char message[255];
+	
+	if (av_strerror(error, message, 255) == 0)
+		fprintf(stderr, "%s: av error: %s\n", prefix, message);
+	else
+		fprintf(stderr, "%s: unknown av error, code: %d\n", prefix, error);
+}
+
+double now(){
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec + time.tv_nsec / 1000000000.0;
+}
+
+
+//
+// Statistics of one decoded stream
+//
+
+typedef struct {
+	const char *codec_name;
+	int64_t frames, bytes;
+	// Time spent for each frame (decode, filter and convert) in seconds
+	double *latencies;
+	size_t latency_count, latency_capacity;
+} stream_stats_t;
+
+void stats_add_frame(stream_stats_t *stats, double latency){
+	// If there's no memory for more latencies the frame is still counted, only the percentiles miss it
+	if (stats->latency_count == stats->latency_capacity){
+		size_t capacity = (stats->latency_capacity == 0) ? 1024 : stats->latency_capacity * 2;
+		double *latencies = realloc(stats->latencies, capacity * sizeof(double));
+		if (latencies != NULL){
+			stats->latencies = latencies;
+			stats->latency_capacity = capacity;
+		}
+	}
+	if (stats->latency_count < stats->latency_capacity)
+		stats->latencies[stats->latency_count++] = latency;
+	stats->frames++;
+}
+
+int compare_doubles(const void *a, const void *b){
+	double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+double percentile(stream_stats_t *stats, double p){
+	if (stats->latency_count == 0)
+		return 0;
+	size_t index = p / 100 * (stats->latency_count - 1) + 0.5;
+	return stats->latencies[index];
+}
+
+void stats_print(const char *type, stream_stats_t *stats, double wall_sec){
+	qsort(stats->latencies, stats->latency_count, sizeof(double), compare_doubles);
+	printf("  %s %-10s %8ld frames %9.1f frames/s %8.2f MiB/s   per frame (ms): p50 %.2f p90 %.2f p99 %.2f max %.2f\n",
+		type, stats->codec_name, stats->frames, stats->frames / wall_sec, stats->bytes / wall_sec / (1024 * 1024),
+		percentile(stats, 50) * 1000, percentile(stats, 90) * 1000, percentile(stats, 99) * 1000, percentile(stats, 100) * 1000);
+}
+
+void stats_free(stream_stats_t *stats){
+	free(stats->latencies);
+	memset(stats, 0, sizeof(stream_stats_t));
+}
+
+
+//
+// Filter graph (same setup as in av_encode but with a sink that is just emptied)
+//
+
+bool build_filter_graph(AVCodecContext *codec_context_ptr, AVRational time_base, const char *filters,
+	AVFilterGraph **graph_dptr, AVFilterContext **src_dptr, AVFilterContext **sink_dptr){
+	char args[255];
+	snprintf(args, sizeof(args), "%d:%d:%d:%d:%d:%d:%d", codec_context_ptr->width, codec_context_ptr->height, codec_context_ptr->pix_fmt,
+		time_base.num, time_base.den, codec_context_ptr->sample_aspect_ratio.num, codec_context_ptr->sample_aspect_ratio.den);
+	
+	*graph_dptr = avfilter_graph_alloc();
+	int error = avfilter_graph_create_filter(src_dptr, avfilter_get_by_name("buffer"), "src", args, NULL, *graph_dptr);
+	if (error < 0){
+		print_av_error("avfilter_graph_create_filter", error);
+		return false;
+	}
+	
+	enum PixelFormat pix_fmts[] = { codec_context_ptr->pix_fmt, PIX_FMT_NONE };
+	error = avfilter_graph_create_filter(sink_dptr, avfilter_get_by_name("buffersink"), "sink", "", pix_fmts, *graph_dptr);
+	if (error < 0){
+		print_av_error("avfilter_graph_create_filter", error);
+		return false;
+	}
+	
+	AVFilterInOut *outputs = avfilter_inout_alloc(), *inputs = avfilter_inout_alloc();
+	outputs->name = av_strdup("in");
+	outputs->filter_ctx = *src_dptr;
+	outputs->pad_idx = 0;
+	outputs->next = NULL;
+	inputs->name = av_strdup("out");
+	inputs->filter_ctx = *sink_dptr;
+	inputs->pad_idx = 0;
+	inputs->next = NULL;
+	
+	error = avfilter_graph_parse(*graph_dptr, filters, &inputs, &outputs, NULL);
+	if (error != 0){
+		print_av_error("avfilter_graph_parse", error);
+		return false;
+	}
+	
+	error = avfilter_graph_config(*graph_dptr, NULL);
+	if (error < 0){
+		print_av_error("avfilter_graph_config", error);
+		return false;
+	}
+	
+	return true;
+}
+
+
+//
+// One run over a file
+//
+
+/**
+ * Demuxes and decodes the whole file once. The video is only decoded if `video_stats` is not `NULL` (with
+ * `thread_count` threads), the audio only if `audio_stats` is not `NULL`. Returns the wall clock time of the
+ * run or a negative value on error.
+ */
+double bench_file(const char *filename, int thread_count, const char *filters, bool convert,
+	stream_stats_t *video_stats, stream_stats_t *audio_stats){
+	AVFormatContext *format_context_ptr = NULL;
+	int error = avformat_open_input(&format_context_ptr, filename, NULL, NULL);
+	if (error != 0){
+		print_av_error("avformat_open_input", error);
+		return -1;
+	}
+	
+	error = av_find_stream_info(format_context_ptr);
+	if (error < 0)
+		print_av_error("av_find_stream_info", error);
+	
+	int video_stream = -1, audio_stream = -1;
+	for(int i = 0; i < format_context_ptr->nb_streams; i++){
+		if (format_context_ptr->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO && video_stream < 0)
+			video_stream = i;
+		if (format_context_ptr->streams[i]->codec->codec_type == AVMEDIA_TYPE_AUDIO && audio_stream < 0)
+			audio_stream = i;
+	}
+	if ( (video_stats != NULL && video_stream < 0) || (audio_stats != NULL && audio_stream < 0) ){
+		fprintf(stderr, "%s: no %s stream\n", filename, (video_stats != NULL && video_stream < 0) ? "video" : "audio");
+		av_close_input_file(format_context_ptr);
+		return -1;
+	}
+	
+	// Open the decoders, the thread count has to be set before
+	AVCodecContext *video_context_ptr = NULL;
+	if (video_stats != NULL){
+		video_context_ptr = format_context_ptr->streams[video_stream]->codec;
+		AVCodec *video_codec_ptr = avcodec_find_decoder(video_context_ptr->codec_id);
+		video_context_ptr->thread_count = thread_count;
+		if (video_codec_ptr == NULL || avcodec_open(video_context_ptr, video_codec_ptr) < 0){
+			fprintf(stderr, "%s: could not open video codec\n", filename);
+			av_close_input_file(format_context_ptr);
+			return -1;
+		}
+		video_stats->codec_name = video_codec_ptr->name;
+	}
+	
+	AVCodecContext *audio_context_ptr = NULL;
+	if (audio_stats != NULL){
+		audio_context_ptr = format_context_ptr->streams[audio_stream]->codec;
+		AVCodec *audio_codec_ptr = avcodec_find_decoder(audio_context_ptr->codec_id);
+		if (audio_codec_ptr == NULL || avcodec_open(audio_context_ptr, audio_codec_ptr) < 0){
+			fprintf(stderr, "%s: could not open audio codec\n", filename);
+			if (video_context_ptr != NULL)
+				avcodec_close(video_context_ptr);
+			av_close_input_file(format_context_ptr);
+			return -1;
+		}
+		audio_stats->codec_name = audio_codec_ptr->name;
+	}
+	
+	AVFilterGraph *graph_ptr = NULL;
+	AVFilterContext *src_ptr = NULL, *sink_ptr = NULL;
+	if ( video_context_ptr != NULL && filters != NULL && ! build_filter_graph(video_context_ptr, format_context_ptr->streams[video_stream]->time_base, filters, &graph_ptr, &src_ptr, &sink_ptr) ){
+		avcodec_close(video_context_ptr);
+		if (audio_context_ptr != NULL)
+			avcodec_close(audio_context_ptr);
+		av_close_input_file(format_context_ptr);
+		return -1;
+	}
+	
+	// The converted frames go into this picture and are thrown away
+	struct SwsContext *scaler = NULL;
+	AVPicture converted;
+	if (video_context_ptr != NULL && convert){
+		scaler = sws_getContext(video_context_ptr->width, video_context_ptr->height, video_context_ptr->pix_fmt,
+			video_context_ptr->width, video_context_ptr->height, PIX_FMT_YUV420P, SWS_FAST_BILINEAR, NULL, NULL, NULL);
+		avpicture_alloc(&converted, PIX_FMT_YUV420P, video_context_ptr->width, video_context_ptr->height);
+	}
+	
+	AVFrame *frame_ptr = avcodec_alloc_frame();
+	int16_t *samples_ptr = av_malloc(AVCODEC_MAX_AUDIO_FRAME_SIZE);
+	AVPacket packet;
+	int frame_finished;
+	
+	double start = now();
+	while(true){
+		// Flush the delayed frames of the video decoder at the end of the file
+		bool flushing = (av_read_frame(format_context_ptr, &packet) < 0);
+		if (flushing && video_context_ptr == NULL)
+			break;
+		if (flushing){
+			av_init_packet(&packet);
+			packet.data = NULL;
+			packet.size = 0;
+			packet.stream_index = video_stream;
+		}
+		
+		double frame_start = now();
+		if (video_context_ptr != NULL && packet.stream_index == video_stream){
+			video_stats->bytes += packet.size;
+			error = avcodec_decode_video2(video_context_ptr, frame_ptr, &frame_finished, &packet);
+			if (error < 0)
+				print_av_error("avcodec_decode_video2", error);
+			
+			if (frame_finished){
+				if (graph_ptr != NULL){
+					error = av_vsrc_buffer_add_frame(src_ptr, frame_ptr, AV_VSRC_BUF_FLAG_OVERWRITE);
+					if (error < 0)
+						print_av_error("av_vsrc_buffer_add_frame", error);
+					
+					AVFilterBufferRef *buffer_ref_ptr = NULL;
+					while( avfilter_poll_frame(sink_ptr->inputs[0]) > 0 ){
+						if ( av_vsink_buffer_get_video_buffer_ref(sink_ptr, &buffer_ref_ptr, 0) >= 0 )
+							avfilter_unref_buffer(buffer_ref_ptr);
+					}
+				}
+				
+				if (scaler != NULL)
+					sws_scale(scaler, (const uint8_t * const*)frame_ptr->data, frame_ptr->linesize, 0, video_context_ptr->height,
+						converted.data, converted.linesize);
+				
+				stats_add_frame(video_stats, now() - frame_start);
+			} else if (flushing) {
+				break;
+			}
+		} else if (audio_context_ptr != NULL && packet.stream_index == audio_stream) {
+			audio_stats->bytes += packet.size;
+			AVPacket remaining = packet;
+			while (remaining.size > 0){
+				int samples_size = AVCODEC_MAX_AUDIO_FRAME_SIZE;
+				int bytes_decoded = avcodec_decode_audio3(audio_context_ptr, samples_ptr, &samples_size, &remaining);
+				if (bytes_decoded < 0){
+					print_av_error("avcodec_decode_audio3", bytes_decoded);
+					break;
+				}
+				// Nothing consumed, the decoder won't take the rest of the packet
+				if (bytes_decoded == 0)
+					break;
+				remaining.data += bytes_decoded;
+				remaining.size -= bytes_decoded;
+			}
+			stats_add_frame(audio_stats, now() - frame_start);
+		}
+		
+		if ( ! flushing )
+			av_free_packet(&packet);
+	}
+	double wall_sec = now() - start;
+	
+	//
+	// Clean up
+	//
+	
+	av_free(samples_ptr);
+	av_free(frame_ptr);
+	if (scaler != NULL){
+		avpicture_free(&converted);
+		sws_freeContext(scaler);
+	}
+	avfilter_graph_free(&graph_ptr);
+	if (video_context_ptr != NULL)
+		avcodec_close(video_context_ptr);
+	if (audio_context_ptr != NULL)
+		avcodec_close(audio_context_ptr);
+	av_close_input_file(format_context_ptr);
+	
+	return wall_sec;
+}
+
+
+int main(int argc, char **argv){
+	int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	const char *filters = NULL;
+	bool convert = false;
+	
+	int opt;
+	while( (opt = getopt(argc, argv, "t:f:c")) != -1 ){
+		switch(opt){
+			case 't':
+				max_threads = atoi(optarg);
+				break;
+			case 'f':
+				filters = optarg;
+				break;
+			case 'c':
+				convert = true;
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-t max-threads] [-f filters] [-c] file...\n", argv[0]);
+				return 1;
+		}
+	}
+	if (optind >= argc){
+		fprintf(stderr, "invalid args\nusage: %s [-t max-threads] [-f filters] [-c] file...\n", argv[0]);
+		return 1;
+	}
+	if (max_threads < 1)
+		max_threads = 1;
+	
+	avcodec_register_all();
+	av_register_all();
+	avfilter_register_all();
+	av_log_set_level(AV_LOG_ERROR);
+	
+	for(int i = optind; i < argc; i++){
+		printf("%s:\n", argv[i]);
+		
+		// Only the video is decoded in the thread sweep, so the speedup isn't skewed by the audio
+		double single_thread_fps = 0;
+		for(int threads = 1; threads <= max_threads; threads = (threads * 2 > max_threads && threads < max_threads) ? max_threads : threads * 2){
+			stream_stats_t video_stats = { 0 };
+			double wall_sec = bench_file(argv[i], threads, filters, convert, &video_stats, NULL);
+			if (wall_sec < 0)
+				break;
+			
+			double fps = video_stats.frames / wall_sec;
+			if (threads == 1)
+				single_thread_fps = fps;
+			printf(" %2d thread(s), %.2f s, speedup %.2fx\n", threads, wall_sec, (single_thread_fps > 0) ? fps / single_thread_fps : 0);
+			stats_print("video", &video_stats, wall_sec);
+			stats_free(&video_stats);
+		}
+		
+		// The audio decoder doesn't use threads, one run is enough. The time still includes the demuxing of
+		// the whole file.
+		stream_stats_t audio_stats = { 0 };
+		double wall_sec = bench_file(argv[i], 1, NULL, false, NULL, &audio_stats);
+		if (wall_sec >= 0){
+			printf(" audio only, %.2f s\n", wall_sec);
+			stats_print("audio", &audio_stats, wall_sec);
+		}
+		stats_free(&audio_stats);
+	}
+	
+	return 0;
+}
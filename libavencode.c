@@ -0,0 +1,7814 @@
+/**
+ * Please be aware: The following code is UGLY. It was hacked together in a
+ * few days to learn libavformat, libavcodec, libavfilter, x264, faac, libmp4v2
+ * and the MPEG4 spec.
+ * 
+ * The encoding pipeline of av_encode, see libavencode.h for the interface.
+ */
+
+// This is for time.h to include struct timespec (since it's from POSIX)
+#define _XOPEN_SOURCE 600
+// And this for madvise() (used for the huge pages of the frame pool)
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+// And this for sched_getaffinity() and the CPU_* macros (used by the governor and the affinity)
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/avutil.h>
+#include <libavutil/audioconvert.h>
+#include <libavutil/samplefmt.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
+
+#include <libavfilter/avfilter.h>
+#include <libavfilter/avfiltergraph.h>
+#include <libavfilter/vsrc_buffer.h>
+#include <libavfilter/buffersrc.h>
+#include <libavfilter/vsink_buffer.h>
+#include <libavfilter/avcodec.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <x264.h>
+#include <faac.h>
+#include "asf.h"
+#include "libavencode.h"
+
+
+//
+// General output stuff
+//
+
+// Shows or hides the debug output. It's only about logging, so it's shared by all sessions.
+static bool enc_debug_show = false;
+
+void enc_set_debug(bool show){
+	enc_debug_show = show;
+}
+
+bool enc_debug_enabled(){
+	return enc_debug_show;
+}
+
+static void enc_debug(const char *format, ...){
+	if (!enc_debug_show)
+		return;
+	
+	va_list args;
+	
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	va_end(args);
+}
+
+/**
+ * Just a small helper function that will return `-1` for an unkown PTS value.
+ * This is better readable than the minimum int64_t value. Could also be done
+ * with a macro, but well... not really worth it.
+ */
+int64_t format_pts(int64_t pts){
+	return pts == AV_NOPTS_VALUE ? -1 : pts;
+}
+
+
+display_time_t display_time_from_secs(double entire_seconds){
+	int64_t seconds = entire_seconds;
+	
+	uint16_t hours = seconds / (60LL * 60LL);
+	seconds -= hours * (60LL * 60LL);
+	uint8_t minutes = seconds / 60LL;
+	seconds -= minutes * 60LL;
+	
+	return (display_time_t){ .hours = hours, .minutes = minutes, .seconds = seconds, .entire_seconds = entire_seconds };
+}
+
+display_time_t display_time(int64_t time_stamp, AVRational time_base){
+	return display_time_from_secs( time_stamp * av_q2d(time_base) );
+}
+
+
+//
+// Common libav stuff
+//
+
+/**
+ * Small helper function that prints an error message followed by a description of
+ * the specified AV error code. Inspired by the POSIX perror() function.
+ */
+void enc_av_perror(char *prefix, int error){
+	char message[255];
+	
+	if (av_strerror(error, message, 255) == 0)
+		fprintf(stderr, "%s: av error: %s\n", prefix, message);
+	else
+		fprintf(stderr, "%s: unknown av error, code: %d\n", prefix, error);
+}
+
+
+//
+// Probe cache stuff
+//
+
+/**
+ * The results of `av_find_stream_info()` are stored in a small text file per input file. The name of the
+ * entry is a hash of the absolute path, size, mtime and a hash of the first bytes of the file. If one of
+ * them changes the file is probed again. The entry contains the codec parameters of all streams, the
+ * duration and the automatically selected streams.
+ */
+#define ENC_PROBE_CACHE_HEADER_SIZE 65536
+#define ENC_PROBE_CACHE_VERSION 1
+
+typedef struct {
+	// Path of the cache entry for the input file
+	char entry_file[PATH_MAX];
+	// The key of the input file, stored in the entry to detect hash collisions
+	char path[PATH_MAX];
+	int64_t size, mtime;
+	uint64_t header_hash;
+	
+	// Filled by `enc_probe_cache_load()`. The stream indices are -1 and 0 if the previous run did not select
+	// the streams automatically.
+	bool hit;
+	int video_stream_index;
+	int audio_stream_indices[ENC_MAX_AUDIO_TRACKS];
+	int audio_stream_count;
+} enc_probe_cache_t;
+
+// Codec parameters of one stream as stored in the cache entry
+typedef struct {
+	int codec_type, codec_id, bit_rate, width, height, pix_fmt, ticks_per_frame, sample_rate, channels, sample_fmt, frame_size;
+	AVRational time_base, sample_aspect_ratio, r_frame_rate, avg_frame_rate;
+	int64_t start_time, duration, channel_layout;
+} enc_probe_cache_stream_t;
+
+static uint64_t enc_probe_cache_hash(uint64_t hash, const void *data, size_t size){
+	// 64 bit FNV-1a
+	const uint8_t *bytes = data;
+	for(size_t i = 0; i < size; i++)
+		hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+	return hash;
+}
+
+/**
+ * Builds the cache key for `filename` and the path of its entry in `cache_dir`. The directory is created
+ * if it does not exist yet.
+ */
+bool enc_probe_cache_open(const char *cache_dir, const char *filename, enc_probe_cache_t *cache){
+	cache->hit = false;
+	cache->video_stream_index = -1;
+	cache->audio_stream_count = 0;
+	
+	struct stat file_stat;
+	if (stat(filename, &file_stat) != 0 || realpath(filename, cache->path) == NULL){
+		perror(filename);
+		return false;
+	}
+	cache->size = file_stat.st_size;
+	cache->mtime = file_stat.st_mtime;
+	
+	FILE *file = fopen(filename, "rb");
+	if (file == NULL){
+		perror(filename);
+		return false;
+	}
+	uint8_t *header_ptr = malloc(ENC_PROBE_CACHE_HEADER_SIZE);
+	if (header_ptr == NULL){
+		fprintf(stderr, "probe cache: failed to allocate the header buffer\n");
+		fclose(file);
+		return false;
+	}
+	size_t header_size = fread(header_ptr, 1, ENC_PROBE_CACHE_HEADER_SIZE, file);
+	fclose(file);
+	cache->header_hash = enc_probe_cache_hash(0xcbf29ce484222325ULL, header_ptr, header_size);
+	free(header_ptr);
+	
+	uint64_t key_hash = enc_probe_cache_hash(cache->header_hash, cache->path, strlen(cache->path));
+	key_hash = enc_probe_cache_hash(key_hash, &cache->size, sizeof(cache->size));
+	key_hash = enc_probe_cache_hash(key_hash, &cache->mtime, sizeof(cache->mtime));
+	
+	if (mkdir(cache_dir, 0755) != 0 && errno != EEXIST){
+		perror(cache_dir);
+		return false;
+	}
+	snprintf(cache->entry_file, sizeof(cache->entry_file), "%s/%016llx.probe", cache_dir, (unsigned long long)key_hash);
+	
+	return true;
+}
+
+/**
+ * Reads the cache entry and applies the stored parameters to the streams of the format context. The
+ * streams found in the header have to match the stored ones (type and codec), otherwise the entry is
+ * ignored. Returns `true` on a cache hit, in that case `av_find_stream_info()` is not necessary.
+ */
+bool enc_probe_cache_load(enc_probe_cache_t *cache, AVFormatContext *format_context_ptr){
+	FILE *file = fopen(cache->entry_file, "r");
+	if (file == NULL)
+		return false;
+	
+	bool valid = false;
+	char path[PATH_MAX];
+	int version = 0, nb_streams = 0;
+	int64_t size = 0, mtime = 0, duration = 0, start_time = 0;
+	unsigned long long header_hash = 0;
+	int bit_rate = 0;
+	enc_probe_cache_stream_t *params = NULL;
+	
+	if ( fscanf(file, "av_encode probe cache %d\n", &version) != 1 || version != ENC_PROBE_CACHE_VERSION )
+		goto done;
+	if ( fgets(path, sizeof(path), file) == NULL )
+		goto done;
+	path[strcspn(path, "\n")] = '\0';
+	if ( fscanf(file, "%ld %ld %llx\n", &size, &mtime, &header_hash) != 3 )
+		goto done;
+	if ( strcmp(path, cache->path) != 0 || size != cache->size || mtime != cache->mtime || header_hash != cache->header_hash )
+		goto done;
+	
+	if ( fscanf(file, "format %ld %ld %d %d\n", &duration, &start_time, &bit_rate, &nb_streams) != 4 || nb_streams != format_context_ptr->nb_streams )
+		goto done;
+	
+	// Read all stream parameters first, they're only applied if all streams match
+	params = malloc(nb_streams * sizeof(enc_probe_cache_stream_t));
+	if (params == NULL)
+		goto done;
+	for(int i = 0; i < nb_streams; i++){
+		enc_probe_cache_stream_t *p = &params[i];
+		int fields = fscanf(file, "stream %d %d %d %d %d %d %d/%d %d/%d %d %d %d %d %ld %d %d/%d %d/%d %ld %ld\n",
+			&p->codec_type, &p->codec_id, &p->bit_rate, &p->width, &p->height, &p->pix_fmt,
+			&p->sample_aspect_ratio.num, &p->sample_aspect_ratio.den, &p->time_base.num, &p->time_base.den, &p->ticks_per_frame,
+			&p->sample_rate, &p->channels, &p->sample_fmt, &p->channel_layout, &p->frame_size,
+			&p->r_frame_rate.num, &p->r_frame_rate.den, &p->avg_frame_rate.num, &p->avg_frame_rate.den,
+			&p->start_time, &p->duration);
+		AVCodecContext *codec_context_ptr = format_context_ptr->streams[i]->codec;
+		if (fields != 22 || p->codec_type != codec_context_ptr->codec_type || p->codec_id != codec_context_ptr->codec_id)
+			goto done;
+	}
+	
+	if ( fscanf(file, "selected %d %d", &cache->video_stream_index, &cache->audio_stream_count) != 2 || cache->audio_stream_count > ENC_MAX_AUDIO_TRACKS )
+		goto done;
+	for(int i = 0; i < cache->audio_stream_count; i++){
+		if ( fscanf(file, " %d", &cache->audio_stream_indices[i]) != 1 )
+			goto done;
+	}
+	
+	for(int i = 0; i < nb_streams; i++){
+		enc_probe_cache_stream_t *p = &params[i];
+		AVStream *stream_ptr = format_context_ptr->streams[i];
+		AVCodecContext *codec_context_ptr = stream_ptr->codec;
+		
+		codec_context_ptr->bit_rate = p->bit_rate;
+		codec_context_ptr->width = p->width;
+		codec_context_ptr->height = p->height;
+		codec_context_ptr->pix_fmt = p->pix_fmt;
+		codec_context_ptr->sample_aspect_ratio = p->sample_aspect_ratio;
+		codec_context_ptr->time_base = p->time_base;
+		codec_context_ptr->ticks_per_frame = p->ticks_per_frame;
+		codec_context_ptr->sample_rate = p->sample_rate;
+		codec_context_ptr->channels = p->channels;
+		codec_context_ptr->sample_fmt = p->sample_fmt;
+		codec_context_ptr->channel_layout = p->channel_layout;
+		codec_context_ptr->frame_size = p->frame_size;
+		stream_ptr->r_frame_rate = p->r_frame_rate;
+		stream_ptr->avg_frame_rate = p->avg_frame_rate;
+		stream_ptr->start_time = p->start_time;
+		stream_ptr->duration = p->duration;
+	}
+	format_context_ptr->duration = duration;
+	format_context_ptr->start_time = start_time;
+	format_context_ptr->bit_rate = bit_rate;
+	
+	valid = true;
+	cache->hit = true;
+	
+	done:
+	free(params);
+	fclose(file);
+	if ( ! valid ){
+		cache->video_stream_index = -1;
+		cache->audio_stream_count = 0;
+		enc_debug("probe cache: ignoring stale or broken entry %s\n", cache->entry_file);
+	}
+	return valid;
+}
+
+/**
+ * Writes the parameters of all streams and the automatically selected streams (`-1` and `0` if the streams
+ * were selected manually) into the cache entry. The entry is written to a temporary file first and then
+ * renamed so concurrent jobs never see a half written entry.
+ */
+bool enc_probe_cache_store(enc_probe_cache_t *cache, AVFormatContext *format_context_ptr,
+	int video_stream_index, const int *audio_stream_indices, int audio_stream_count
+){
+	char temp_file[PATH_MAX + 32];
+	snprintf(temp_file, sizeof(temp_file), "%s.%d.%p", cache->entry_file, (int)getpid(), (void*)cache);
+	
+	FILE *file = fopen(temp_file, "w");
+	if (file == NULL){
+		perror(temp_file);
+		return false;
+	}
+	
+	fprintf(file, "av_encode probe cache %d\n%s\n%ld %ld %016llx\n", ENC_PROBE_CACHE_VERSION,
+		cache->path, cache->size, cache->mtime, (unsigned long long)cache->header_hash);
+	fprintf(file, "format %ld %ld %d %d\n", format_context_ptr->duration, format_context_ptr->start_time,
+		format_context_ptr->bit_rate, format_context_ptr->nb_streams);
+	
+	for(int i = 0; i < format_context_ptr->nb_streams; i++){
+		AVStream *stream_ptr = format_context_ptr->streams[i];
+		AVCodecContext *c = stream_ptr->codec;
+		fprintf(file, "stream %d %d %d %d %d %d %d/%d %d/%d %d %d %d %d %ld %d %d/%d %d/%d %ld %ld\n",
+			c->codec_type, c->codec_id, c->bit_rate, c->width, c->height, c->pix_fmt,
+			c->sample_aspect_ratio.num, c->sample_aspect_ratio.den, c->time_base.num, c->time_base.den, c->ticks_per_frame,
+			c->sample_rate, c->channels, c->sample_fmt, (int64_t)c->channel_layout, c->frame_size,
+			stream_ptr->r_frame_rate.num, stream_ptr->r_frame_rate.den, stream_ptr->avg_frame_rate.num, stream_ptr->avg_frame_rate.den,
+			stream_ptr->start_time, stream_ptr->duration);
+	}
+	
+	fprintf(file, "selected %d %d", video_stream_index, audio_stream_count);
+	for(int i = 0; i < audio_stream_count; i++)
+		fprintf(file, " %d", audio_stream_indices[i]);
+	fprintf(file, "\n");
+	
+	if (fclose(file) != 0 || rename(temp_file, cache->entry_file) != 0){
+		perror(cache->entry_file);
+		unlink(temp_file);
+		return false;
+	}
+	
+	return true;
+}
+
+
+//
+// Result cache stuff (reusing the output of identical jobs)
+//
+
+/**
+ * The output files of finished jobs are stored in a cache directory. The key is a fingerprint of the input
+ * files, all options that change the output and the versions of the libraries. On a hit the cached file is
+ * copied (reflinked if the file system can) to the output file and nothing is encoded. With `link_output`
+ * the output and the entry are hardlinks of each other instead, faster but the output must not be modified
+ * in place. The directory is kept below `max_size` bytes by removing the least recently used entries. A hit
+ * updates the atime of an entry, the mtime is left alone since it's also the mtime of a hardlinked output.
+ * 
+ * The fingerprint reads `ENC_RESULT_CACHE_BLOCKS` blocks spread evenly over each input file, so it's
+ * fast even for large files. Together with the file size this catches everything but a deliberate
+ * modification in the middle of a block gap.
+ */
+#define ENC_RESULT_CACHE_BLOCKS 16
+#define ENC_RESULT_CACHE_BLOCK_SIZE 65536
+// Has to change whenever the output for the same job changes (e.g. the MP4 writer)
+#define ENC_RESULT_CACHE_VERSION 3
+
+typedef struct {
+	const char *cache_dir;
+	int64_t max_size;
+	bool link_output;
+	char entry_file[PATH_MAX];
+} enc_result_cache_t;
+
+// File name, size and last use (atime) of one entry, used for the eviction
+typedef struct {
+	char name[64];
+	int64_t size;
+	time_t atime;
+} enc_result_cache_entry_t;
+
+/**
+ * Hashes the size and sampled blocks of `filename` into `hash`.
+ */
+static bool enc_result_cache_fingerprint(const char *filename, uint64_t *hash){
+	FILE *file = fopen(filename, "rb");
+	if (file == NULL){
+		perror(filename);
+		return false;
+	}
+	
+	struct stat file_stat;
+	if (fstat(fileno(file), &file_stat) != 0){
+		perror(filename);
+		fclose(file);
+		return false;
+	}
+	int64_t size = file_stat.st_size;
+	*hash = enc_probe_cache_hash(*hash, &size, sizeof(size));
+	
+	uint8_t *block_ptr = malloc(ENC_RESULT_CACHE_BLOCK_SIZE);
+	if (block_ptr == NULL){
+		fprintf(stderr, "result cache: failed to allocate the fingerprint buffer\n");
+		fclose(file);
+		return false;
+	}
+	for(int i = 0; i < ENC_RESULT_CACHE_BLOCKS; i++){
+		// The first block starts at the beginning, the last one ends at the end of the file
+		int64_t offset = 0;
+		if (size > ENC_RESULT_CACHE_BLOCK_SIZE)
+			offset = (size - ENC_RESULT_CACHE_BLOCK_SIZE) * i / (ENC_RESULT_CACHE_BLOCKS - 1);
+		if (fseeko(file, offset, SEEK_SET) != 0)
+			break;
+		size_t block_size = fread(block_ptr, 1, ENC_RESULT_CACHE_BLOCK_SIZE, file);
+		*hash = enc_probe_cache_hash(*hash, block_ptr, block_size);
+		if (size <= ENC_RESULT_CACHE_BLOCK_SIZE)
+			break;
+	}
+	free(block_ptr);
+	
+	fclose(file);
+	return true;
+}
+
+/**
+ * Builds the key of the job described by `opts` and the path of its entry in `cache_dir`. The directory
+ * is created if it does not exist yet. Options that don't change the output (e.g. `silent` or the probe
+ * limits) are not part of the key.
+ */
+bool enc_result_cache_open(const enc_options_t *opts, const char *cache_dir, int64_t max_size, bool link_output, enc_result_cache_t *cache){
+	cache->cache_dir = cache_dir;
+	cache->max_size = max_size;
+	cache->link_output = link_output;
+	
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for(int i = 0; i < opts->input_count; i++){
+		if ( ! enc_result_cache_fingerprint(opts->input_files[i], &hash) )
+			return false;
+	}
+	
+	char *faac_id = NULL, *faac_copyright = NULL;
+	faacEncGetVersion(&faac_id, &faac_copyright);
+	
+	// The normalized options, defaults are filled in so "--tune film" and no tune at all are the same job
+	char key[4096];
+	int key_length = snprintf(key, sizeof(key),
+		"av_encode result cache %d\nlibs %u %u %u %u %d %s\n"
+		"streams %d %d %d\nframes %ld\nfilters %s %d %d\nx264 %s %s %.2f %s %.2f %.3f\ndedup %d %.3f %.3f\nloudness %d %.2f\naudio format %d %d\nauto quality %d %.4f %d %d\n",
+		ENC_RESULT_CACHE_VERSION,
+		avcodec_version(), avformat_version(), avfilter_version(), swscale_version(), X264_BUILD,
+		faac_id ? faac_id : "-",
+		opts->video_stream_index, opts->all_audio_streams, opts->audio_stream_count,
+		opts->frame_limit,
+		opts->video_filter ? opts->video_filter : "", opts->auto_crop, opts->auto_deinterlace,
+		opts->preset, opts->tune, opts->quality, opts->profile ? opts->profile : "-", opts->speed_target, opts->target_size,
+		opts->drop_duplicates, opts->drop_duplicates ? opts->duplicate_threshold : 0, opts->drop_duplicates ? opts->max_duplicate_gap : 0,
+		opts->normalize_loudness, opts->normalize_loudness ? opts->loudness_target : 0,
+		opts->audio_sample_rate, opts->audio_channels,
+		opts->auto_quality, opts->auto_quality ? opts->quality_target_ssim : 0, opts->quality_min_bit_rate, opts->quality_max_bit_rate);
+	for(int i = 0; i < opts->audio_stream_count && key_length < sizeof(key); i++)
+		key_length += snprintf(key + key_length, sizeof(key) - key_length, "audio %d\n", opts->audio_stream_indices[i]);
+	hash = enc_probe_cache_hash(hash, key, strlen(key));
+	enc_debug("result cache key:\n%s", key);
+	
+	if (mkdir(cache_dir, 0755) != 0 && errno != EEXIST){
+		perror(cache_dir);
+		return false;
+	}
+	snprintf(cache->entry_file, sizeof(cache->entry_file), "%s/%016llx.mp4", cache_dir, (unsigned long long)hash);
+	
+	return true;
+}
+
+/**
+ * Copies `source` to `dest`. If the file system supports it (e.g. Btrfs or XFS) `dest` is a reflink of
+ * `source`: it shares the data blocks until one of them is modified. Otherwise it's copied byte by byte.
+ */
+static bool enc_result_cache_copy(const char *source, const char *dest){
+	FILE *in = fopen(source, "rb");
+	if (in == NULL){
+		perror(source);
+		return false;
+	}
+	FILE *out = fopen(dest, "wb");
+	if (out == NULL){
+		perror(dest);
+		fclose(in);
+		return false;
+	}
+	
+	if (ioctl(fileno(out), FICLONE, fileno(in)) == 0){
+		fclose(in);
+		fclose(out);
+		return true;
+	}
+	
+	char buffer[65536];
+	size_t size;
+	bool success = true;
+	while( (size = fread(buffer, 1, sizeof(buffer), in)) > 0 ){
+		if (fwrite(buffer, 1, size, out) != size){
+			success = false;
+			break;
+		}
+	}
+	if (ferror(in))
+		success = false;
+	
+	fclose(in);
+	if (fclose(out) != 0)
+		success = false;
+	if (!success){
+		perror(dest);
+		unlink(dest);
+	}
+	return success;
+}
+
+/**
+ * Marks an entry as recently used for the LRU eviction. Only the atime is set, the mtime stays the time the
+ * entry was encoded.
+ */
+static void enc_result_cache_touch(const char *entry_file){
+	struct timespec times[2] = { { .tv_sec = 0, .tv_nsec = UTIME_NOW }, { .tv_sec = 0, .tv_nsec = UTIME_OMIT } };
+	if (utimensat(AT_FDCWD, entry_file, times, 0) != 0)
+		perror(entry_file);
+}
+
+/**
+ * Puts the cached result into `output_file` if there is one. Returns `true` on a cache hit.
+ */
+bool enc_result_cache_fetch(enc_result_cache_t *cache, const char *output_file){
+	if (access(cache->entry_file, R_OK) != 0)
+		return false;
+	
+	unlink(output_file);
+	if ( ! (cache->link_output && link(cache->entry_file, output_file) == 0) && ! enc_result_cache_copy(cache->entry_file, output_file) )
+		return false;
+	
+	enc_result_cache_touch(cache->entry_file);
+	return true;
+}
+
+static int enc_result_cache_compare_entries(const void *a, const void *b){
+	time_t a_atime = ((const enc_result_cache_entry_t*)a)->atime, b_atime = ((const enc_result_cache_entry_t*)b)->atime;
+	return (a_atime > b_atime) - (a_atime < b_atime);
+}
+
+/**
+ * Removes the least recently used entries until the cache is smaller than its maximal size.
+ */
+void enc_result_cache_evict(enc_result_cache_t *cache){
+	DIR *dir = opendir(cache->cache_dir);
+	if (dir == NULL){
+		perror(cache->cache_dir);
+		return;
+	}
+	
+	enc_result_cache_entry_t *entries = NULL;
+	size_t entry_count = 0, entry_capacity = 0;
+	int64_t total_size = 0;
+	char path[PATH_MAX];
+	struct dirent *dirent_ptr;
+	while( (dirent_ptr = readdir(dir)) != NULL ){
+		size_t name_length = strlen(dirent_ptr->d_name);
+		if (name_length < 4 || name_length >= sizeof(entries[0].name) || strcmp(dirent_ptr->d_name + name_length - 4, ".mp4") != 0)
+			continue;
+		
+		struct stat entry_stat;
+		snprintf(path, sizeof(path), "%s/%s", cache->cache_dir, dirent_ptr->d_name);
+		if (stat(path, &entry_stat) != 0)
+			continue;
+		
+		if (entry_count == entry_capacity){
+			entry_capacity = (entry_capacity > 0) ? entry_capacity * 2 : 64;
+			enc_result_cache_entry_t *larger_entries = realloc(entries, entry_capacity * sizeof(enc_result_cache_entry_t));
+			if (larger_entries == NULL){
+				fprintf(stderr, "result cache: out of memory, skipping the eviction\n");
+				free(entries);
+				closedir(dir);
+				return;
+			}
+			entries = larger_entries;
+		}
+		strcpy(entries[entry_count].name, dirent_ptr->d_name);
+		entries[entry_count].size = entry_stat.st_size;
+		entries[entry_count].atime = entry_stat.st_atime;
+		entry_count++;
+		total_size += entry_stat.st_size;
+	}
+	closedir(dir);
+	
+	qsort(entries, entry_count, sizeof(enc_result_cache_entry_t), enc_result_cache_compare_entries);
+	for(size_t i = 0; i < entry_count && total_size > cache->max_size; i++){
+		snprintf(path, sizeof(path), "%s/%s", cache->cache_dir, entries[i].name);
+		enc_debug("result cache: evicting %s (%ld bytes)\n", path, entries[i].size);
+		if (unlink(path) == 0)
+			total_size -= entries[i].size;
+	}
+	
+	free(entries);
+}
+
+/**
+ * Stores the finished `output_file` in the cache. It's copied (or linked) to a temporary name first and
+ * then renamed so concurrent jobs never see a half written entry.
+ */
+bool enc_result_cache_store(enc_result_cache_t *cache, const char *output_file){
+	char temp_file[PATH_MAX + 32];
+	snprintf(temp_file, sizeof(temp_file), "%s.%d.%p", cache->entry_file, (int)getpid(), (void*)cache);
+	
+	if ( ! (cache->link_output && link(output_file, temp_file) == 0) && ! enc_result_cache_copy(output_file, temp_file) )
+		return false;
+	
+	if (rename(temp_file, cache->entry_file) != 0){
+		perror(cache->entry_file);
+		unlink(temp_file);
+		return false;
+	}
+	
+	enc_result_cache_touch(cache->entry_file);
+	enc_result_cache_evict(cache);
+	return true;
+}
+
+/**
+ * The output file may be a hardlink to an entry of the result cache. Replace it instead of overwriting the
+ * cached file.
+ */
+void enc_result_cache_unlink_output(const char *output_file){
+	struct stat output_stat;
+	if (stat(output_file, &output_stat) == 0 && S_ISREG(output_stat.st_mode) && output_stat.st_nlink > 1)
+		unlink(output_file);
+}
+
+
+//
+// ASF header stuff
+//
+
+/**
+ * Stream information read from the header objects of ASF (WMV and WMA) files. libav often reports a
+ * bitrate of 0 for the streams of our archive files, the header objects usually know better.
+ */
+typedef struct {
+	// Bits per second from the extended stream properties or the waveformatex, 0 if unknown
+	int bit_rate;
+	// Calculated from the average time per frame of the extended stream properties, 0/0 if unknown
+	AVRational frame_rate;
+} enc_asf_stream_info_t;
+
+/**
+ * Reads the header objects of an ASF file with libasf and stores the information of each stream in
+ * `stream_infos` (indexed like the streams of the format context). libavformat uses the ASF stream number
+ * as stream id so the streams can be matched without decoding anything. Returns `false` if the header
+ * can't be read.
+ */
+bool enc_asf_read_header(const char *filename, const AVFormatContext *format_context_ptr, enc_asf_stream_info_t *stream_infos){
+	for(int i = 0; i < format_context_ptr->nb_streams; i++)
+		stream_infos[i] = (enc_asf_stream_info_t){ .bit_rate = 0, .frame_rate = (AVRational){ 0, 0 } };
+	
+	asf_file_t *file_ptr = asf_open_file(filename);
+	if (file_ptr == NULL){
+		fprintf(stderr, "libasf: failed to open %s\n", filename);
+		return false;
+	}
+	if (asf_init(file_ptr) < 0){
+		fprintf(stderr, "libasf: failed to read the header of %s\n", filename);
+		asf_close(file_ptr);
+		return false;
+	}
+	
+	// libasf returns the highest stream number in use, stream numbers start at 1
+	int stream_count = asf_get_stream_count(file_ptr);
+	for(int stream_num = 1; stream_num <= stream_count; stream_num++){
+		asf_stream_t *stream_ptr = asf_get_stream(file_ptr, stream_num);
+		if ( stream_ptr == NULL || (stream_ptr->flags & ASF_STREAM_FLAG_AVAILABLE) != ASF_STREAM_FLAG_AVAILABLE )
+			continue;
+		
+		int index = -1;
+		for(int i = 0; i < format_context_ptr->nb_streams; i++){
+			if (format_context_ptr->streams[i]->id == stream_num)
+				index = i;
+		}
+		if (index == -1)
+			continue;
+		
+		enc_asf_stream_info_t *info_ptr = &stream_infos[index];
+		if ( (stream_ptr->flags & ASF_STREAM_FLAG_EXTENDED) == ASF_STREAM_FLAG_EXTENDED ){
+			asf_stream_extended_properties_t *ext_ptr = stream_ptr->extended_properties;
+			info_ptr->bit_rate = ext_ptr->data_bitrate;
+			// The average time per frame is given in 100ns units
+			if (ext_ptr->avg_time_per_frame > 0)
+				info_ptr->frame_rate = (AVRational){ .num = 10000000, .den = ext_ptr->avg_time_per_frame };
+		}
+		if (info_ptr->bit_rate == 0 && stream_ptr->type == ASF_STREAM_TYPE_AUDIO && stream_ptr->properties != NULL){
+			asf_waveformatex_t *audio_ptr = stream_ptr->properties;
+			info_ptr->bit_rate = audio_ptr->nAvgBytesPerSec * 8;
+		}
+		
+		enc_debug("asf stream %d (index %d): type %d, bitrate %d, frame rate %d/%d\n", stream_num, index,
+			stream_ptr->type, info_ptr->bit_rate, info_ptr->frame_rate.num, info_ptr->frame_rate.den);
+	}
+	
+	asf_close(file_ptr);
+	return true;
+}
+
+
+//
+//  libavformat stuff
+//
+
+// Probe limits for ASF files with a readable header. The header objects already describe every stream, the
+// probe only has to fill in what the decoders need (e.g. the pixel format).
+#define ENC_ASF_PROBE_SIZE (256 * 1024)
+#define ENC_ASF_PROBE_DURATION 0.5
+
+/**
+ * Opens the specified file and returns a format context pointer in `format_context_dptr`.
+ * The file is scanned for additional information. This is necessary since DV files do not
+ * contain much of a header. We need to scan DV files in order to get an proper audio and
+ * video stream.
+ * 
+ * The scan reads at most `probe_size` bytes and `probe_duration` seconds (if not 0). If `probe_cache` is
+ * not `NULL` and contains an entry for the file the scan is skipped altogether.
+ * 
+ * If `asf_stream_infos_dptr` is not `NULL` and the file is an ASF file its header objects are read with
+ * libasf before the scan. In that case the scan is limited to `ENC_ASF_PROBE_SIZE` bytes and
+ * `ENC_ASF_PROBE_DURATION` seconds (unless the limits are given explicitly) and the stream information is returned in `asf_stream_infos_dptr` (one
+ * entry per stream, free it with `free()`). It's set to `NULL` for other files.
+ * 
+ * Files without any streams are rejected, there's nothing to encode in them.
+ */
+bool enc_avformat_open_file(const char *filename, int64_t probe_size, float probe_duration,
+	enc_probe_cache_t *probe_cache, AVFormatContext **format_context_dptr, enc_asf_stream_info_t **asf_stream_infos_dptr
+){
+	int error = 0;
+	
+	if (asf_stream_infos_dptr != NULL)
+		*asf_stream_infos_dptr = NULL;
+	
+	*format_context_dptr = avformat_alloc_context();
+	if (*format_context_dptr == NULL){
+		fprintf(stderr, "avformat_alloc_context: failed to allocate format context\n");
+		return false;
+	}
+	if (probe_size > 0)
+		(*format_context_dptr)->probesize = probe_size;
+	if (probe_duration > 0)
+		(*format_context_dptr)->max_analyze_duration = probe_duration * AV_TIME_BASE;
+	
+	error = avformat_open_input(format_context_dptr, filename, NULL, NULL);
+	if (error != 0){
+		enc_av_perror("avformat_open_input", error);
+		return false;
+	}
+	
+	// The ASF demuxer creates all streams from the header objects, so they can be matched with the libasf
+	// streams right away
+	AVFormatContext *format_context_ptr = *format_context_dptr;
+	if ( asf_stream_infos_dptr != NULL && format_context_ptr->nb_streams > 0 && strcmp(format_context_ptr->iformat->name, "asf") == 0 ){
+		enc_asf_stream_info_t *stream_infos = malloc(sizeof(enc_asf_stream_info_t) * format_context_ptr->nb_streams);
+		if ( stream_infos != NULL && enc_asf_read_header(filename, format_context_ptr, stream_infos) ){
+			*asf_stream_infos_dptr = stream_infos;
+			if (probe_size <= 0 && format_context_ptr->probesize > ENC_ASF_PROBE_SIZE)
+				format_context_ptr->probesize = ENC_ASF_PROBE_SIZE;
+			if (probe_duration <= 0 && format_context_ptr->max_analyze_duration > ENC_ASF_PROBE_DURATION * AV_TIME_BASE)
+				format_context_ptr->max_analyze_duration = ENC_ASF_PROBE_DURATION * AV_TIME_BASE;
+			enc_debug("asf header read, probing only %u bytes\n", format_context_ptr->probesize);
+		} else {
+			free(stream_infos);
+		}
+	}
+	
+	if ( probe_cache != NULL && enc_probe_cache_load(probe_cache, format_context_ptr) ){
+		enc_debug("probe cache: using %s\n", probe_cache->entry_file);
+	} else {
+		error = av_find_stream_info(format_context_ptr);
+		if (error < 0){
+			enc_av_perror("av_find_stream_info", error);
+			return false;
+		}
+	}
+	
+	if (format_context_ptr->nb_streams == 0){
+		fprintf(stderr, "%s: no streams found\n", filename);
+		return false;
+	}
+	
+	return true;
+}
+
+/**
+ * If the video stream index is `-1` this function selects the video stream with the highest bitrate. If no
+ * audio stream is given (`audio_stream_count` is 0) the audio stream with the highest bitrate is selected.
+ * With `all_audio_streams` every audio stream is selected. If `asf_stream_infos` is not `NULL` the bitrates
+ * from the ASF header are used instead of the ones reported by the codec.
+ * 
+ * The purpose of this function is to autodetect the best streams in the old WMV archive files. They often
+ * contain many streams and manually searching for the indecies an be a tedious task.
+ */
+bool enc_avformat_select_streams(const AVFormatContext *format_context_ptr, const enc_asf_stream_info_t *asf_stream_infos,
+	int *video_stream_index, int *audio_stream_indices, int *audio_stream_count, bool all_audio_streams
+){
+	if (format_context_ptr->nb_streams == 0){
+		fprintf(stderr, "Could not find a proper video or audio stream, sorry.\nThe input has no streams.\n");
+		return false;
+	}
+	
+	int bitrates[format_context_ptr->nb_streams];
+	for(int i = 0; i < format_context_ptr->nb_streams; i++){
+		bitrates[i] = format_context_ptr->streams[i]->codec->bit_rate;
+		if (asf_stream_infos != NULL && asf_stream_infos[i].bit_rate > 0)
+			bitrates[i] = asf_stream_infos[i].bit_rate;
+	}
+	
+	if (*video_stream_index == -1){
+		int selected_bitrate = -1;
+		for(int i = 0; i < format_context_ptr->nb_streams; i++){
+			AVCodecContext *codec_context_ptr = format_context_ptr->streams[i]->codec;
+			if ( codec_context_ptr->codec_type == AVMEDIA_TYPE_VIDEO && bitrates[i] > selected_bitrate ){
+				*video_stream_index = i;
+				selected_bitrate = bitrates[i];
+			}
+		}
+	}
+	
+	if (all_audio_streams){
+		*audio_stream_count = 0;
+		for(int i = 0; i < format_context_ptr->nb_streams && *audio_stream_count < ENC_MAX_AUDIO_TRACKS; i++){
+			if (format_context_ptr->streams[i]->codec->codec_type == AVMEDIA_TYPE_AUDIO)
+				audio_stream_indices[(*audio_stream_count)++] = i;
+		}
+	} else if (*audio_stream_count == 0){
+		int selected_bitrate = -1;
+		for(int i = 0; i < format_context_ptr->nb_streams; i++){
+			AVCodecContext *codec_context_ptr = format_context_ptr->streams[i]->codec;
+			if ( codec_context_ptr->codec_type == AVMEDIA_TYPE_AUDIO && bitrates[i] > selected_bitrate ){
+				audio_stream_indices[0] = i;
+				*audio_stream_count = 1;
+				selected_bitrate = bitrates[i];
+			}
+		}
+	}
+	
+	if (*video_stream_index < 0 || *video_stream_index >= format_context_ptr->nb_streams || *audio_stream_count == 0){
+		fprintf(stderr, "Could not find a proper video or audio stream, sorry.\nVideo stream index: %d, audio steams: %d\n",
+			*video_stream_index, *audio_stream_count);
+		return false;
+	}
+	
+	for(int i = 0; i < *audio_stream_count; i++){
+		if (audio_stream_indices[i] < 0 || audio_stream_indices[i] >= format_context_ptr->nb_streams){
+			fprintf(stderr, "Audio stream %d does not exist, sorry.\n", audio_stream_indices[i]);
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+
+//
+// Follow mode stuff (encoding files that are still recorded)
+//
+
+typedef struct {
+	float timeout;
+	const char *sentinel_file;
+	// Time of the last successful read
+	struct timespec last_data;
+	// The sentinel appeared, one last read is done to get the data written before it
+	bool sentinel_seen;
+} enc_follow_t;
+
+void enc_follow_init(float timeout, const char *sentinel_file, enc_follow_t *follow){
+	follow->timeout = timeout;
+	follow->sentinel_file = sentinel_file;
+	follow->sentinel_seen = false;
+	clock_gettime(CLOCK_MONOTONIC, &follow->last_data);
+}
+
+/**
+ * Works like `av_read_frame()` but if `follow` is not `NULL` a read that hits the end of the file waits for
+ * the file to grow. The read position is reset to the start of the failed packet so a packet that was only
+ * partially written is read again as a whole. This works for DV and other formats that read their packets
+ * straight from the file.
+ * 
+ * Returns the error of the last read if the file did not grow within the timeout or the sentinel file
+ * exists (after one final read). Errors that are not caused by the end of the file (corrupt data, I/O
+ * errors) are returned right away.
+ */
+int enc_follow_read_frame(AVFormatContext *format_context_ptr, AVPacket *packet_ptr, enc_follow_t *follow){
+	if (follow == NULL)
+		return av_read_frame(format_context_ptr, packet_ptr);
+	
+	while(true){
+		int64_t position = avio_tell(format_context_ptr->pb);
+		int error = av_read_frame(format_context_ptr, packet_ptr);
+		if (error >= 0){
+			clock_gettime(CLOCK_MONOTONIC, &follow->last_data);
+			return error;
+		}
+		
+		// A packet cut off at the end of the file may be reported as any error, the end of file flag tells
+		// it apart from real errors
+		if ( follow->sentinel_seen || ! (error == AVERROR_EOF || format_context_ptr->pb->eof_reached) )
+			return error;
+		
+		if (follow->sentinel_file != NULL && access(follow->sentinel_file, F_OK) == 0) {
+			enc_debug("follow: sentinel %s found, reading the remaining data\n", follow->sentinel_file);
+			follow->sentinel_seen = true;
+		} else {
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			double idle = (now.tv_sec - follow->last_data.tv_sec) + (now.tv_nsec - follow->last_data.tv_nsec) / 1000000000.0;
+			if (idle > follow->timeout){
+				enc_debug("follow: no new data for %.1f s, stopping\n", idle);
+				return error;
+			}
+			
+			struct timespec wait = { .tv_sec = 0, .tv_nsec = 250 * 1000000 };
+			nanosleep(&wait, NULL);
+		}
+		
+		// Go back to the start of the incomplete packet and forget that we hit the end of the file
+		if (avio_seek(format_context_ptr->pb, position, SEEK_SET) < 0)
+			return error;
+		format_context_ptr->pb->eof_reached = 0;
+	}
+}
+
+
+//
+// Governor stuff (CPU quota, I/O limits and pausing, for running next to other services)
+//
+
+// CPUs the encoders may use, the affinity mask limited by the cgroup CPU quota. Set by `enc_init()`.
+static int enc_cpus = 0;
+static double enc_cpu_quota = 0;
+// Set by `enc_pause()`, usually from a signal handler. Pauses all sessions of the process.
+static volatile sig_atomic_t enc_paused = 0;
+
+/**
+ * Reads the CPU quota of a cgroup v2 directory (relative to /sys/fs/cgroup). The cpu.max file contains
+ * "max <period>" or "<quota> <period>". Returns the quota in CPUs or 0 if there's no limit.
+ */
+static double enc_governor_cgroup2_quota(const char *dir){
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "/sys/fs/cgroup%s/cpu.max", dir);
+	FILE *file = fopen(path, "r");
+	if (file == NULL)
+		return 0;
+	
+	char quota[32];
+	long period = 0;
+	int fields = fscanf(file, "%31s %ld", quota, &period);
+	fclose(file);
+	if (fields != 2 || strcmp(quota, "max") == 0 || period <= 0)
+		return 0;
+	return strtod(quota, NULL) / period;
+}
+
+/**
+ * Returns the CPU quota of the cgroup we run in (in CPUs) or 0 if there's none. For cgroup v2 the lowest
+ * limit on the way up to the root counts, for cgroup v1 only the controller mounted for us (containers
+ * see their own cgroup there).
+ */
+static double enc_governor_cgroup_quota(){
+	double quota = 0;
+	
+	char line[PATH_MAX];
+	FILE *file = fopen("/proc/self/cgroup", "r");
+	while (file != NULL && fgets(line, sizeof(line), file) != NULL){
+		if (strncmp(line, "0::", 3) != 0)
+			continue;
+		
+		char *dir = line + 3;
+		dir[strcspn(dir, "\n")] = '\0';
+		while (true){
+			double dir_quota = enc_governor_cgroup2_quota(dir);
+			if (dir_quota > 0 && (quota == 0 || dir_quota < quota))
+				quota = dir_quota;
+			
+			char *slash = strrchr(dir, '/');
+			if (slash == NULL || slash == dir)
+				break;
+			*slash = '\0';
+		}
+	}
+	if (file != NULL)
+		fclose(file);
+	if (quota > 0)
+		return quota;
+	
+	const char *v1_dirs[] = { "/sys/fs/cgroup/cpu", "/sys/fs/cgroup/cpu,cpuacct" };
+	for(size_t i = 0; i < sizeof(v1_dirs) / sizeof(v1_dirs[0]); i++){
+		char path[PATH_MAX];
+		long cfs_quota = -1, cfs_period = 0;
+		snprintf(path, sizeof(path), "%s/cpu.cfs_quota_us", v1_dirs[i]);
+		if ( (file = fopen(path, "r")) == NULL )
+			continue;
+		if (fscanf(file, "%ld", &cfs_quota) != 1)
+			cfs_quota = -1;
+		fclose(file);
+		
+		snprintf(path, sizeof(path), "%s/cpu.cfs_period_us", v1_dirs[i]);
+		if ( (file = fopen(path, "r")) == NULL )
+			continue;
+		if (fscanf(file, "%ld", &cfs_period) != 1)
+			cfs_period = 0;
+		fclose(file);
+		
+		if (cfs_quota > 0 && cfs_period > 0)
+			return (double)cfs_quota / cfs_period;
+	}
+	
+	return 0;
+}
+
+/**
+ * Determines the CPUs we may use: the CPUs of the affinity mask, limited by the cgroup CPU quota (rounded
+ * up, a quota of 2.5 CPUs can keep 3 threads busy most of the time).
+ */
+static void enc_governor_init(){
+	cpu_set_t cpu_set;
+	enc_cpus = (sched_getaffinity(0, sizeof(cpu_set), &cpu_set) == 0) ? CPU_COUNT(&cpu_set) : sysconf(_SC_NPROCESSORS_ONLN);
+	if (enc_cpus < 1)
+		enc_cpus = 1;
+	
+	enc_cpu_quota = enc_governor_cgroup_quota();
+	if (enc_cpu_quota > 0 && ceil(enc_cpu_quota) < enc_cpus)
+		enc_cpus = ceil(enc_cpu_quota);
+	enc_debug("governor: %d CPUs usable (cgroup quota: %.2f CPUs)\n", enc_cpus, enc_cpu_quota);
+}
+
+/**
+ * Number of CPUs the encoders should use. x264 and the estimate size their threads with it instead of the
+ * CPUs of the host. A thread pinned to fewer CPUs (see `enc_affinity_pin()`) gets that number.
+ */
+int enc_cpu_count(){
+	int cpus = (enc_cpus > 0) ? enc_cpus : 1;
+	cpu_set_t cpu_set;
+	if (sched_getaffinity(0, sizeof(cpu_set), &cpu_set) == 0 && CPU_COUNT(&cpu_set) > 0 && CPU_COUNT(&cpu_set) < cpus)
+		cpus = CPU_COUNT(&cpu_set);
+	return cpus;
+}
+
+/**
+ * Pauses or resumes all sessions. Only sets a flag, so it's safe to call from a signal handler. Paused
+ * sessions stop reading input, the encoder state is kept as it is.
+ */
+void enc_pause(bool paused){
+	enc_paused = paused;
+}
+
+/**
+ * Average bandwidth limit, `rate` in bytes per second (0 = no limit). Whenever more bytes were transferred
+ * than the limit allows since `start` the caller sleeps until the limit is met again.
+ */
+typedef struct {
+	double rate;
+	struct timespec start;
+	int64_t bytes;
+	double throttled_sec;
+} enc_io_limit_t;
+
+void enc_io_limit_reset(enc_io_limit_t *limit){
+	clock_gettime(CLOCK_MONOTONIC, &limit->start);
+	limit->bytes = 0;
+}
+
+void enc_io_limit_init(float mib_per_sec, enc_io_limit_t *limit){
+	*limit = (enc_io_limit_t){ .rate = mib_per_sec * 1024.0 * 1024.0 };
+	enc_io_limit_reset(limit);
+}
+
+void enc_io_limit_account(enc_io_limit_t *limit, int64_t bytes){
+	if (limit == NULL || limit->rate <= 0)
+		return;
+	
+	limit->bytes += bytes;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double elapsed = (now.tv_sec - limit->start.tv_sec) + (now.tv_nsec - limit->start.tv_nsec) / 1000000000.0;
+	double ahead = limit->bytes / limit->rate - elapsed;
+	if (ahead <= 0.001)
+		return;
+	
+	struct timespec wait = { .tv_sec = (time_t)ahead, .tv_nsec = (ahead - (time_t)ahead) * 1000000000 };
+	nanosleep(&wait, NULL);
+	limit->throttled_sec += ahead;
+}
+
+/**
+ * Per session state of the governor: the limits of the input reads and the output writes and the time spent
+ * paused.
+ */
+typedef struct {
+	enc_io_limit_t read, write;
+	double paused_sec;
+} enc_governor_t;
+
+void enc_governor_open(float io_limit, enc_governor_t *gov){
+	enc_io_limit_init(io_limit, &gov->read);
+	enc_io_limit_init(io_limit, &gov->write);
+	gov->paused_sec = 0;
+}
+
+/**
+ * Blocks as long as the sessions are paused. Returns `true` if it did, the time spent there doesn't count
+ * for the I/O limits.
+ */
+bool enc_governor_wait_while_paused(enc_governor_t *gov){
+	if (!enc_paused)
+		return false;
+	
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	printf("\nPaused, send SIGUSR2 to resume\n");
+	fflush(stdout);
+	while (enc_paused){
+		struct timespec wait = { .tv_sec = 0, .tv_nsec = 100 * 1000000 };
+		nanosleep(&wait, NULL);
+	}
+	
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double paused = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1000000000.0;
+	gov->paused_sec += paused;
+	printf("Resumed after %.1f s\n", paused);
+	enc_io_limit_reset(&gov->read);
+	enc_io_limit_reset(&gov->write);
+	return true;
+}
+
+void enc_governor_report(enc_governor_t *gov){
+	if (gov->paused_sec == 0 && gov->read.rate <= 0 && enc_cpu_quota == 0)
+		return;
+	
+	printf("Governor: %d CPUs (cgroup quota %.2f), paused %.1f s, reads throttled %.1f s, writes throttled %.1f s\n",
+		enc_cpus, enc_cpu_quota, gov->paused_sec, gov->read.throttled_sec, gov->write.throttled_sec);
+}
+
+
+//
+// Affinity stuff (keeping a session on one NUMA node or L3 cache domain)
+//
+
+#define ENC_AFFINITY_MAX_DOMAINS 64
+// Memory policy of set_mempolicy() (from linux/mempolicy.h): prefer the given node, fall back if it's full
+#define ENC_MPOL_DEFAULT 0
+#define ENC_MPOL_PREFERRED 1
+
+/**
+ * The CPU groups a session can be pinned to. NUMA nodes if there are several of them, otherwise the groups of
+ * CPUs sharing an L3 cache. `nodes` is the NUMA node of each domain (only if `numa` is set).
+ */
+typedef struct {
+	int count;
+	bool numa;
+	int nodes[ENC_AFFINITY_MAX_DOMAINS];
+	cpu_set_t cpus[ENC_AFFINITY_MAX_DOMAINS];
+} enc_affinity_domains_t;
+
+/**
+ * The domain a session is pinned to. `lock_fd` holds a lock on the domain so concurrent jobs (in this or
+ * other processes) pick other domains. The affinity of the thread before the session is restored on close.
+ */
+typedef struct {
+	bool pinned, numa;
+	int domain, node;
+	int lock_fd;
+	cpu_set_t previous_cpus;
+} enc_affinity_t;
+
+/**
+ * Reads a CPU list from sysfs (e.g. "0-7,16-23"). Returns `false` if the file doesn't exist or is empty.
+ */
+static bool enc_affinity_read_cpulist(const char *path, cpu_set_t *cpus){
+	CPU_ZERO(cpus);
+	FILE *file = fopen(path, "r");
+	if (file == NULL)
+		return false;
+	
+	char list[4096];
+	bool read = (fgets(list, sizeof(list), file) != NULL);
+	fclose(file);
+	if (!read)
+		return false;
+	
+	char *range_ptr = list, *end_ptr = NULL;
+	while (true){
+		long first = strtol(range_ptr, &end_ptr, 10);
+		if (end_ptr == range_ptr)
+			break;
+		long last = first;
+		if (*end_ptr == '-')
+			last = strtol(end_ptr + 1, &end_ptr, 10);
+		for(long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+			CPU_SET(cpu, cpus);
+		if (*end_ptr != ',')
+			break;
+		range_ptr = end_ptr + 1;
+	}
+	
+	return CPU_COUNT(cpus) > 0;
+}
+
+/**
+ * Adds a domain unless it's empty (after removing the CPUs we're not allowed to use) or already known.
+ */
+static void enc_affinity_add_domain(enc_affinity_domains_t *domains, cpu_set_t *cpus, const cpu_set_t *allowed_cpus, int node){
+	CPU_AND(cpus, cpus, allowed_cpus);
+	if (CPU_COUNT(cpus) == 0 || domains->count == ENC_AFFINITY_MAX_DOMAINS)
+		return;
+	for(int i = 0; i < domains->count; i++){
+		if ( CPU_EQUAL(cpus, &domains->cpus[i]) )
+			return;
+	}
+	
+	domains->nodes[domains->count] = node;
+	domains->cpus[domains->count] = *cpus;
+	domains->count++;
+}
+
+/**
+ * Reads the NUMA nodes and L3 cache domains from sysfs, limited to the CPUs of `allowed_cpus`.
+ */
+static void enc_affinity_read_domains(const cpu_set_t *allowed_cpus, enc_affinity_domains_t *domains){
+	char path[PATH_MAX];
+	cpu_set_t cpus;
+	domains->count = 0;
+	
+	// NUMA nodes in the order of their numbers, nodes without CPUs (only memory) are skipped
+	for(int node = 0; node < 1024 && domains->count < ENC_AFFINITY_MAX_DOMAINS; node++){
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+		if ( enc_affinity_read_cpulist(path, &cpus) )
+			enc_affinity_add_domain(domains, &cpus, allowed_cpus, node);
+	}
+	domains->numa = (domains->count > 1);
+	if (domains->numa)
+		return;
+	
+	// One node (or no NUMA support): the CPUs sharing an L3 cache
+	domains->count = 0;
+	for(int cpu = 0; cpu < CPU_SETSIZE; cpu++){
+		if ( ! CPU_ISSET(cpu, allowed_cpus) )
+			continue;
+		for(int index = 0; index < 8; index++){
+			int level = 0;
+			snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/level", cpu, index);
+			FILE *file = fopen(path, "r");
+			if (file == NULL)
+				break;
+			if (fscanf(file, "%d", &level) != 1)
+				level = 0;
+			fclose(file);
+			
+			snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list", cpu, index);
+			if ( level == 3 && enc_affinity_read_cpulist(path, &cpus) )
+				enc_affinity_add_domain(domains, &cpus, allowed_cpus, -1);
+		}
+	}
+}
+
+/**
+ * Pins the calling thread to a domain, `spec` is its number or "auto". All threads started afterwards (the
+ * x264 threads) inherit the affinity. On a NUMA node the memory allocated afterwards prefers that node, so
+ * the frame buffers of the session are local.
+ * 
+ * "auto" takes the first domain no other session holds, starting at a domain picked by the process ID. That
+ * spreads concurrent jobs across the domains. If all are taken it shares the domain it started with.
+ * Returns `false` for an invalid domain number.
+ */
+bool enc_affinity_pin(const char *spec, enc_affinity_t *aff){
+	aff->pinned = false;
+	aff->lock_fd = -1;
+	if ( sched_getaffinity(0, sizeof(aff->previous_cpus), &aff->previous_cpus) != 0 ){
+		perror("affinity: sched_getaffinity");
+		return true;
+	}
+	
+	enc_affinity_domains_t domains;
+	enc_affinity_read_domains(&aff->previous_cpus, &domains);
+	if (domains.count < 2){
+		printf("Affinity: only one NUMA node and L3 cache domain, not pinning\n");
+		return true;
+	}
+	
+	if (strcmp(spec, "auto") == 0) {
+		const char *lock_dir = (access("/dev/shm", W_OK) == 0) ? "/dev/shm" : "/tmp";
+		int start = getpid() % domains.count;
+		aff->domain = start;
+		for(int i = 0; i < domains.count; i++){
+			int domain = (start + i) % domains.count;
+			char lock_file[PATH_MAX];
+			snprintf(lock_file, sizeof(lock_file), "%s/av_encode-%s-%d.lock", lock_dir, domains.numa ? "node" : "l3", domain);
+			int fd = open(lock_file, O_RDWR | O_CREAT, 0666);
+			if (fd < 0)
+				continue;
+			if ( flock(fd, LOCK_EX | LOCK_NB) == 0 ){
+				aff->domain = domain;
+				aff->lock_fd = fd;
+				break;
+			}
+			close(fd);
+		}
+	} else {
+		char *end_ptr = NULL;
+		aff->domain = strtol(spec, &end_ptr, 10);
+		if (end_ptr == spec || *end_ptr != '\0' || aff->domain < 0 || aff->domain >= domains.count){
+			fprintf(stderr, "affinity: invalid domain %s, there are %d %s\n", spec, domains.count, domains.numa ? "NUMA nodes" : "L3 cache domains");
+			return false;
+		}
+	}
+	
+	if ( sched_setaffinity(0, sizeof(domains.cpus[aff->domain]), &domains.cpus[aff->domain]) != 0 ){
+		perror("affinity: sched_setaffinity");
+		if (aff->lock_fd >= 0)
+			close(aff->lock_fd);
+		aff->lock_fd = -1;
+		return true;
+	}
+	aff->pinned = true;
+	aff->numa = domains.numa;
+	aff->node = domains.nodes[aff->domain];
+	
+	if (aff->numa){
+		unsigned long node_mask[1024 / (8 * sizeof(unsigned long))] = { 0 };
+		node_mask[aff->node / (8 * sizeof(unsigned long))] |= 1UL << (aff->node % (8 * sizeof(unsigned long)));
+		if ( syscall(SYS_set_mempolicy, ENC_MPOL_PREFERRED, node_mask, sizeof(node_mask) * 8) != 0 )
+			perror("affinity: set_mempolicy");
+	}
+	
+	printf("Affinity: pinned to %s %d (%d CPUs)%s\n", aff->numa ? "NUMA node" : "L3 cache domain", aff->numa ? aff->node : aff->domain,
+		CPU_COUNT(&domains.cpus[aff->domain]), (aff->lock_fd < 0 && strcmp(spec, "auto") == 0) ? ", shared with another job" : "");
+	return true;
+}
+
+/**
+ * Restores the affinity and memory policy the thread had before and releases the domain.
+ */
+void enc_affinity_unpin(enc_affinity_t *aff){
+	if (aff->pinned){
+		sched_setaffinity(0, sizeof(aff->previous_cpus), &aff->previous_cpus);
+		if (aff->numa)
+			syscall(SYS_set_mempolicy, ENC_MPOL_DEFAULT, NULL, 0);
+	}
+	if (aff->lock_fd >= 0)
+		close(aff->lock_fd);
+	aff->pinned = false;
+	aff->lock_fd = -1;
+}
+
+
+//
+// libavcodec stuff
+//
+
+/**
+ * Searches and opens a codec for the specified stream.
+ */
+bool enc_avcodec_open(AVFormatContext *format_context_ptr, int stream_index, enum AVMediaType required_stream_type, AVCodecContext **codec_context_dptr, AVCodec **codec_dptr){
+	enum AVMediaType stream_type = format_context_ptr->streams[stream_index]->codec->codec_type;
+	if (required_stream_type != stream_type){
+		char *type_names[] = {"unknown", "video", "audio", "data", "subtitle", "attachment", "nb"};
+		fprintf(stderr, "Tried to use steam %d as %s steam but it is an %s steam!\n",
+			stream_index, type_names[required_stream_type+1], type_names[stream_type+1]);
+		return false;
+	}
+	
+	*codec_context_dptr = format_context_ptr->streams[stream_index]->codec;
+	*codec_dptr = avcodec_find_decoder((*codec_context_dptr)->codec_id);
+	if (*codec_dptr == NULL){
+		fprintf(stderr, "Found no matching codec for stream %d!\n", stream_index);
+		return false;
+	}
+	
+	if ( avcodec_open(*codec_context_dptr, *codec_dptr) != 0 ){
+		fprintf(stderr, "Initialization of codec %s failed!\n", (*codec_dptr)->name);
+		return false;
+	}
+	
+	return true;
+}
+
+
+//
+// Frame pool stuff (decoder buffers shared with the filter graph)
+//
+
+// Lines and planes of pooled frames start at multiples of this (cache line size, enough for AVX)
+#define ENC_FRAME_POOL_ALIGN 64
+// Buffers of at least this size are backed by transparent huge pages if enabled
+#define ENC_FRAME_POOL_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+typedef struct enc_frame_pool enc_frame_pool_t;
+
+/**
+ * One frame buffer of the pool. `refs` counts the decoder (between `get_buffer()` and `release_buffer()`)
+ * and every filter buffer that references the frame. At 0 the buffer goes back into the pool.
+ */
+typedef struct enc_frame_buffer {
+	enc_frame_pool_t *pool;
+	uint8_t *data_ptr;
+	size_t size;
+	int refs;
+	struct enc_frame_buffer *next;
+} enc_frame_buffer_t;
+
+/**
+ * Decoded frames are put into buffers of this pool instead of the default allocator of libavcodec. Buffers
+ * are allocated as needed and reused afterwards, the buffer size follows the stream dimensions. The decoder
+ * threads and the filter graph release buffers so everything is protected by the mutex.
+ */
+struct enc_frame_pool {
+	pthread_mutex_t mutex;
+	bool huge_pages;
+	size_t buffer_size;
+	enc_frame_buffer_t *free_buffers;
+	int buffers_in_use;
+	// Set by `enc_frame_pool_free()`, the pool is freed when the last buffer comes back
+	bool closed;
+};
+
+enc_frame_pool_t *enc_frame_pool_new(bool huge_pages){
+	enc_frame_pool_t *pool = calloc(1, sizeof(enc_frame_pool_t));
+	if (pool == NULL)
+		return NULL;
+	pthread_mutex_init(&pool->mutex, NULL);
+	pool->huge_pages = huge_pages;
+	return pool;
+}
+
+static void enc_frame_pool_destroy(enc_frame_pool_t *pool){
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool);
+}
+
+static void enc_frame_pool_free_buffers(enc_frame_pool_t *pool){
+	while (pool->free_buffers != NULL){
+		enc_frame_buffer_t *buffer = pool->free_buffers;
+		pool->free_buffers = buffer->next;
+		free(buffer->data_ptr);
+		free(buffer);
+	}
+}
+
+/**
+ * Frees all unused buffers. Buffers still referenced (e.g. by a filter graph that is not yet freed) are freed
+ * when they are released, the pool itself after the last one.
+ */
+void enc_frame_pool_free(enc_frame_pool_t *pool){
+	if (pool == NULL)
+		return;
+	
+	pthread_mutex_lock(&pool->mutex);
+	enc_frame_pool_free_buffers(pool);
+	pool->closed = true;
+	bool unused = (pool->buffers_in_use == 0);
+	pthread_mutex_unlock(&pool->mutex);
+	
+	if (unused)
+		enc_frame_pool_destroy(pool);
+}
+
+/**
+ * Returns an unused buffer of `size` bytes. If the size changed (e.g. the next input file has other
+ * dimensions) the buffers of the old size are dropped.
+ */
+static enc_frame_buffer_t *enc_frame_pool_take(enc_frame_pool_t *pool, size_t size){
+	pthread_mutex_lock(&pool->mutex);
+	if (size != pool->buffer_size){
+		enc_frame_pool_free_buffers(pool);
+		pool->buffer_size = size;
+	}
+	
+	enc_frame_buffer_t *buffer = pool->free_buffers;
+	if (buffer != NULL)
+		pool->free_buffers = buffer->next;
+	pool->buffers_in_use++;
+	pthread_mutex_unlock(&pool->mutex);
+	
+	if (buffer == NULL){
+		buffer = calloc(1, sizeof(enc_frame_buffer_t));
+		size_t alignment = ENC_FRAME_POOL_ALIGN, allocated_size = size;
+		if (pool->huge_pages && size >= ENC_FRAME_POOL_HUGE_PAGE_SIZE){
+			alignment = ENC_FRAME_POOL_HUGE_PAGE_SIZE;
+			allocated_size = FFALIGN(size, ENC_FRAME_POOL_HUGE_PAGE_SIZE);
+		}
+		
+		void *data_ptr = NULL;
+		if ( buffer == NULL || posix_memalign(&data_ptr, alignment, allocated_size) != 0 ){
+			fprintf(stderr, "frame pool: failed to allocate a %zu byte buffer\n", size);
+			free(buffer);
+			pthread_mutex_lock(&pool->mutex);
+			pool->buffers_in_use--;
+			pthread_mutex_unlock(&pool->mutex);
+			return NULL;
+		}
+		
+#ifdef MADV_HUGEPAGE
+		// Only a hint, the kernel might not support it or have it disabled
+		if (alignment == ENC_FRAME_POOL_HUGE_PAGE_SIZE)
+			madvise(data_ptr, allocated_size, MADV_HUGEPAGE);
+#endif
+		
+		buffer->pool = pool;
+		buffer->data_ptr = data_ptr;
+		buffer->size = size;
+	}
+	
+	buffer->refs = 1;
+	return buffer;
+}
+
+static void enc_frame_pool_ref(enc_frame_buffer_t *buffer){
+	pthread_mutex_lock(&buffer->pool->mutex);
+	buffer->refs++;
+	pthread_mutex_unlock(&buffer->pool->mutex);
+}
+
+/**
+ * Drops one reference of the buffer. The last one puts it back into the pool or frees it if it's no longer
+ * needed (size changed or pool closed).
+ */
+static void enc_frame_pool_unref(enc_frame_buffer_t *buffer){
+	enc_frame_pool_t *pool = buffer->pool;
+	bool destroy_pool = false;
+	
+	pthread_mutex_lock(&pool->mutex);
+	buffer->refs--;
+	if (buffer->refs == 0){
+		pool->buffers_in_use--;
+		if (pool->closed || buffer->size != pool->buffer_size){
+			free(buffer->data_ptr);
+			free(buffer);
+			destroy_pool = (pool->closed && pool->buffers_in_use == 0);
+		} else {
+			buffer->next = pool->free_buffers;
+			pool->free_buffers = buffer;
+		}
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	
+	if (destroy_pool)
+		enc_frame_pool_destroy(pool);
+}
+
+/**
+ * `get_buffer()` callback of the decoder. Lays out the planes like `avcodec_default_get_buffer()` does (with
+ * the edges around the picture the decoder needs for motion vectors pointing outside) but every line is
+ * aligned to `ENC_FRAME_POOL_ALIGN`. Palette and hardware formats use the default allocator.
+ */
+static int enc_frame_pool_get_buffer(AVCodecContext *codec_context_ptr, AVFrame *frame_ptr){
+	enc_frame_pool_t *pool = codec_context_ptr->opaque;
+	const AVPixFmtDescriptor *desc = &av_pix_fmt_descriptors[codec_context_ptr->pix_fmt];
+	if (desc->flags & (PIX_FMT_PAL | PIX_FMT_HWACCEL))
+		return avcodec_default_get_buffer(codec_context_ptr, frame_ptr);
+	
+	int width = codec_context_ptr->width, height = codec_context_ptr->height;
+	int linesize_align[AV_NUM_DATA_POINTERS];
+	avcodec_align_dimensions2(codec_context_ptr, &width, &height, linesize_align);
+	int edge = (codec_context_ptr->flags & CODEC_FLAG_EMU_EDGE) ? 0 : avcodec_get_edge_width();
+	int pixel_size = desc->comp[0].step_minus1 + 1;
+	
+	int linesizes[4];
+	if ( av_image_fill_linesizes(linesizes, codec_context_ptr->pix_fmt, width + 2 * edge) < 0 )
+		return -1;
+	
+	// Offsets of the planes and of the picture within each plane (behind the top and left edge)
+	size_t plane_offsets[4] = { 0 }, picture_offsets[4] = { 0 }, size = 0;
+	for(int i = 0; i < 4 && linesizes[i] > 0; i++){
+		int h_shift = (i == 1 || i == 2) ? desc->log2_chroma_w : 0;
+		int v_shift = (i == 1 || i == 2) ? desc->log2_chroma_h : 0;
+		int plane_height = -((-(height + 2 * edge)) >> v_shift);
+		
+		linesizes[i] = FFALIGN(linesizes[i], ENC_FRAME_POOL_ALIGN);
+		plane_offsets[i] = size;
+		picture_offsets[i] = FFALIGN((size_t)linesizes[i] * (edge >> v_shift) + (pixel_size * edge >> h_shift), ENC_FRAME_POOL_ALIGN);
+		// Padding for the picture offset alignment and for SIMD reads past the last line
+		size += FFALIGN((size_t)linesizes[i] * plane_height + ENC_FRAME_POOL_ALIGN + 16, ENC_FRAME_POOL_ALIGN);
+	}
+	
+	enc_frame_buffer_t *buffer = enc_frame_pool_take(pool, size);
+	if (buffer == NULL)
+		return -1;
+	
+	for(int i = 0; i < 4; i++){
+		frame_ptr->data[i] = (linesizes[i] > 0) ? buffer->data_ptr + plane_offsets[i] + picture_offsets[i] : NULL;
+		frame_ptr->linesize[i] = linesizes[i];
+	}
+	frame_ptr->type = FF_BUFFER_TYPE_USER;
+	frame_ptr->opaque = buffer;
+	// Disables the skipped macroblock optimization of mpegvideo, it would need the age of the buffer contents
+	frame_ptr->age = INT_MAX;
+	frame_ptr->reordered_opaque = codec_context_ptr->reordered_opaque;
+	frame_ptr->pkt_pts = (codec_context_ptr->pkt != NULL) ? codec_context_ptr->pkt->pts : AV_NOPTS_VALUE;
+	
+	return 0;
+}
+
+/**
+ * `release_buffer()` callback of the decoder, the filter graph might still hold references to the buffer.
+ */
+static void enc_frame_pool_release_buffer(AVCodecContext *codec_context_ptr, AVFrame *frame_ptr){
+	if (frame_ptr->type != FF_BUFFER_TYPE_USER){
+		avcodec_default_release_buffer(codec_context_ptr, frame_ptr);
+		return;
+	}
+	
+	enc_frame_pool_unref(frame_ptr->opaque);
+	for(int i = 0; i < 4; i++)
+		frame_ptr->data[i] = NULL;
+}
+
+/**
+ * `reget_buffer()` callback of the decoder. Decoders that update the previous picture in place (screen capture
+ * codecs like tscc, msrle or qtrle) get their buffer back as long as only the decoder holds it. If the filter
+ * graph still references it (e.g. yadif keeps the previous frame) the picture is copied into a new buffer
+ * first, the graph keeps the old one.
+ */
+static int enc_frame_pool_reget_buffer(AVCodecContext *codec_context_ptr, AVFrame *frame_ptr){
+	if (frame_ptr->data[0] == NULL){
+		frame_ptr->buffer_hints |= FF_BUFFER_HINTS_READABLE;
+		return codec_context_ptr->get_buffer(codec_context_ptr, frame_ptr);
+	}
+	if (frame_ptr->type != FF_BUFFER_TYPE_USER)
+		return avcodec_default_reget_buffer(codec_context_ptr, frame_ptr);
+	
+	enc_frame_buffer_t *buffer = frame_ptr->opaque;
+	pthread_mutex_lock(&buffer->pool->mutex);
+	bool shared = (buffer->refs > 1);
+	pthread_mutex_unlock(&buffer->pool->mutex);
+	
+	if (!shared){
+		frame_ptr->reordered_opaque = codec_context_ptr->reordered_opaque;
+		frame_ptr->pkt_pts = (codec_context_ptr->pkt != NULL) ? codec_context_ptr->pkt->pts : AV_NOPTS_VALUE;
+		return 0;
+	}
+	
+	AVFrame previous = *frame_ptr;
+	for(int i = 0; i < 4; i++)
+		frame_ptr->data[i] = NULL;
+	if ( enc_frame_pool_get_buffer(codec_context_ptr, frame_ptr) < 0 ){
+		*frame_ptr = previous;
+		return -1;
+	}
+	av_image_copy(frame_ptr->data, frame_ptr->linesize, (const uint8_t**)previous.data, previous.linesize,
+		codec_context_ptr->pix_fmt, codec_context_ptr->width, codec_context_ptr->height);
+	enc_frame_pool_unref(buffer);
+	return 0;
+}
+
+/**
+ * Lets the decoder allocate its frames from the pool. Decoders without direct rendering support (CODEC_CAP_DR1)
+ * keep the default allocator.
+ */
+void enc_frame_pool_attach(enc_frame_pool_t *pool, AVCodecContext *codec_context_ptr, AVCodec *codec_ptr){
+	if ( pool == NULL || !(codec_ptr->capabilities & CODEC_CAP_DR1) )
+		return;
+	
+	codec_context_ptr->opaque = pool;
+	codec_context_ptr->get_buffer = enc_frame_pool_get_buffer;
+	codec_context_ptr->release_buffer = enc_frame_pool_release_buffer;
+	codec_context_ptr->reget_buffer = enc_frame_pool_reget_buffer;
+	// The pool has its own lock, frame threads don't need to go through the main thread
+	codec_context_ptr->thread_safe_callbacks = 1;
+}
+
+// Free callback of the filter buffers that reference a pooled frame
+static void enc_frame_pool_free_filter_buffer(AVFilterBuffer *filter_buffer_ptr){
+	enc_frame_pool_unref(filter_buffer_ptr->priv);
+	av_free(filter_buffer_ptr);
+}
+
+/**
+ * Puts a decoded frame into the filter graph. Pooled frames are handed over by reference, the buffer stays
+ * out of the pool until the filter graph is done with it. The reference is read only, filters that work in
+ * place get a copy from libavfilter. Other frames are copied into the graph.
+ */
+bool enc_frame_pool_add_frame(AVFilterContext *src_filter_context_ptr, AVCodecContext *codec_context_ptr, AVFrame *frame_ptr){
+	if (frame_ptr->type == FF_BUFFER_TYPE_USER && codec_context_ptr->get_buffer == enc_frame_pool_get_buffer){
+		AVFilterBufferRef *buffer_ref_ptr = avfilter_get_video_buffer_ref_from_arrays(frame_ptr->data, frame_ptr->linesize, AV_PERM_READ,
+			codec_context_ptr->width, codec_context_ptr->height, codec_context_ptr->pix_fmt);
+		if (buffer_ref_ptr != NULL){
+			avfilter_copy_frame_props(buffer_ref_ptr, frame_ptr);
+			enc_frame_pool_ref(frame_ptr->opaque);
+			buffer_ref_ptr->buf->priv = frame_ptr->opaque;
+			buffer_ref_ptr->buf->free = enc_frame_pool_free_filter_buffer;
+			
+			// Fails if the source still holds a frame the graph didn't take yet, the copy below replaces it then
+			if ( av_buffersrc_buffer(src_filter_context_ptr, buffer_ref_ptr) >= 0 )
+				return true;
+			avfilter_unref_buffer(buffer_ref_ptr);
+		}
+	}
+	
+	int error = av_vsrc_buffer_add_frame(src_filter_context_ptr, frame_ptr, AV_VSRC_BUF_FLAG_OVERWRITE);
+	if (error < 0){
+		enc_av_perror("av_vsrc_buffer_add_frame", error);
+		return false;
+	}
+	return true;
+}
+
+
+//
+// Analysis stuff
+//
+
+/**
+ * Callback used by `enc_analysis_sample_frames()`. It's called for every decoded video frame
+ * of a sample. `sample_index` is the number of the sample the frame belongs to.
+ */
+typedef void (*enc_analysis_frame_callback_t)(AVFrame *frame_ptr, int sample_index, void *data_ptr);
+
+/**
+ * Decodes a few video frames at `sample_count` positions spread evenly across the input and
+ * hands them to the callback. At each position `frames_per_sample` consecutive frames are
+ * decoded. Afterwards the input is rewound to the start and the video decoder is flushed so
+ * the normal decoding loop can start as if nothing happened.
+ *
+ * Only works for seekable inputs with a known duration. Returns the number of frames handed
+ * to the callback or `-1` if the input could not be rewound (the input is useless then).
+ */
+int enc_analysis_sample_frames(
+	AVFormatContext *format_context_ptr, int video_stream_index, AVCodecContext *video_codec_context_ptr,
+	int sample_count, int frames_per_sample, enc_analysis_frame_callback_t callback, void *data_ptr
+){
+	if (format_context_ptr->duration == AV_NOPTS_VALUE || format_context_ptr->duration <= 0){
+		fprintf(stderr, "analysis: input has no known duration, skipping analysis\n");
+		return 0;
+	}
+	if (format_context_ptr->pb != NULL && !format_context_ptr->pb->seekable){
+		fprintf(stderr, "analysis: input is not seekable, skipping analysis\n");
+		return 0;
+	}
+
+	int64_t start_time = (format_context_ptr->start_time != AV_NOPTS_VALUE) ? format_context_ptr->start_time : 0;
+	AVFrame *frame_ptr = avcodec_alloc_frame();
+	AVPacket packet;
+	int frames_sampled = 0, frame_available = 0;
+
+	for(int i = 0; i < sample_count; i++){
+		// Sample the middle of each of the `sample_count` parts of the input. That way we never
+		// hit the very first or last frame (often black).
+		int64_t timestamp = start_time + format_context_ptr->duration * (2 * i + 1) / (2 * sample_count);
+		if ( av_seek_frame(format_context_ptr, -1, timestamp, AVSEEK_FLAG_BACKWARD) < 0 ){
+			enc_debug("analysis: seek to %ld failed, skipping sample %d\n", timestamp, i);
+			continue;
+		}
+		avcodec_flush_buffers(video_codec_context_ptr);
+
+		// Don't read forever if the stream is broken at this position
+		int frames_decoded = 0, packets_left = 100 + 10 * frames_per_sample;
+		while( frames_decoded < frames_per_sample && packets_left > 0 && av_read_frame(format_context_ptr, &packet) >= 0 ){
+			if (packet.stream_index == video_stream_index){
+				if ( avcodec_decode_video2(video_codec_context_ptr, frame_ptr, &frame_available, &packet) >= 0 && frame_available ){
+					callback(frame_ptr, i, data_ptr);
+					frames_decoded++;
+				}
+				packets_left--;
+			}
+			av_free_packet(&packet);
+		}
+
+		frames_sampled += frames_decoded;
+	}
+
+	av_free(frame_ptr);
+
+	// Go back to the start so the real decoding can start
+	avcodec_flush_buffers(video_codec_context_ptr);
+	if ( av_seek_frame(format_context_ptr, -1, start_time, AVSEEK_FLAG_BACKWARD) < 0 ){
+		fprintf(stderr, "analysis: failed to rewind input after analysis\n");
+		return -1;
+	}
+
+	return frames_sampled;
+}
+
+
+/**
+ * State of the black border detection. The borders are the number of black pixel lines
+ * (or columns) on each side of the frame.
+ */
+typedef struct {
+	int width, height;
+	// Pixels with a luma value above this threshold are not considered black
+	int threshold;
+	// Borders found so far. These are the minimum of all sampled frames so we never crop away
+	// something that was visible in any of the samples.
+	int top, bottom, left, right;
+	int frames_used;
+} enc_cropdetect_t;
+
+/**
+ * Returns `true` if the `count` luma values starting at `pixel_ptr` are black. The pixels are
+ * `step` bytes apart. Up to 2% of the pixels may be brighter to tolerate noise and the
+ * occasional VHS head switching artifact.
+ */
+static bool enc_cropdetect_is_black(const uint8_t *pixel_ptr, int count, int step, int threshold){
+	int bright_pixels = 0;
+	for(int i = 0; i < count; i++, pixel_ptr += step){
+		if (*pixel_ptr > threshold)
+			bright_pixels++;
+	}
+
+	return bright_pixels <= count / 50;
+}
+
+/**
+ * Analysis callback of the black border detection. Looks at the luma plane of the frame
+ * and narrows the borders down if the frame has smaller ones.
+ */
+void enc_cropdetect_analyze_frame(AVFrame *frame_ptr, int sample_index, void *data_ptr){
+	enc_cropdetect_t *crop = data_ptr;
+	const uint8_t *luma_ptr = frame_ptr->data[0];
+	int stride = frame_ptr->linesize[0];
+	int top, bottom, left, right;
+
+	for(top = 0; top < crop->height && enc_cropdetect_is_black(luma_ptr + top * stride, crop->width, 1, crop->threshold); top++)
+		;
+
+	// Completely black frames (fades, blank tape) tell us nothing about the borders
+	if (top == crop->height){
+		enc_debug("cropdetect: sample %d is black, ignored\n", sample_index);
+		return;
+	}
+
+	for(bottom = 0; enc_cropdetect_is_black(luma_ptr + (crop->height - 1 - bottom) * stride, crop->width, 1, crop->threshold); bottom++)
+		;
+
+	int content_height = crop->height - top - bottom;
+	const uint8_t *content_ptr = luma_ptr + top * stride;
+	for(left = 0; left < crop->width && enc_cropdetect_is_black(content_ptr + left, content_height, stride, crop->threshold); left++)
+		;
+	for(right = 0; right < crop->width - left && enc_cropdetect_is_black(content_ptr + crop->width - 1 - right, content_height, stride, crop->threshold); right++)
+		;
+
+	if (left + right >= crop->width){
+		enc_debug("cropdetect: sample %d has no content columns, ignored\n", sample_index);
+		return;
+	}
+
+	enc_debug("cropdetect: sample %d: top %d, bottom %d, left %d, right %d\n", sample_index, top, bottom, left, right);
+
+	if (crop->frames_used == 0 || top < crop->top)
+		crop->top = top;
+	if (crop->frames_used == 0 || bottom < crop->bottom)
+		crop->bottom = bottom;
+	if (crop->frames_used == 0 || left < crop->left)
+		crop->left = left;
+	if (crop->frames_used == 0 || right < crop->right)
+		crop->right = right;
+	crop->frames_used++;
+}
+
+/**
+ * Samples frames across the input and searches for black borders that are present in all of
+ * them (letterbox or pillarbox). If borders are found a crop filter description is written to
+ * `crop_filter` (e.g. "crop=704:432:8:72"), otherwise it is set to an empty string.
+ *
+ * Returns `false` if the input is no longer usable after the analysis.
+ */
+bool enc_cropdetect(
+	AVFormatContext *format_context_ptr, int video_stream_index, AVCodecContext *video_codec_context_ptr,
+	char *crop_filter, size_t crop_filter_size
+){
+	crop_filter[0] = '\0';
+
+	// We only look at the luma plane so we need a planar YUV format
+	switch(video_codec_context_ptr->pix_fmt){
+		case PIX_FMT_YUV420P: case PIX_FMT_YUVJ420P: case PIX_FMT_YUV422P: case PIX_FMT_YUV411P:
+			break;
+		default:
+			fprintf(stderr, "cropdetect: unsupported pixel format %d, skipping black border detection\n", video_codec_context_ptr->pix_fmt);
+			return true;
+	}
+
+	enc_cropdetect_t crop = {
+		.width = video_codec_context_ptr->width, .height = video_codec_context_ptr->height,
+		// Black is 16 in limited range YUV, leave some headroom for noise
+		.threshold = 24,
+		.top = 0, .bottom = 0, .left = 0, .right = 0,
+		.frames_used = 0
+	};
+
+	if ( enc_analysis_sample_frames(format_context_ptr, video_stream_index, video_codec_context_ptr, 16, 1, enc_cropdetect_analyze_frame, &crop) < 0 )
+		return false;
+
+	if (crop.frames_used < 3){
+		fprintf(stderr, "cropdetect: only %d usable samples, not cropping\n", crop.frames_used);
+		return true;
+	}
+
+	// Round the borders down so we never crop any content. The offsets have to be a multiple of 4
+	// horizontally (chroma subsampling of 4:1:1 DV) and of 2 vertically (4:2:0 chroma and field
+	// order of interlaced material). x264 wants even dimensions for 4:2:0 anyway. The kept size is
+	// rounded up (to a multiple of 4 for 4:1:1, the crop filter would round it down otherwise), but
+	// never beyond the frame.
+	int left = crop.left & ~3, top = crop.top & ~1;
+	int width_align = (video_codec_context_ptr->pix_fmt == PIX_FMT_YUV411P) ? 4 : 2;
+	int width = (crop.width - left - crop.right + width_align - 1) & ~(width_align - 1);
+	if (width > ((crop.width - left) & ~(width_align - 1)))
+		width = (crop.width - left) & ~(width_align - 1);
+	int height = (crop.height - top - crop.bottom + 1) & ~1;
+	if (height > ((crop.height - top) & ~1))
+		height = (crop.height - top) & ~1;
+
+	if (width == crop.width && height == crop.height)
+		return true;
+
+	snprintf(crop_filter, crop_filter_size, "crop=%d:%d:%d:%d", width, height, left, top);
+	printf("Black borders detected in %d samples (top %d, bottom %d, left %d, right %d), using %s\n",
+		crop.frames_used, crop.top, crop.bottom, crop.left, crop.right, crop_filter);
+
+	return true;
+}
+
+
+/**
+ * The possible results of the field detection.
+ */
+typedef enum {
+	ENC_FIELDS_PROGRESSIVE,
+	ENC_FIELDS_INTERLACED,
+	// Film material with 3:2 pulldown (24p stored as 60i)
+	ENC_FIELDS_TELECINED
+} enc_field_type_t;
+
+const char *enc_field_type_names[] = {"progressive", "interlaced", "telecined"};
+
+// Filters inserted into the filter graph for the detected material
+const char *enc_deinterlace_filter = "yadif";
+const char *enc_inverse_telecine_filter = "mp=pullup";
+
+/**
+ * State of the field detection. Each sample is a run of consecutive frames. Every sample
+ * votes for one field type, the majority wins.
+ */
+typedef struct {
+	int width, height;
+	// Luma plane of the previous frame of the current sample, used to detect motion
+	uint8_t *prev_luma_ptr;
+	int sample_index, frame_index;
+	// Statistics of the current sample. Only frames with motion count, static frames don't
+	// show combing no matter how they are stored.
+	int moving_frames, combed_frames;
+	// Counts how often combing was seen at each position in the 5 frame pulldown cycle
+	int combed_phases[5];
+	// Votes of all finished samples
+	int votes[3];
+} enc_fielddetect_t;
+
+/**
+ * Counts the votes of the current sample and resets the per sample statistics.
+ */
+static void enc_fielddetect_finish_sample(enc_fielddetect_t *fields){
+	int moving = fields->moving_frames, combed = fields->combed_frames;
+
+	if (moving >= 5){
+		// Telecined film shows combing in 2 adjacent frames out of every 5
+		int phase_a = 0, phase_b = 0;
+		for(int i = 0; i < 5; i++){
+			if (fields->combed_phases[i] > fields->combed_phases[phase_a])
+				phase_a = i;
+		}
+		phase_b = (fields->combed_phases[(phase_a + 1) % 5] > fields->combed_phases[(phase_a + 4) % 5]) ? (phase_a + 1) % 5 : (phase_a + 4) % 5;
+		int combed_in_pattern = fields->combed_phases[phase_a] + fields->combed_phases[phase_b];
+
+		enc_field_type_t vote;
+		if (combed * 100 < moving * 15)
+			vote = ENC_FIELDS_PROGRESSIVE;
+		else if (combed * 100 > moving * 75)
+			vote = ENC_FIELDS_INTERLACED;
+		else if (combed_in_pattern * 100 >= combed * 80)
+			vote = ENC_FIELDS_TELECINED;
+		else
+			vote = ENC_FIELDS_INTERLACED;
+
+		enc_debug("fielddetect: sample %d: %d of %d moving frames combed, %d in pulldown pattern, vote: %s\n",
+			fields->sample_index, combed, moving, combed_in_pattern, enc_field_type_names[vote]);
+		fields->votes[vote]++;
+	}
+
+	fields->moving_frames = 0;
+	fields->combed_frames = 0;
+	fields->frame_index = 0;
+	memset(fields->combed_phases, 0, sizeof(fields->combed_phases));
+}
+
+/**
+ * Analysis callback of the field detection. A pixel is combed if it differs from the lines
+ * above and below in the same direction (the lines belong to the other field). A frame with
+ * more than 0.5% combed pixels is a combed frame.
+ */
+void enc_fielddetect_analyze_frame(AVFrame *frame_ptr, int sample_index, void *data_ptr){
+	enc_fielddetect_t *fields = data_ptr;
+	const uint8_t *luma_ptr = frame_ptr->data[0];
+	int stride = frame_ptr->linesize[0];
+
+	if (sample_index != fields->sample_index){
+		enc_fielddetect_finish_sample(fields);
+		fields->sample_index = sample_index;
+	}
+
+	// Look at every second column, that's enough for statistics and twice as fast
+	int64_t difference = 0;
+	int combed_pixels = 0, pixels = 0;
+	for(int y = 1; y < fields->height - 1; y++){
+		const uint8_t *line_ptr = luma_ptr + y * stride;
+		const uint8_t *prev_line_ptr = fields->prev_luma_ptr + y * fields->width;
+		for(int x = 0; x < fields->width; x += 2){
+			int above = line_ptr[x - stride], current = line_ptr[x], below = line_ptr[x + stride];
+			if ( (current - above) * (current - below) > 15 * 15 )
+				combed_pixels++;
+			difference += abs(current - prev_line_ptr[x]);
+			pixels++;
+		}
+	}
+
+	bool moving = (fields->frame_index > 0) && (difference > 2 * (int64_t)pixels);
+	bool combed = combed_pixels * 200 > pixels;
+	if (moving){
+		fields->moving_frames++;
+		if (combed){
+			fields->combed_frames++;
+			fields->combed_phases[fields->frame_index % 5]++;
+		}
+	}
+
+	for(int y = 0; y < fields->height; y++)
+		memcpy(fields->prev_luma_ptr + y * fields->width, luma_ptr + y * stride, fields->width);
+	fields->frame_index++;
+}
+
+/**
+ * Classifies the video as progressive, interlaced or telecined by looking at runs of frames
+ * sampled across the input. Telecine is only reported for material with 29.97 or 30 frames
+ * per second, everything else with a pulldown like pattern is handled as interlaced.
+ *
+ * Returns `false` if the input is no longer usable after the analysis.
+ */
+bool enc_fielddetect(
+	AVFormatContext *format_context_ptr, int video_stream_index, AVCodecContext *video_codec_context_ptr,
+	AVRational frame_rate, enc_field_type_t *field_type_ptr
+){
+	*field_type_ptr = ENC_FIELDS_PROGRESSIVE;
+
+	enc_fielddetect_t fields = {
+		.width = video_codec_context_ptr->width, .height = video_codec_context_ptr->height,
+		.prev_luma_ptr = av_mallocz(video_codec_context_ptr->width * video_codec_context_ptr->height),
+		.sample_index = 0, .frame_index = 0,
+		.moving_frames = 0, .combed_frames = 0,
+		.combed_phases = {0, 0, 0, 0, 0},
+		.votes = {0, 0, 0}
+	};
+
+	if (fields.prev_luma_ptr == NULL){
+		fprintf(stderr, "fielddetect: failed to allocate frame buffer\n");
+		return true;
+	}
+
+	int frames = enc_analysis_sample_frames(format_context_ptr, video_stream_index, video_codec_context_ptr, 10, 30, enc_fielddetect_analyze_frame, &fields);
+	enc_fielddetect_finish_sample(&fields);
+	av_free(fields.prev_luma_ptr);
+
+	if (frames < 0)
+		return false;
+
+	for(int i = 0; i < 3; i++){
+		if (fields.votes[i] > fields.votes[*field_type_ptr])
+			*field_type_ptr = i;
+	}
+
+	double fps = av_q2d(frame_rate);
+	if (*field_type_ptr == ENC_FIELDS_TELECINED && (fps < 29.9 || fps > 30.1))
+		*field_type_ptr = ENC_FIELDS_INTERLACED;
+
+	printf("Field detection votes: progressive %d, interlaced %d, telecined %d, video is %s\n",
+		fields.votes[ENC_FIELDS_PROGRESSIVE], fields.votes[ENC_FIELDS_INTERLACED], fields.votes[ENC_FIELDS_TELECINED],
+		enc_field_type_names[*field_type_ptr]);
+
+	return true;
+}
+
+
+//
+// x264 stuff
+//
+
+typedef struct {
+	x264_t *encoder;
+	x264_picture_t pic_in, pic_out;
+	struct SwsContext* scaler;
+	x264_nal_t* nals;
+	int nal_count;
+	int payload_size;
+	// Time base of the frames coming out of the filter pipeline and the time base used for x264 (and
+	// the MP4 video track). They differ if the frames are retimed, e.g. after an inverse telecine.
+	AVRational input_time_base, time_base;
+	int64_t last_pts;
+	// Added to the PTS of the filtered frames (in `time_base`). Used to put several input files one after
+	// the other.
+	int64_t pts_offset;
+} x264_context_t;
+
+/**
+ * Rate control of a two pass encode: the average bitrate (kbit/s), the pass (1 or 2) and the statistics
+ * file written by the first pass and read by the second one.
+ */
+typedef struct {
+	int bit_rate;
+	int pass;
+	const char *stats_file;
+} enc_x264_two_pass_t;
+
+/**
+ * Opens the x264 encoder. `width` and `height` are the dimensions of the frames coming out of the
+ * filter pipeline. They can differ from the decoder dimensions (e.g. if the frames are cropped).
+ * 
+ * The PTS of the filtered frames (in `input_time_base`) are converted to `time_base` for x264.
+ * `frame_rate` is the nominal frame rate x264 uses for rate control. The encoder uses CRF with `quality`
+ * unless `two_pass` is not `NULL`. With `metrics` x264 measures the PSNR and SSIM of each frame (see
+ * `enc_metrics_frame()`).
+ */
+bool enc_x264_open(
+	AVCodecContext *video_codec_context_ptr, int width, int height, AVRational sample_aspect_ratio,
+	AVRational input_time_base, AVRational time_base, AVRational frame_rate,
+	const char *preset, const char *tune, float quality, const char *profile, int keyint_max, int sps_id, bool metrics,
+	const enc_x264_two_pass_t *two_pass, x264_context_t *x264_ptr
+){
+	x264_param_t params;
+	// use tune "zerolatency" tune to avoid out of order frames (done by the live mode)
+	if ( x264_param_default_preset(&params, preset, tune) != 0 ){
+		fprintf(stderr, "x264: failed to set preset %s and tune %s\n", preset, tune);
+		return false;
+	}
+	
+	params.i_width = width;
+	params.i_height = height;
+	// Same as x264's automatic thread count but based on the CPUs we may use, not the CPUs of the host
+	params.i_threads = enc_cpu_count() * 3 / 2;
+	// We're muxing the h264 stream into an MP4 container, so we don't want an AnnexB stream
+	params.b_annexb = false;
+	// Use the PTS of the frames instead of assuming a constant frame rate. The PTS are in the time base
+	// of the video track so x264 DTS and PTS can be used for the MP4 samples as they are.
+	params.i_fps_num = frame_rate.num;
+	params.i_fps_den = frame_rate.den;
+	params.b_vfr_input = 1;
+	params.i_timebase_num = time_base.num;
+	params.i_timebase_den = time_base.den;
+	x264_ptr->input_time_base = input_time_base;
+	x264_ptr->time_base = time_base;
+	x264_ptr->last_pts = AV_NOPTS_VALUE;
+	x264_ptr->pts_offset = 0;
+	// Set the sample aspect ratio for the video stream since this information is also present in the h264 stream
+	params.vui.i_sar_width = sample_aspect_ratio.num;
+	params.vui.i_sar_height = sample_aspect_ratio.den;
+	
+	params.rc.i_rc_method = X264_RC_CRF;
+	params.rc.f_rf_constant = quality;
+	
+	// Average bitrate for a target file size. The first pass uses x264's fast first pass settings (e.g.
+	// subme 2, one reference frame), they barely change the statistics.
+	if (two_pass != NULL){
+		params.rc.i_rc_method = X264_RC_ABR;
+		params.rc.i_bitrate = two_pass->bit_rate;
+		if (two_pass->pass == 1){
+			params.rc.b_stat_write = 1;
+			params.rc.psz_stat_out = (char*)two_pass->stats_file;
+			x264_param_apply_fastfirstpass(&params);
+		} else {
+			params.rc.b_stat_read = 1;
+			params.rc.psz_stat_in = (char*)two_pass->stats_file;
+		}
+	}
+	
+	// Maximal GOP length in frames, the live mode uses it to start each segment with an IDR frame
+	if (keyint_max > 0)
+		params.i_keyint_max = keyint_max;
+	// Id of the SPS and PPS, the trim mode uses another id than the original encode so both parameter
+	// sets can be stored in the same track
+	params.i_sps_id = sps_id;
+	// x264 compares its reconstruction with the input picture (with its SIMD code in the encoder threads),
+	// that's the same as decoding the output again. It doesn't change the encoding decisions.
+	params.analyse.b_psnr = metrics;
+	params.analyse.b_ssim = metrics;
+	
+	if ( x264_param_apply_profile(&params, profile) != 0 ){
+		fprintf(stderr, "x264: failed to apply profile %s\n", profile);
+		return false;
+	}
+	
+	x264_ptr->encoder = x264_encoder_open(&params);
+	if (x264_ptr->encoder == NULL){
+		fprintf(stderr, "x264: failed to initialize encoder\n");
+		return false;
+	}
+	
+	// Allocate the x264 input buffer (input "picture")
+	if ( x264_picture_alloc(&x264_ptr->pic_in, X264_CSP_I420, width, height) != 0 ){
+		fprintf(stderr, "x264: could not allocate input picture\n");
+		return false;
+	}
+	
+	// Initialize the output picture pts to 0 so we can use it to calculate the progress.
+	// Otherwise the random value will screw up our status message.
+	x264_ptr->pic_out.i_pts = 0;
+	
+	// The software scaler to copy the raw decoder output into the x264 input picture.
+	// Those buffers use different paddings so we pretty much only use the software scaler
+	// perform an efficient copy.
+	x264_ptr->scaler = sws_getContext(
+		width, height, video_codec_context_ptr->pix_fmt,
+		width, height, PIX_FMT_YUV420P,
+		SWS_FAST_BILINEAR, NULL, NULL, NULL);
+	
+	if (x264_ptr->scaler == NULL){
+		fprintf(stderr, "failed to create software scaler to copy frames to x264\n");
+		return false;
+	}
+	
+	return true;
+}
+
+/**
+ * Replaces the software scaler of the x264 context with one that converts pictures of the specified
+ * size and format. Used if the encoder is not fed by the filter pipeline (e.g. the preview encoder).
+ */
+bool enc_x264_set_input(x264_context_t *x264_ptr, int width, int height, enum PixelFormat pix_fmt){
+	x264_param_t params;
+	x264_encoder_parameters(x264_ptr->encoder, &params);
+	
+	sws_freeContext(x264_ptr->scaler);
+	x264_ptr->scaler = sws_getContext(
+		width, height, pix_fmt,
+		params.i_width, params.i_height, PIX_FMT_YUV420P,
+		SWS_FAST_BILINEAR, NULL, NULL, NULL);
+	
+	if (x264_ptr->scaler == NULL){
+		fprintf(stderr, "failed to create software scaler for x264 input\n");
+		return false;
+	}
+	
+	return true;
+}
+
+/**
+ * Scales a picture of another x264 context into the input picture of this context (see `enc_x264_set_input()`).
+ */
+void enc_x264_scale_picture(x264_context_t *x264_ptr, x264_picture_t *pic_ptr, int height){
+	x264_ptr->pic_in.i_type = X264_TYPE_AUTO;
+	x264_ptr->pic_in.i_pts = pic_ptr->i_pts;
+	sws_scale(x264_ptr->scaler, (const uint8_t * const*)pic_ptr->img.plane,
+		pic_ptr->img.i_stride, 0, height,
+		x264_ptr->pic_in.img.plane, x264_ptr->pic_in.img.i_stride);
+}
+
+bool enc_x264_close(x264_context_t *x264){
+	sws_freeContext(x264->scaler);
+	x264_picture_clean(&x264->pic_in);
+	x264_encoder_close(x264->encoder);
+}
+
+
+//
+// Speed control stuff (encoding at least N times realtime)
+//
+
+/**
+ * Changes the x264 analysis settings between frames so the encoder keeps up with a target speed (in
+ * multiples of realtime), similar to the speedcontrol patch of x264. Every `ENC_SPEED_INTERVAL` seconds
+ * the wall time is compared with the schedule: encoding `n` seconds of video may take `n / target`
+ * seconds. If the encoder is behind it switches to a faster level, if it's well ahead it goes back to a
+ * slower one. The settings of the chosen preset are the slowest level, so the preset is the best quality
+ * a job gets.
+ * 
+ * Only settings `x264_encoder_reconfig()` can change are used. B-frame decisions (b-adapt) and the
+ * lookahead are fixed when the encoder is opened and stay as the preset sets them.
+ */
+#define ENC_SPEED_INTERVAL 1.0
+
+typedef struct {
+	int subpel_refine, me_method, me_range, frame_reference, trellis;
+	unsigned int partitions;
+	bool mixed_references;
+} enc_speed_level_t;
+
+// From fastest to slowest, roughly the analysis settings of the x264 presets "superfast" to "slower". Only
+// the levels faster than the preset are used.
+static const enc_speed_level_t enc_speed_levels[] = {
+	{ 1, X264_ME_DIA, 16, 1, 0, 0, false },
+	{ 2, X264_ME_DIA, 16, 1, 0, X264_ANALYSE_I8x8 | X264_ANALYSE_I4x4, false },
+	{ 4, X264_ME_HEX, 16, 1, 0, X264_ANALYSE_I8x8 | X264_ANALYSE_I4x4 | X264_ANALYSE_PSUB16x16, false },
+	{ 5, X264_ME_HEX, 16, 2, 0, X264_ANALYSE_I8x8 | X264_ANALYSE_I4x4 | X264_ANALYSE_PSUB16x16 | X264_ANALYSE_BSUB16x16, true },
+	{ 6, X264_ME_HEX, 16, 2, 1, X264_ANALYSE_I8x8 | X264_ANALYSE_I4x4 | X264_ANALYSE_PSUB16x16 | X264_ANALYSE_BSUB16x16, true },
+	{ 7, X264_ME_HEX, 16, 3, 1, X264_ANALYSE_I8x8 | X264_ANALYSE_I4x4 | X264_ANALYSE_PSUB16x16 | X264_ANALYSE_BSUB16x16, true },
+	{ 8, X264_ME_UMH, 16, 5, 1, X264_ANALYSE_I8x8 | X264_ANALYSE_I4x4 | X264_ANALYSE_PSUB16x16 | X264_ANALYSE_PSUB8x8 | X264_ANALYSE_BSUB16x16, true },
+	{ 9, X264_ME_UMH, 16, 8, 2, X264_ANALYSE_I8x8 | X264_ANALYSE_I4x4 | X264_ANALYSE_PSUB16x16 | X264_ANALYSE_PSUB8x8 | X264_ANALYSE_BSUB16x16, true }
+};
+#define ENC_SPEED_LEVEL_COUNT (int)(sizeof(enc_speed_levels) / sizeof(enc_speed_levels[0]))
+
+typedef struct {
+	float target;
+	AVRational time_base;
+	// `level` indexes `enc_speed_levels`, `max_level` is the preset itself with the settings in `preset`
+	int level, max_level;
+	enc_speed_level_t preset;
+	// Wall time and PTS of the first encoded frame, the time of the last check and the last PTS
+	struct timespec start, last_check;
+	int64_t start_pts, last_pts;
+	// Number of encoded frames per level and level changes for the report at the end
+	int64_t frames_per_level[ENC_SPEED_LEVEL_COUNT + 1];
+	int level_changes;
+} enc_speed_t;
+
+static double enc_speed_seconds_since(const struct timespec *since, const struct timespec *now){
+	return (now->tv_sec - since->tv_sec) + (now->tv_nsec - since->tv_nsec) / 1000000000.0;
+}
+
+/**
+ * Applies the settings of the current level to the encoder. The other parameters stay as they are.
+ */
+static bool enc_speed_apply_level(enc_speed_t *speed, x264_t *encoder){
+	const enc_speed_level_t *level = (speed->level == speed->max_level) ? &speed->preset : &enc_speed_levels[speed->level];
+	x264_param_t params;
+	x264_encoder_parameters(encoder, &params);
+	
+	params.analyse.i_subpel_refine = level->subpel_refine;
+	params.analyse.i_me_method = level->me_method;
+	params.analyse.i_me_range = level->me_range;
+	params.analyse.i_trellis = level->trellis;
+	params.analyse.inter = level->partitions;
+	params.analyse.b_mixed_references = level->mixed_references;
+	// x264 never uses more reference frames than it was opened with
+	params.i_frame_reference = level->frame_reference;
+	
+	if ( x264_encoder_reconfig(encoder, &params) < 0 ){
+		fprintf(stderr, "x264: failed to switch to speed level %d\n", speed->level);
+		return false;
+	}
+	
+	return true;
+}
+
+/**
+ * Initializes the speed control for an opened encoder. The encoder starts with the settings of its preset.
+ */
+void enc_speed_init(float target, AVRational time_base, x264_t *encoder, enc_speed_t *speed){
+	speed->target = target;
+	speed->time_base = time_base;
+	speed->start_pts = AV_NOPTS_VALUE;
+	speed->level_changes = 0;
+	memset(speed->frames_per_level, 0, sizeof(speed->frames_per_level));
+	
+	x264_param_t params;
+	x264_encoder_parameters(encoder, &params);
+	speed->preset = (enc_speed_level_t){
+		.subpel_refine = params.analyse.i_subpel_refine, .me_method = params.analyse.i_me_method,
+		.me_range = params.analyse.i_me_range, .frame_reference = params.i_frame_reference,
+		.trellis = params.analyse.i_trellis, .partitions = params.analyse.inter,
+		.mixed_references = params.analyse.b_mixed_references
+	};
+	
+	speed->max_level = 0;
+	while (speed->max_level < ENC_SPEED_LEVEL_COUNT && enc_speed_levels[speed->max_level].subpel_refine < speed->preset.subpel_refine)
+		speed->max_level++;
+	speed->level = speed->max_level;
+}
+
+/**
+ * Called for every frame coming out of the encoder. Switches the level if the encoder is behind or well
+ * ahead of the schedule.
+ */
+void enc_speed_frame_out(enc_speed_t *speed, x264_t *encoder, int64_t pts){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	speed->frames_per_level[speed->level]++;
+	speed->last_pts = pts;
+	
+	if (speed->start_pts == AV_NOPTS_VALUE){
+		speed->start_pts = pts;
+		speed->start = now;
+		speed->last_check = now;
+		return;
+	}
+	
+	if (enc_speed_seconds_since(&speed->last_check, &now) < ENC_SPEED_INTERVAL)
+		return;
+	speed->last_check = now;
+	
+	double encoded_sec = (pts - speed->start_pts) * av_q2d(speed->time_base);
+	double elapsed_sec = enc_speed_seconds_since(&speed->start, &now);
+	double scheduled_sec = encoded_sec / speed->target;
+	
+	// Behind the schedule: go faster. More than 20% ahead: take the time for better quality.
+	int new_level = speed->level;
+	if (elapsed_sec > scheduled_sec && speed->level > 0)
+		new_level--;
+	else if (elapsed_sec < scheduled_sec * 0.8 && speed->level < speed->max_level)
+		new_level++;
+	
+	if (new_level != speed->level){
+		enc_debug("speed control: %.2fx realtime (target %.2fx), level %d -> %d\n", encoded_sec / elapsed_sec, speed->target, speed->level, new_level);
+		int old_level = speed->level;
+		speed->level = new_level;
+		if ( enc_speed_apply_level(speed, encoder) )
+			speed->level_changes++;
+		else
+			speed->level = old_level;
+	}
+}
+
+void enc_speed_report(enc_speed_t *speed){
+	if (speed->start_pts == AV_NOPTS_VALUE)
+		return;
+	
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double elapsed_sec = enc_speed_seconds_since(&speed->start, &now);
+	double encoded_sec = (speed->last_pts - speed->start_pts) * av_q2d(speed->time_base);
+	printf("Speed control: %.2fx realtime (target %.2fx), %d level changes, frames per level:", encoded_sec / elapsed_sec, speed->target, speed->level_changes);
+	for(int i = 0; i < speed->max_level; i++)
+		printf(" %ld", speed->frames_per_level[i]);
+	printf(" %ld (preset)\n", speed->frames_per_level[speed->max_level]);
+}
+
+
+//
+// Quality metrics stuff (PSNR and SSIM of the encoded frames)
+//
+
+/**
+ * Collects the PSNR and SSIM x264 measures for each encoded frame (see `enc_x264_open()`). If `file` is
+ * not `NULL` the values of each frame are written into it as JSON, followed by the summary.
+ */
+typedef struct {
+	FILE *file;
+	AVRational time_base;
+	int64_t frames;
+	double psnr_sum[3], psnr_avg_sum, mse_sum, ssim_sum;
+	double worst_ssim;
+	int64_t worst_ssim_pts;
+} enc_metrics_t;
+
+bool enc_metrics_open(const char *file, AVRational time_base, enc_metrics_t *metrics){
+	*metrics = (enc_metrics_t){ .time_base = time_base, .worst_ssim = 1 };
+	if (file == NULL)
+		return true;
+	
+	metrics->file = fopen(file, "w");
+	if (metrics->file == NULL){
+		perror(file);
+		return false;
+	}
+	fprintf(metrics->file, "{\n\t\"frames\": [\n");
+	return true;
+}
+
+void enc_metrics_close(enc_metrics_t *metrics){
+	if (metrics->file != NULL)
+		fclose(metrics->file);
+	metrics->file = NULL;
+}
+
+static char enc_metrics_frame_type(int x264_type){
+	switch(x264_type){
+		case X264_TYPE_IDR:
+		case X264_TYPE_I:
+			return 'I';
+		case X264_TYPE_P:
+			return 'P';
+		case X264_TYPE_BREF:
+		case X264_TYPE_B:
+			return 'B';
+	}
+	return '?';
+}
+
+/**
+ * Adds the values of an output picture of x264 (with `payload_size` > 0).
+ */
+void enc_metrics_frame(enc_metrics_t *metrics, const x264_picture_t *pic_out){
+	const x264_image_properties_t *prop = &pic_out->prop;
+	for(int i = 0; i < 3; i++)
+		metrics->psnr_sum[i] += prop->f_psnr[i];
+	metrics->psnr_avg_sum += prop->f_psnr_avg;
+	// The global PSNR is calculated from the average MSE, not from the average PSNR
+	metrics->mse_sum += 255.0 * 255.0 * pow(10, -prop->f_psnr_avg / 10);
+	metrics->ssim_sum += prop->f_ssim;
+	if (prop->f_ssim < metrics->worst_ssim){
+		metrics->worst_ssim = prop->f_ssim;
+		metrics->worst_ssim_pts = pic_out->i_pts;
+	}
+	
+	if (metrics->file != NULL)
+		fprintf(metrics->file, "%s\t\t{ \"time\": %.3f, \"type\": \"%c\", \"psnr_y\": %.3f, \"psnr_u\": %.3f, \"psnr_v\": %.3f, \"psnr\": %.3f, \"ssim\": %.5f }",
+			(metrics->frames > 0) ? ",\n" : "", pic_out->i_pts * av_q2d(metrics->time_base), enc_metrics_frame_type(pic_out->i_type),
+			prop->f_psnr[0], prop->f_psnr[1], prop->f_psnr[2], prop->f_psnr_avg, prop->f_ssim);
+	metrics->frames++;
+}
+
+/**
+ * Prints the averages over all frames and writes them into the JSON file (if any). The file is closed
+ * afterwards.
+ */
+void enc_metrics_report(enc_metrics_t *metrics){
+	if (metrics->frames == 0){
+		fprintf(stderr, "quality metrics: no frames encoded\n");
+		if (metrics->file != NULL)
+			fprintf(metrics->file, "\n\t],\n\t\"summary\": null\n}\n");
+		enc_metrics_close(metrics);
+		return;
+	}
+	
+	double psnr[3], psnr_avg = metrics->psnr_avg_sum / metrics->frames;
+	for(int i = 0; i < 3; i++)
+		psnr[i] = metrics->psnr_sum[i] / metrics->frames;
+	double psnr_global = 10 * log10(255.0 * 255.0 / fmax(metrics->mse_sum / metrics->frames, 1e-10));
+	double ssim = metrics->ssim_sum / metrics->frames;
+	double ssim_db = -10 * log10(fmax(1 - ssim, 1e-10));
+	double worst_ssim_sec = metrics->worst_ssim_pts * av_q2d(metrics->time_base);
+	
+	printf("Quality metrics of %ld frames: PSNR Y %.3f U %.3f V %.3f, average %.3f, global %.3f dB, SSIM %.5f (%.3f dB), worst SSIM %.5f at %.2f s\n",
+		metrics->frames, psnr[0], psnr[1], psnr[2], psnr_avg, psnr_global, ssim, ssim_db, metrics->worst_ssim, worst_ssim_sec);
+	
+	if (metrics->file != NULL)
+		fprintf(metrics->file, "\n\t],\n\t\"summary\": {\n\t\t\"frames\": %ld,\n\t\t\"psnr_y\": %.3f,\n\t\t\"psnr_u\": %.3f,\n\t\t\"psnr_v\": %.3f,\n"
+			"\t\t\"psnr\": %.3f,\n\t\t\"psnr_global\": %.3f,\n\t\t\"ssim\": %.5f,\n\t\t\"ssim_db\": %.3f,\n\t\t\"worst_ssim\": %.5f,\n\t\t\"worst_ssim_time\": %.3f\n\t}\n}\n",
+			metrics->frames, psnr[0], psnr[1], psnr[2], psnr_avg, psnr_global, ssim, ssim_db, metrics->worst_ssim, worst_ssim_sec);
+	enc_metrics_close(metrics);
+}
+
+
+//
+// libavfilter stuff
+//
+
+bool enc_avfilter_build_graph(
+	AVCodecContext *video_codec_context_ptr, AVRational time_base, AVRational sample_aspect_ratio, const char *filters,
+	AVFilterGraph **filter_graph_dptr, AVFilterContext **src_filter_context_dptr, AVFilterContext **sink_filter_context_dptr
+){
+	char filter_args[255];
+	int error = 0;
+	
+	*filter_graph_dptr = avfilter_graph_alloc();
+	
+	// Build the gateway (source) into the filter pipeline
+	snprintf(filter_args, sizeof(filter_args), "%d:%d:%d:%d:%d:%d:%d",
+		video_codec_context_ptr->width, video_codec_context_ptr->height, video_codec_context_ptr->pix_fmt,
+		time_base.num, time_base.den,
+		sample_aspect_ratio.num, sample_aspect_ratio.den);
+	
+	*src_filter_context_dptr = NULL;
+	error = avfilter_graph_create_filter(src_filter_context_dptr, avfilter_get_by_name("buffer"), "src", filter_args, NULL, *filter_graph_dptr);
+	if (error < 0){
+		enc_av_perror("avfilter_graph_create_filter", error);
+		return false;
+	}
+	
+	// Build the output sink of the filter pipeline
+	enum PixelFormat pix_fmts[] = { video_codec_context_ptr->pix_fmt, PIX_FMT_NONE };
+	*sink_filter_context_dptr = NULL;
+	error = avfilter_graph_create_filter(sink_filter_context_dptr, avfilter_get_by_name("buffersink"), "sink", "",  pix_fmts, *filter_graph_dptr);
+	if (error < 0){
+		enc_av_perror("avfilter_graph_create_filter", error);
+		return false;
+	}
+	
+	// A NULL string will crash avfilter_graph_parse(). If we got no filter string to wire up
+	// just connect the source with the sink.
+	if (filters != NULL && strlen(filters) > 0) {
+		// Build the use defined filter graph between the two ends
+		AVFilterInOut *outputs = avfilter_inout_alloc();
+		AVFilterInOut *inputs = avfilter_inout_alloc();
+		
+		outputs->name = av_strdup("in");
+		outputs->filter_ctx = *src_filter_context_dptr;
+		outputs->pad_idx = 0;
+		outputs->next = NULL;
+		
+		inputs->name = av_strdup("out");
+		inputs->filter_ctx = *sink_filter_context_dptr;
+		inputs->pad_idx = 0;
+		inputs->next = NULL;
+		
+		error = avfilter_graph_parse(*filter_graph_dptr, filters, &inputs, &outputs, NULL);
+		if (error != 0){
+			enc_av_perror("avfilter_graph_parse", error);
+			return false;
+		}
+	} else {
+		error = avfilter_link(*src_filter_context_dptr, 0, *sink_filter_context_dptr, 0);
+		if (error != 0){
+			enc_av_perror("avfilter_link", error);
+			return false;
+		}
+	}
+	
+	error = avfilter_graph_config(*filter_graph_dptr, NULL);
+	if (error < 0){
+		enc_av_perror("avfilter_graph_config", error);
+		return false;
+	}
+	
+	return true;
+}
+
+/**
+ * Tries to pull one frame out of the filter pipeline and copy it into the input picture of the x264 context
+ * input pixture. Returns `true` if a frame was copied to the x264 context, `false` if the pipeline is empty,
+ * at its end (after the end of stream was pushed into it) or broken.
+ */
+bool enc_avfilter_pull_to_x264_context(AVFilterContext *sink_ptr, AVFrame *frame_ptr, x264_context_t *x264_ptr){
+	int error;
+	AVFilterBufferRef *buffer_ref_ptr = NULL;
+	
+	error = avfilter_poll_frame(sink_ptr->inputs[0]);
+	if (error > 0) {
+		// A frame is ready, get it out of the pipeline
+		error = av_vsink_buffer_get_video_buffer_ref(sink_ptr, &buffer_ref_ptr, 0);
+		if (error < 0){
+			enc_av_perror("av_vsink_buffer_get_video_buffer_ref", error);
+			return false;
+		}
+		error = avfilter_fill_frame_from_video_buffer_ref(frame_ptr, buffer_ref_ptr);
+		if (error < 0){
+			enc_av_perror("avfilter_fill_frame_from_video_buffer_ref", error);
+			avfilter_unref_buffer(buffer_ref_ptr);
+			return false;
+		}
+		
+		enc_debug("  filtered frame: pts: %ld, packet pts: %ld, packet dts: %ld\n", format_pts(frame_ptr->pts),
+			format_pts(frame_ptr->pkt_pts), frame_ptr->pkt_dts);
+		
+		// Copy it into the x264 context input picture. x264 needs strictly increasing PTS, rounding into a coarser
+		// time base might give us the same PTS twice.
+		int64_t pts = av_rescale_q(frame_ptr->pts, x264_ptr->input_time_base, x264_ptr->time_base) + x264_ptr->pts_offset;
+		if (x264_ptr->last_pts != AV_NOPTS_VALUE && pts <= x264_ptr->last_pts)
+			pts = x264_ptr->last_pts + 1;
+		x264_ptr->last_pts = pts;
+		
+		x264_ptr->pic_in.i_type = X264_TYPE_AUTO;
+		x264_ptr->pic_in.i_pts = pts;
+		sws_scale(x264_ptr->scaler, (const uint8_t * const*)frame_ptr->data,
+			frame_ptr->linesize, 0, frame_ptr->height,
+			x264_ptr->pic_in.img.plane, x264_ptr->pic_in.img.i_stride);
+		
+		// Free the buffer reference we got from the filter pipeline
+		avfilter_unref_buffer(buffer_ref_ptr);
+	} else if (error == 0 || error == AVERROR_EOF) {
+		// Pipeline empty or at its end
+		return false;
+	} else {
+		// Negative values are error codes
+		enc_av_perror("avfilter_poll_frame", error);
+		return false;
+	}
+	
+	return true;
+}
+
+
+//
+// Per title quality stuff (choosing the CRF with a low resolution probe encode)
+//
+
+// Number of segments sampled across the input and frames per segment
+#define ENC_PER_TITLE_SEGMENTS 5
+#define ENC_PER_TITLE_SEGMENT_FRAMES 24
+// Width of the probe encode, small enough that all probe encodes together take a few seconds
+#define ENC_PER_TITLE_WIDTH 480
+#define ENC_PER_TITLE_PRESET "veryfast"
+// CRFs of the probe encodes (ascending), the chosen CRF is interpolated between them
+static const double enc_per_title_crfs[] = { 16, 21, 26, 31, 36 };
+#define ENC_PER_TITLE_CRF_COUNT (sizeof(enc_per_title_crfs) / sizeof(enc_per_title_crfs[0]))
+// The bitrate of the probe is scaled by the pixel ratio to this power to guess the bitrate of the real
+// encode. Larger frames need fewer bits per pixel for the same CRF.
+#define ENC_PER_TITLE_PIXEL_EXPONENT 0.75
+
+/**
+ * Frames sampled for the probe encodes. The sampled frames go through the same filters as the real encode
+ * (crop, deinterlace, ...), the filtered frames are scaled down to the probe size (YUV 4:2:0, one after the
+ * other). `segments` is the segment of each frame, every segment starts with an IDR frame.
+ */
+typedef struct {
+	AVFilterContext *src_filter_context_ptr, *sink_filter_context_ptr;
+	AVCodecContext *video_codec_context_ptr;
+	int width, height;
+	struct SwsContext *scaler;
+	uint8_t *frames_ptr;
+	int frame_size, frame_count;
+	int segments[ENC_PER_TITLE_SEGMENTS * ENC_PER_TITLE_SEGMENT_FRAMES];
+} enc_per_title_t;
+
+static void enc_per_title_sample_frame(AVFrame *frame_ptr, int sample_index, void *data_ptr){
+	enc_per_title_t *probe = data_ptr;
+	
+	if (frame_ptr->pts == AV_NOPTS_VALUE || frame_ptr->pts == 0)
+		frame_ptr->pts = frame_ptr->pkt_pts;
+	enc_frame_pool_add_frame(probe->src_filter_context_ptr, probe->video_codec_context_ptr, frame_ptr);
+	
+	AVFilterBufferRef *buffer_ref_ptr = NULL;
+	while( avfilter_poll_frame(probe->sink_filter_context_ptr->inputs[0]) > 0 ){
+		if ( av_vsink_buffer_get_video_buffer_ref(probe->sink_filter_context_ptr, &buffer_ref_ptr, 0) < 0 )
+			break;
+		
+		if (probe->frame_count < ENC_PER_TITLE_SEGMENTS * ENC_PER_TITLE_SEGMENT_FRAMES){
+			uint8_t *y_ptr = probe->frames_ptr + probe->frame_count * probe->frame_size;
+			uint8_t *planes[4] = { y_ptr, y_ptr + probe->width * probe->height, y_ptr + probe->width * probe->height * 5 / 4, NULL };
+			int strides[4] = { probe->width, probe->width / 2, probe->width / 2, 0 };
+			sws_scale(probe->scaler, (const uint8_t * const*)buffer_ref_ptr->data, buffer_ref_ptr->linesize, 0, buffer_ref_ptr->video->h, planes, strides);
+			
+			probe->segments[probe->frame_count] = sample_index;
+			probe->frame_count++;
+		}
+		avfilter_unref_buffer(buffer_ref_ptr);
+	}
+}
+
+/**
+ * Encodes all sampled frames with the CRF. Returns the average SSIM of the frames and the average size of
+ * an encoded frame in bytes.
+ */
+static bool enc_per_title_encode(enc_per_title_t *probe, double crf, const char *tune, AVRational frame_rate, double *ssim_ptr, double *frame_bytes_ptr){
+	x264_param_t params;
+	if ( x264_param_default_preset(&params, ENC_PER_TITLE_PRESET, tune) != 0 ){
+		fprintf(stderr, "x264: failed to set preset %s and tune %s\n", ENC_PER_TITLE_PRESET, tune);
+		return false;
+	}
+	params.i_width = probe->width;
+	params.i_height = probe->height;
+	params.i_threads = enc_cpu_count() * 3 / 2;
+	params.i_fps_num = frame_rate.num;
+	params.i_fps_den = frame_rate.den;
+	params.i_log_level = X264_LOG_ERROR;
+	params.rc.i_rc_method = X264_RC_CRF;
+	params.rc.f_rf_constant = crf;
+	params.analyse.b_ssim = 1;
+	
+	x264_t *encoder = x264_encoder_open(&params);
+	if (encoder == NULL){
+		fprintf(stderr, "x264: failed to initialize probe encoder\n");
+		return false;
+	}
+	
+	x264_picture_t pic_in, pic_out;
+	x264_picture_init(&pic_in);
+	pic_in.img.i_csp = X264_CSP_I420;
+	pic_in.img.i_plane = 3;
+	pic_in.img.i_stride[0] = probe->width;
+	pic_in.img.i_stride[1] = pic_in.img.i_stride[2] = probe->width / 2;
+	
+	x264_nal_t *nals;
+	int nal_count, frames_out = 0;
+	int64_t bytes = 0;
+	double ssim_sum = 0;
+	for(int i = 0; ; i++){
+		int payload_size;
+		if (i < probe->frame_count){
+			// The frames are used as they are, x264 only reads the input picture
+			pic_in.img.plane[0] = probe->frames_ptr + i * probe->frame_size;
+			pic_in.img.plane[1] = pic_in.img.plane[0] + probe->width * probe->height;
+			pic_in.img.plane[2] = pic_in.img.plane[1] + probe->width * probe->height / 4;
+			pic_in.i_pts = i;
+			pic_in.i_type = (i == 0 || probe->segments[i] != probe->segments[i - 1]) ? X264_TYPE_IDR : X264_TYPE_AUTO;
+			payload_size = x264_encoder_encode(encoder, &nals, &nal_count, &pic_in, &pic_out);
+		} else if ( x264_encoder_delayed_frames(encoder) > 0 ) {
+			payload_size = x264_encoder_encode(encoder, &nals, &nal_count, NULL, &pic_out);
+		} else {
+			break;
+		}
+		
+		if (payload_size > 0){
+			bytes += payload_size;
+			ssim_sum += pic_out.prop.f_ssim;
+			frames_out++;
+		} else if (payload_size < 0) {
+			fprintf(stderr, "x264: probe encoder error\n");
+			break;
+		}
+	}
+	x264_encoder_close(encoder);
+	
+	if (frames_out == 0)
+		return false;
+	*ssim_ptr = ssim_sum / frames_out;
+	*frame_bytes_ptr = bytes / (double)frames_out;
+	return true;
+}
+
+/**
+ * Piecewise linear interpolation of `y` at `value`. `x` has to be monotonic (ascending or descending),
+ * outside of its range the `y` of the nearest end is used.
+ */
+static double enc_per_title_interpolate(const double *x, const double *y, int count, double value){
+	bool ascending = (x[count - 1] >= x[0]);
+	if ( ascending ? (value <= x[0]) : (value >= x[0]) )
+		return y[0];
+	for(int i = 0; i + 1 < count; i++){
+		bool inside = ascending ? (value <= x[i + 1]) : (value >= x[i + 1]);
+		if (inside)
+			return (x[i + 1] == x[i]) ? y[i] : y[i] + (y[i + 1] - y[i]) * (value - x[i]) / (x[i + 1] - x[i]);
+	}
+	return y[count - 1];
+}
+
+/**
+ * Picks the CRF for the input: a few short segments are piped through `filters` and encoded at a low
+ * resolution with a fast preset and several CRFs. The chosen CRF is the highest one whose probe still reaches
+ * `target_ssim`. If a bitrate band is given (kbit/s, 0 = no limit) the CRF is moved so the estimated bitrate
+ * of the real encode (`width` x `height`, the size of the filter output) stays inside the band.
+ *
+ * `quality_ptr` is left alone if the input can't be sampled. Returns `false` if the input is useless
+ * afterwards (see `enc_analysis_sample_frames()`).
+ */
+bool enc_per_title_quality(
+	AVFormatContext *format_context_ptr, int video_stream_index, AVCodecContext *video_codec_context_ptr,
+	AVRational input_time_base, AVRational input_sample_aspect_ratio, const char *filters,
+	int width, int height, AVRational frame_rate, const char *tune, double target_ssim, int min_bit_rate, int max_bit_rate,
+	float *quality_ptr
+){
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	
+	enc_per_title_t probe = { .video_codec_context_ptr = video_codec_context_ptr };
+	AVFilterGraph *filter_graph_ptr = NULL;
+	if ( ! enc_avfilter_build_graph(video_codec_context_ptr, input_time_base, input_sample_aspect_ratio, filters, &filter_graph_ptr, &probe.src_filter_context_ptr, &probe.sink_filter_context_ptr) ){
+		fprintf(stderr, "per title quality: failed to build the filters, keeping CRF %.1f\n", *quality_ptr);
+		avfilter_graph_free(&filter_graph_ptr);
+		return true;
+	}
+	
+	AVFilterLink *filter_output_ptr = probe.sink_filter_context_ptr->inputs[0];
+	probe.width = (width > ENC_PER_TITLE_WIDTH) ? ENC_PER_TITLE_WIDTH : width & ~1;
+	probe.height = (int64_t)height * probe.width / width & ~1;
+	probe.frame_size = probe.width * probe.height * 3 / 2;
+	probe.frames_ptr = av_malloc(ENC_PER_TITLE_SEGMENTS * ENC_PER_TITLE_SEGMENT_FRAMES * probe.frame_size);
+	probe.scaler = sws_getContext(filter_output_ptr->w, filter_output_ptr->h, filter_output_ptr->format,
+		probe.width, probe.height, PIX_FMT_YUV420P, SWS_BILINEAR, NULL, NULL, NULL);
+	if (probe.frames_ptr == NULL || probe.scaler == NULL){
+		fprintf(stderr, "per title quality: failed to allocate the probe frames\n");
+		av_free(probe.frames_ptr);
+		sws_freeContext(probe.scaler);
+		avfilter_graph_free(&filter_graph_ptr);
+		return true;
+	}
+	
+	int frames = enc_analysis_sample_frames(format_context_ptr, video_stream_index, video_codec_context_ptr,
+		ENC_PER_TITLE_SEGMENTS, ENC_PER_TITLE_SEGMENT_FRAMES, enc_per_title_sample_frame, &probe);
+	sws_freeContext(probe.scaler);
+	avfilter_graph_free(&filter_graph_ptr);
+	if (frames < 0){
+		av_free(probe.frames_ptr);
+		return false;
+	}
+	
+	// SSIM in dB and bitrate in log scale, both are close to linear in the CRF
+	double ssim_db[ENC_PER_TITLE_CRF_COUNT], log_bit_rates[ENC_PER_TITLE_CRF_COUNT];
+	double pixel_scale = pow((double)width * height / (probe.width * probe.height), ENC_PER_TITLE_PIXEL_EXPONENT);
+	bool probed = (probe.frame_count > 0);
+	for(int i = 0; i < ENC_PER_TITLE_CRF_COUNT && probed; i++){
+		double ssim, frame_bytes;
+		probed = enc_per_title_encode(&probe, enc_per_title_crfs[i], tune, frame_rate, &ssim, &frame_bytes);
+		if (!probed)
+			break;
+		ssim_db[i] = -10 * log10(1 - fmin(ssim, 0.999999));
+		log_bit_rates[i] = log(frame_bytes * 8 * av_q2d(frame_rate) / 1000 * pixel_scale);
+		enc_debug("per title quality: crf %.0f: ssim %.5f (%.2f dB), %.0f kbit/s estimated\n", enc_per_title_crfs[i], ssim, ssim_db[i], exp(log_bit_rates[i]));
+	}
+	av_free(probe.frames_ptr);
+	
+	if (!probed){
+		fprintf(stderr, "per title quality: probe encode failed, keeping CRF %.1f\n", *quality_ptr);
+		return true;
+	}
+	
+	double target_db = -10 * log10(1 - target_ssim);
+	double crf = enc_per_title_interpolate(ssim_db, enc_per_title_crfs, ENC_PER_TITLE_CRF_COUNT, target_db);
+	if (max_bit_rate > 0)
+		crf = fmax(crf, enc_per_title_interpolate(log_bit_rates, enc_per_title_crfs, ENC_PER_TITLE_CRF_COUNT, log(max_bit_rate)));
+	if (min_bit_rate > 0)
+		crf = fmin(crf, enc_per_title_interpolate(log_bit_rates, enc_per_title_crfs, ENC_PER_TITLE_CRF_COUNT, log(min_bit_rate)));
+	*quality_ptr = round(crf * 10) / 10;
+	
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("Per title quality: CRF %.1f, about %.0f kbit/s (probed %d frames at %dx%d in %.1f s)\n", *quality_ptr,
+		exp(enc_per_title_interpolate(enc_per_title_crfs, log_bit_rates, ENC_PER_TITLE_CRF_COUNT, *quality_ptr)),
+		probe.frame_count, probe.width, probe.height, (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1000000000.0);
+	
+	return true;
+}
+
+
+//
+// Duplicate frame detection
+//
+
+/**
+ * State of the duplicate frame detection. Contains a copy of the last frame that was encoded.
+ */
+typedef struct {
+	x264_picture_t reference;
+	bool reference_valid;
+	// Maximum sum of absolute differences of a 16x16 block for two frames to count as identical
+	int block_threshold;
+	// Maximum PTS distance (x264 time base) between two encoded frames
+	int64_t max_gap;
+	int64_t dropped_frames;
+	// Set if the last frame pulled out of the filter pipeline was dropped
+	bool last_dropped;
+} enc_dedup_t;
+
+bool enc_dedup_open(int width, int height, float threshold, float max_gap_sec, AVRational time_base, enc_dedup_t *dedup){
+	if ( x264_picture_alloc(&dedup->reference, X264_CSP_I420, width, height) != 0 ){
+		fprintf(stderr, "dedup: could not allocate reference picture\n");
+		return false;
+	}
+	
+	dedup->reference_valid = false;
+	dedup->block_threshold = threshold * 16 * 16;
+	dedup->max_gap = max_gap_sec / av_q2d(time_base);
+	dedup->dropped_frames = 0;
+	dedup->last_dropped = false;
+	
+	return true;
+}
+
+void enc_dedup_close(enc_dedup_t *dedup){
+	x264_picture_clean(&dedup->reference);
+}
+
+/**
+ * Sum of absolute differences of 16 pixels. Uses SSE2 (psadbw) if available.
+ */
+static inline int enc_dedup_sad16(const uint8_t *a_ptr, const uint8_t *b_ptr){
+#ifdef __SSE2__
+	__m128i sad = _mm_sad_epu8(_mm_loadu_si128((const __m128i*)a_ptr), _mm_loadu_si128((const __m128i*)b_ptr));
+	return _mm_cvtsi128_si32(sad) + _mm_cvtsi128_si32(_mm_srli_si128(sad, 8));
+#else
+	int sum = 0;
+	for(int i = 0; i < 16; i++)
+		sum += abs(a_ptr[i] - b_ptr[i]);
+	return sum;
+#endif
+}
+
+/**
+ * Compares one plane in blocks of 16x16 pixels. Returns `true` if no block exceeds the threshold.
+ * Stops at the first block that differs, so frames with changes are usually rejected quickly.
+ */
+static bool enc_dedup_plane_equal(const uint8_t *a_ptr, int a_stride, const uint8_t *b_ptr, int b_stride, int width, int height, int threshold){
+	int block_sums[(width + 15) / 16];
+	
+	for(int block_y = 0; block_y < height; block_y += 16){
+		memset(block_sums, 0, sizeof(block_sums));
+		
+		for(int y = block_y; y < block_y + 16 && y < height; y++){
+			const uint8_t *a_line_ptr = a_ptr + y * a_stride, *b_line_ptr = b_ptr + y * b_stride;
+			int x = 0;
+			for(; x + 16 <= width; x += 16)
+				block_sums[x / 16] += enc_dedup_sad16(a_line_ptr + x, b_line_ptr + x);
+			for(; x < width; x++)
+				block_sums[x / 16] += abs(a_line_ptr[x] - b_line_ptr[x]);
+		}
+		
+		for(int i = 0; i < (width + 15) / 16; i++){
+			if (block_sums[i] > threshold)
+				return false;
+		}
+	}
+	
+	return true;
+}
+
+/**
+ * Returns `true` if the picture is a duplicate of the last encoded one and should not be encoded.
+ * Otherwise the picture becomes the new reference. The dropped time is added to the duration of
+ * the previous frame since the MP4 sample durations are calculated from the DTS differences.
+ */
+bool enc_dedup_drop_frame(enc_dedup_t *dedup, x264_picture_t *pic_ptr, int width, int height){
+	if ( dedup->reference_valid && pic_ptr->i_pts - dedup->reference.i_pts < dedup->max_gap ){
+		bool equal = true;
+		for(int plane = 0; plane < 3 && equal; plane++){
+			int plane_width = (plane == 0) ? width : width / 2, plane_height = (plane == 0) ? height : height / 2;
+			equal = enc_dedup_plane_equal(pic_ptr->img.plane[plane], pic_ptr->img.i_stride[plane],
+				dedup->reference.img.plane[plane], dedup->reference.img.i_stride[plane],
+				plane_width, plane_height, dedup->block_threshold);
+		}
+		
+		if (equal){
+			enc_debug("  dedup: dropping frame with pts %ld\n", pic_ptr->i_pts);
+			dedup->dropped_frames++;
+			dedup->last_dropped = true;
+			return true;
+		}
+	}
+	
+	for(int plane = 0; plane < 3; plane++){
+		int plane_width = (plane == 0) ? width : width / 2, plane_height = (plane == 0) ? height : height / 2;
+		for(int y = 0; y < plane_height; y++)
+			memcpy(dedup->reference.img.plane[plane] + y * dedup->reference.img.i_stride[plane],
+				pic_ptr->img.plane[plane] + y * pic_ptr->img.i_stride[plane], plane_width);
+	}
+	dedup->reference.i_pts = pic_ptr->i_pts;
+	dedup->reference_valid = true;
+	dedup->last_dropped = false;
+	
+	return false;
+}
+
+
+//
+// Snapshot stuff (poster frame and sprite sheets)
+//
+
+/**
+ * Returns the pixel format used to store an image in the specified file: PIX_FMT_RGB24 for PNG files,
+ * PIX_FMT_YUVJ420P (JPEG) for everything else.
+ */
+enum PixelFormat enc_image_pix_fmt(const char *filename){
+	const char *extension_ptr = strrchr(filename, '.');
+	if (extension_ptr != NULL && strcasecmp(extension_ptr, ".png") == 0)
+		return PIX_FMT_RGB24;
+	return PIX_FMT_YUVJ420P;
+}
+
+/**
+ * Encodes the picture with the libavcodec PNG or JPEG encoder (depending on the pixel format, see
+ * `enc_image_pix_fmt()`) and writes it into the specified file.
+ */
+bool enc_image_write(const char *filename, AVPicture *picture_ptr, enum PixelFormat pix_fmt, int width, int height){
+	AVCodec *codec_ptr = avcodec_find_encoder( (pix_fmt == PIX_FMT_RGB24) ? CODEC_ID_PNG : CODEC_ID_MJPEG );
+	if (codec_ptr == NULL){
+		fprintf(stderr, "snapshots: found no image encoder for %s\n", filename);
+		return false;
+	}
+	
+	AVCodecContext *codec_context_ptr = avcodec_alloc_context3(codec_ptr);
+	codec_context_ptr->width = width;
+	codec_context_ptr->height = height;
+	codec_context_ptr->pix_fmt = pix_fmt;
+	codec_context_ptr->time_base = (AVRational){ .num = 1, .den = 25 };
+	// Use a fixed quantizer (set via the frame quality below), only used by the JPEG encoder
+	codec_context_ptr->flags |= CODEC_FLAG_QSCALE;
+	
+	if ( avcodec_open(codec_context_ptr, codec_ptr) != 0 ){
+		fprintf(stderr, "snapshots: initialization of image encoder %s failed\n", codec_ptr->name);
+		av_free(codec_context_ptr);
+		return false;
+	}
+	
+	AVFrame *frame_ptr = avcodec_alloc_frame();
+	for(int i = 0; i < 4; i++){
+		frame_ptr->data[i] = picture_ptr->data[i];
+		frame_ptr->linesize[i] = picture_ptr->linesize[i];
+	}
+	frame_ptr->quality = 3 * FF_QP2LAMBDA;
+	
+	// Enough for uncompressed RGB (worst case of PNG) plus headers
+	int buffer_size = width * height * 4 + 4096;
+	uint8_t *buffer_ptr = av_malloc(buffer_size);
+	int image_size = (buffer_ptr != NULL) ? avcodec_encode_video(codec_context_ptr, buffer_ptr, buffer_size, frame_ptr) : -1;
+	
+	bool success = false;
+	if (image_size > 0){
+		FILE *file = fopen(filename, "wb");
+		if (file != NULL){
+			success = (fwrite(buffer_ptr, image_size, 1, file) == 1);
+			success = (fclose(file) == 0) && success;
+		}
+		if (!success)
+			perror(filename);
+	} else {
+		fprintf(stderr, "snapshots: failed to encode image %s\n", filename);
+	}
+	
+	av_free(buffer_ptr);
+	av_free(frame_ptr);
+	avcodec_close(codec_context_ptr);
+	av_free(codec_context_ptr);
+	
+	return success;
+}
+
+/**
+ * State of the snapshot outputs. The snapshots are taken from the x264 input pictures (I420) so they
+ * show exactly what is encoded.
+ */
+typedef struct {
+	int width, height;
+	AVRational time_base;
+	// PTS of the first frame, all snapshot times are relative to it
+	int64_t first_pts;
+	
+	// Poster frame, written once as soon as the poster time is reached
+	const char *poster_file;
+	int64_t poster_pts;
+	bool poster_written;
+	int poster_width, poster_height;
+	
+	// Sprite sheets with `columns` x `rows` thumbnails each. The sheets are named like the sprite
+	// file with the sheet number appended (e.g. "sheet-001.jpg"). The WebVTT index has the same name
+	// with a ".vtt" extension.
+	char sprite_base[1024], sprite_extension[16];
+	enum PixelFormat sprite_pix_fmt;
+	int thumb_width, thumb_height, columns, rows;
+	int64_t interval, next_pts;
+	struct SwsContext *thumb_scaler;
+	AVPicture sheet;
+	int sheet_index, tile_count;
+	FILE *vtt_file;
+} enc_snapshots_t;
+
+/**
+ * Fills the sprite sheet with black so unused tiles of the last sheet don't contain garbage.
+ */
+static void enc_snapshots_clear_sheet(enc_snapshots_t *snap){
+	int sheet_height = snap->rows * snap->thumb_height;
+	if (snap->sprite_pix_fmt == PIX_FMT_RGB24) {
+		memset(snap->sheet.data[0], 0, snap->sheet.linesize[0] * sheet_height);
+	} else {
+		memset(snap->sheet.data[0], 0, snap->sheet.linesize[0] * sheet_height);
+		memset(snap->sheet.data[1], 128, snap->sheet.linesize[1] * sheet_height / 2);
+		memset(snap->sheet.data[2], 128, snap->sheet.linesize[2] * sheet_height / 2);
+	}
+}
+
+bool enc_snapshots_open(
+	int width, int height, AVRational sample_aspect_ratio, AVRational time_base, double duration_sec,
+	const char *poster_file, const char *sprite_file, float interval_sec, int thumb_width, enc_snapshots_t *snap
+){
+	// Snapshots are shown with square pixels so use the display aspect ratio
+	double display_aspect_ratio = (double)width / height;
+	if (sample_aspect_ratio.num > 0 && sample_aspect_ratio.den > 0)
+		display_aspect_ratio *= av_q2d(sample_aspect_ratio);
+	
+	snap->width = width;
+	snap->height = height;
+	snap->time_base = time_base;
+	snap->first_pts = AV_NOPTS_VALUE;
+	
+	snap->poster_file = poster_file;
+	snap->poster_pts = (duration_sec > 0) ? 0.1 * duration_sec / av_q2d(time_base) : 0;
+	snap->poster_written = false;
+	snap->poster_height = height;
+	snap->poster_width = (int)(height * display_aspect_ratio + 1) & ~1;
+	
+	snap->sprite_base[0] = '\0';
+	snap->thumb_scaler = NULL;
+	snap->vtt_file = NULL;
+	if (sprite_file == NULL)
+		return true;
+	
+	// Split the sprite file into base name and extension (JPEG if there is none)
+	const char *extension_ptr = strrchr(sprite_file, '.'), *slash_ptr = strrchr(sprite_file, '/');
+	if (extension_ptr == NULL || (slash_ptr != NULL && extension_ptr < slash_ptr)){
+		snprintf(snap->sprite_base, sizeof(snap->sprite_base), "%s", sprite_file);
+		snprintf(snap->sprite_extension, sizeof(snap->sprite_extension), ".jpg");
+	} else {
+		snprintf(snap->sprite_base, sizeof(snap->sprite_base), "%.*s", (int)(extension_ptr - sprite_file), sprite_file);
+		snprintf(snap->sprite_extension, sizeof(snap->sprite_extension), "%s", extension_ptr);
+	}
+	snap->sprite_pix_fmt = enc_image_pix_fmt(snap->sprite_extension);
+	
+	snap->thumb_width = thumb_width & ~1;
+	snap->thumb_height = (int)(thumb_width / display_aspect_ratio + 1) & ~1;
+	snap->columns = 10;
+	snap->rows = 10;
+	snap->interval = interval_sec / av_q2d(time_base);
+	if (snap->interval < 1)
+		snap->interval = 1;
+	snap->next_pts = 0;
+	snap->sheet_index = 1;
+	snap->tile_count = 0;
+	
+	snap->thumb_scaler = sws_getContext(width, height, PIX_FMT_YUV420P,
+		snap->thumb_width, snap->thumb_height, snap->sprite_pix_fmt, SWS_FAST_BILINEAR, NULL, NULL, NULL);
+	if (snap->thumb_scaler == NULL){
+		fprintf(stderr, "snapshots: failed to create thumbnail scaler\n");
+		return false;
+	}
+	
+	if ( avpicture_alloc(&snap->sheet, snap->sprite_pix_fmt, snap->columns * snap->thumb_width, snap->rows * snap->thumb_height) != 0 ){
+		fprintf(stderr, "snapshots: failed to allocate sprite sheet\n");
+		return false;
+	}
+	enc_snapshots_clear_sheet(snap);
+	
+	char vtt_filename[1024 + 4];
+	snprintf(vtt_filename, sizeof(vtt_filename), "%s.vtt", snap->sprite_base);
+	snap->vtt_file = fopen(vtt_filename, "w");
+	if (snap->vtt_file == NULL){
+		perror(vtt_filename);
+		return false;
+	}
+	fprintf(snap->vtt_file, "WEBVTT\n\n");
+	
+	return true;
+}
+
+/**
+ * Writes the current sprite sheet (only the rows used so far) and starts a new one.
+ */
+static bool enc_snapshots_write_sheet(enc_snapshots_t *snap){
+	if (snap->tile_count == 0)
+		return true;
+	
+	char filename[1024 + 32];
+	snprintf(filename, sizeof(filename), "%s-%03d%s", snap->sprite_base, snap->sheet_index, snap->sprite_extension);
+	
+	int used_rows = (snap->tile_count + snap->columns - 1) / snap->columns;
+	bool success = enc_image_write(filename, &snap->sheet, snap->sprite_pix_fmt, snap->columns * snap->thumb_width, used_rows * snap->thumb_height);
+	enc_debug("snapshots: wrote sprite sheet %s with %d thumbnails\n", filename, snap->tile_count);
+	
+	snap->sheet_index++;
+	snap->tile_count = 0;
+	enc_snapshots_clear_sheet(snap);
+	
+	return success;
+}
+
+static void enc_snapshots_vtt_time(FILE *file, int64_t pts, AVRational time_base){
+	display_time_t time = display_time(pts, time_base);
+	int milliseconds = (time.entire_seconds - (int64_t)time.entire_seconds) * 1000;
+	fprintf(file, "%02d:%02d:%02d.%03d", time.hours, time.minutes, time.seconds, milliseconds);
+}
+
+/**
+ * Takes the poster and sprite snapshots if the picture is at the right time.
+ */
+void enc_snapshots_add_frame(enc_snapshots_t *snap, x264_picture_t *pic_ptr){
+	if (snap->first_pts == AV_NOPTS_VALUE)
+		snap->first_pts = pic_ptr->i_pts;
+	int64_t pts = pic_ptr->i_pts - snap->first_pts;
+	
+	if (snap->poster_file != NULL && !snap->poster_written && pts >= snap->poster_pts){
+		// Only one picture, use a better scaler than for the thumbnails
+		enum PixelFormat pix_fmt = enc_image_pix_fmt(snap->poster_file);
+		struct SwsContext *scaler = sws_getContext(snap->width, snap->height, PIX_FMT_YUV420P,
+			snap->poster_width, snap->poster_height, pix_fmt, SWS_BICUBIC, NULL, NULL, NULL);
+		AVPicture poster;
+		
+		if ( scaler != NULL && avpicture_alloc(&poster, pix_fmt, snap->poster_width, snap->poster_height) == 0 ){
+			sws_scale(scaler, (const uint8_t * const*)pic_ptr->img.plane, pic_ptr->img.i_stride, 0, snap->height,
+				poster.data, poster.linesize);
+			if ( enc_image_write(snap->poster_file, &poster, pix_fmt, snap->poster_width, snap->poster_height) )
+				printf("Poster frame written to %s\n", snap->poster_file);
+			avpicture_free(&poster);
+		} else {
+			fprintf(stderr, "snapshots: failed to prepare poster frame\n");
+		}
+		
+		sws_freeContext(scaler);
+		snap->poster_written = true;
+	}
+	
+	if (snap->thumb_scaler != NULL && pts >= snap->next_pts){
+		// Scale the thumbnail directly into its tile of the sprite sheet
+		int x = (snap->tile_count % snap->columns) * snap->thumb_width;
+		int y = (snap->tile_count / snap->columns) * snap->thumb_height;
+		uint8_t *tile_planes[4] = { NULL, NULL, NULL, NULL };
+		if (snap->sprite_pix_fmt == PIX_FMT_RGB24) {
+			tile_planes[0] = snap->sheet.data[0] + y * snap->sheet.linesize[0] + x * 3;
+		} else {
+			tile_planes[0] = snap->sheet.data[0] + y * snap->sheet.linesize[0] + x;
+			tile_planes[1] = snap->sheet.data[1] + y / 2 * snap->sheet.linesize[1] + x / 2;
+			tile_planes[2] = snap->sheet.data[2] + y / 2 * snap->sheet.linesize[2] + x / 2;
+		}
+		sws_scale(snap->thumb_scaler, (const uint8_t * const*)pic_ptr->img.plane, pic_ptr->img.i_stride, 0, snap->height,
+			tile_planes, snap->sheet.linesize);
+		
+		// Index entry: the thumbnail is shown for the whole interval
+		int64_t cue_start = snap->next_pts;
+		while (snap->next_pts <= pts)
+			snap->next_pts += snap->interval;
+		
+		enc_snapshots_vtt_time(snap->vtt_file, cue_start, snap->time_base);
+		fprintf(snap->vtt_file, " --> ");
+		enc_snapshots_vtt_time(snap->vtt_file, snap->next_pts, snap->time_base);
+		const char *sheet_name_ptr = strrchr(snap->sprite_base, '/');
+		sheet_name_ptr = (sheet_name_ptr != NULL) ? sheet_name_ptr + 1 : snap->sprite_base;
+		fprintf(snap->vtt_file, "\n%s-%03d%s#xywh=%d,%d,%d,%d\n\n", sheet_name_ptr, snap->sheet_index, snap->sprite_extension,
+			x, y, snap->thumb_width, snap->thumb_height);
+		
+		snap->tile_count++;
+		if (snap->tile_count == snap->columns * snap->rows)
+			enc_snapshots_write_sheet(snap);
+	}
+}
+
+/**
+ * Writes the last sprite sheet and frees everything.
+ */
+void enc_snapshots_close(enc_snapshots_t *snap){
+	if (snap->thumb_scaler != NULL){
+		enc_snapshots_write_sheet(snap);
+		sws_freeContext(snap->thumb_scaler);
+		avpicture_free(&snap->sheet);
+	}
+	
+	if (snap->vtt_file != NULL)
+		fclose(snap->vtt_file);
+}
+
+
+//
+// Loudness stuff (EBU R128)
+//
+
+// Histogram of the gating block loudness, 0.1 LU per bin from -70 LUFS (absolute gate) to +5 LUFS
+#define ENC_LOUDNESS_BINS 751
+// Taps of each phase of the 4x oversampling filter for the true peak measurement
+#define ENC_LOUDNESS_TP_TAPS 12
+
+/**
+ * State of the loudness measurement (ITU-R BS.1770 / EBU R128) and of the streaming normalization.
+ * 
+ * The integrated loudness is only known at the end. The normalization therefore uses the integrated
+ * loudness of everything seen so far as gain target and changes the gain slowly. A look-ahead limiter
+ * keeps the samples below the ceiling. The exact values are written to the sidecar so a later remux
+ * can apply a precise gain.
+ */
+typedef struct {
+	int channels, sample_rate;
+	
+	// K-weighting filter: two biquads (high shelf and high pass) with a state per channel and stage
+	double b[2][3], a[2][3];
+	double *filter_state_ptr;
+	double channel_weights[8];
+	
+	// Energy of 100ms sub blocks. 4 consecutive ones form a 400ms gating block (75% overlap).
+	int subblock_length, subblock_fill;
+	double subblock_energy, subblock_history[3];
+	int subblock_count;
+	uint64_t block_counts[ENC_LOUDNESS_BINS];
+	double block_energies[ENC_LOUDNESS_BINS];
+	
+	// True peak: polyphase 4x oversampling filter with a history of the last input samples per channel
+	double tp_coefficients[4][ENC_LOUDNESS_TP_TAPS];
+	double *tp_history_ptr;
+	double true_peak, sample_peak;
+	
+	// Normalization
+	bool normalize;
+	double target, gain, ceiling;
+	// Look-ahead limiter: delay line of gained frames, the gain each frame needs to stay below the ceiling
+	// and a monotonic queue (frame numbers) to get the minimum of those gains in the window. The counters are
+	// 64 bit, follow and live mode can run for days.
+	int lookahead;
+	int64_t frames_in;
+	double *delay_ptr, *required_gain_ptr;
+	int64_t *min_queue_ptr, min_queue_start, min_queue_end;
+	double limiter_gain, release;
+} enc_loudness_t;
+
+/**
+ * Calculates the K-weighting filter coefficients for the sample rate (BS.1770, as done by libebur128).
+ */
+static void enc_loudness_init_filter(enc_loudness_t *loud){
+	double f0 = 1681.974450955533, G = 3.999843853973347, Q = 0.7071752369554196;
+	double K = tan(M_PI * f0 / loud->sample_rate);
+	double Vh = pow(10.0, G / 20.0), Vb = pow(Vh, 0.4996667741545416);
+	double a0 = 1.0 + K / Q + K * K;
+	
+	loud->b[0][0] = (Vh + Vb * K / Q + K * K) / a0;
+	loud->b[0][1] = 2.0 * (K * K - Vh) / a0;
+	loud->b[0][2] = (Vh - Vb * K / Q + K * K) / a0;
+	loud->a[0][0] = 1.0;
+	loud->a[0][1] = 2.0 * (K * K - 1.0) / a0;
+	loud->a[0][2] = (1.0 - K / Q + K * K) / a0;
+	
+	f0 = 38.13547087602444;
+	Q = 0.5003270373238773;
+	K = tan(M_PI * f0 / loud->sample_rate);
+	loud->b[1][0] = 1.0;
+	loud->b[1][1] = -2.0;
+	loud->b[1][2] = 1.0;
+	loud->a[1][0] = 1.0;
+	loud->a[1][1] = 2.0 * (K * K - 1.0) / (1.0 + K / Q + K * K);
+	loud->a[1][2] = (1.0 - K / Q + K * K) / (1.0 + K / Q + K * K);
+}
+
+bool enc_loudness_open(int sample_rate, int channels, bool normalize, double target, enc_loudness_t *loud){
+	memset(loud, 0, sizeof(enc_loudness_t));
+	loud->channels = channels;
+	loud->sample_rate = sample_rate;
+	enc_loudness_init_filter(loud);
+	
+	// Channel weights for the libav channel order of 5.1 (L R C LFE Ls Rs): the LFE is ignored and the
+	// surround channels get +1.5 dB.
+	for(int i = 0; i < 8; i++)
+		loud->channel_weights[i] = 1.0;
+	if (channels >= 6){
+		loud->channel_weights[3] = 0.0;
+		loud->channel_weights[4] = 1.41;
+		loud->channel_weights[5] = 1.41;
+	}
+	
+	loud->subblock_length = sample_rate / 10;
+	
+	// Windowed sinc lowpass for 4x oversampling, split into 4 phases
+	for(int i = 0; i < 4 * ENC_LOUDNESS_TP_TAPS; i++){
+		double t = (i - (4 * ENC_LOUDNESS_TP_TAPS - 1) / 2.0) / 4.0;
+		double sinc = (t == 0) ? 1.0 : sin(M_PI * t) / (M_PI * t);
+		double window = 0.5 - 0.5 * cos(2 * M_PI * (i + 0.5) / (4 * ENC_LOUDNESS_TP_TAPS));
+		loud->tp_coefficients[i % 4][i / 4] = sinc * window;
+	}
+	
+	loud->normalize = normalize;
+	loud->target = target;
+	loud->gain = 1.0;
+	loud->limiter_gain = 1.0;
+	// Sample ceiling of -1 dBFS, 10ms look-ahead and 100ms release
+	loud->ceiling = pow(10.0, -1.0 / 20.0) * 32767.0;
+	loud->lookahead = sample_rate / 100;
+	loud->release = 1.0 - exp(-1.0 / (0.1 * sample_rate));
+	
+	loud->filter_state_ptr = av_mallocz(channels * 4 * sizeof(double));
+	loud->tp_history_ptr = av_mallocz(channels * ENC_LOUDNESS_TP_TAPS * sizeof(double));
+	loud->delay_ptr = av_mallocz((loud->lookahead + 1) * channels * sizeof(double));
+	loud->required_gain_ptr = av_mallocz((loud->lookahead + 1) * sizeof(double));
+	loud->min_queue_ptr = av_mallocz((loud->lookahead + 1) * sizeof(int64_t));
+	
+	if (loud->filter_state_ptr == NULL || loud->tp_history_ptr == NULL || loud->delay_ptr == NULL || loud->required_gain_ptr == NULL || loud->min_queue_ptr == NULL){
+		fprintf(stderr, "loudness: failed to allocate buffers\n");
+		return false;
+	}
+	
+	return true;
+}
+
+void enc_loudness_close(enc_loudness_t *loud){
+	av_free(loud->filter_state_ptr);
+	av_free(loud->tp_history_ptr);
+	av_free(loud->delay_ptr);
+	av_free(loud->required_gain_ptr);
+	av_free(loud->min_queue_ptr);
+}
+
+/**
+ * Returns the integrated loudness (LUFS) of everything measured so far or -HUGE_VAL if nothing was loud
+ * enough to pass the absolute gate.
+ */
+double enc_loudness_integrated(enc_loudness_t *loud){
+	double energy = 0;
+	uint64_t count = 0;
+	for(int i = 0; i < ENC_LOUDNESS_BINS; i++){
+		energy += loud->block_energies[i];
+		count += loud->block_counts[i];
+	}
+	if (count == 0)
+		return -HUGE_VAL;
+	
+	// Relative gate: 10 LU below the loudness of all blocks above the absolute gate
+	double relative_gate = -0.691 + 10 * log10(energy / count) - 10.0;
+	int first_bin = (relative_gate + 70.0) * 10.0;
+	if (first_bin < 0)
+		first_bin = 0;
+	
+	energy = 0;
+	count = 0;
+	for(int i = first_bin; i < ENC_LOUDNESS_BINS; i++){
+		energy += loud->block_energies[i];
+		count += loud->block_counts[i];
+	}
+	
+	return (count > 0) ? -0.691 + 10 * log10(energy / count) : -HUGE_VAL;
+}
+
+/**
+ * Measures one interleaved frame of samples (one sample per channel).
+ */
+static void enc_loudness_measure_frame(enc_loudness_t *loud, const float *frame_ptr){
+	for(int c = 0; c < loud->channels; c++){
+		double x = frame_ptr[c] / 32768.0;
+		
+		// Sample and true peak
+		if (fabs(x) > loud->sample_peak)
+			loud->sample_peak = fabs(x);
+		
+		double *history_ptr = loud->tp_history_ptr + c * ENC_LOUDNESS_TP_TAPS;
+		memmove(history_ptr + 1, history_ptr, (ENC_LOUDNESS_TP_TAPS - 1) * sizeof(double));
+		history_ptr[0] = x;
+		for(int phase = 0; phase < 4; phase++){
+			double y = 0;
+			for(int j = 0; j < ENC_LOUDNESS_TP_TAPS; j++)
+				y += loud->tp_coefficients[phase][j] * history_ptr[j];
+			if (fabs(y) > loud->true_peak)
+				loud->true_peak = fabs(y);
+		}
+		
+		// K-weighting (two biquads, transposed direct form II)
+		double *state_ptr = loud->filter_state_ptr + c * 4;
+		for(int stage = 0; stage < 2; stage++){
+			double y = loud->b[stage][0] * x + state_ptr[stage * 2];
+			state_ptr[stage * 2] = loud->b[stage][1] * x - loud->a[stage][1] * y + state_ptr[stage * 2 + 1];
+			state_ptr[stage * 2 + 1] = loud->b[stage][2] * x - loud->a[stage][2] * y;
+			x = y;
+		}
+		
+		loud->subblock_energy += loud->channel_weights[c < 8 ? c : 7] * x * x;
+	}
+	
+	loud->subblock_fill++;
+	if (loud->subblock_fill == loud->subblock_length){
+		// A gating block consists of the current and the last three sub blocks
+		if (loud->subblock_count >= 3){
+			double energy = (loud->subblock_energy + loud->subblock_history[0] + loud->subblock_history[1] + loud->subblock_history[2]) / (4.0 * loud->subblock_length);
+			double loudness = -0.691 + 10 * log10(energy);
+			if (loudness >= -70.0){
+				int bin = (loudness + 70.0) * 10.0;
+				if (bin >= ENC_LOUDNESS_BINS)
+					bin = ENC_LOUDNESS_BINS - 1;
+				loud->block_counts[bin]++;
+				loud->block_energies[bin] += energy;
+			}
+		}
+		
+		loud->subblock_history[2] = loud->subblock_history[1];
+		loud->subblock_history[1] = loud->subblock_history[0];
+		loud->subblock_history[0] = loud->subblock_energy;
+		loud->subblock_count++;
+		loud->subblock_energy = 0;
+		loud->subblock_fill = 0;
+		
+		// Update the normalization gain once every sub block. Wait for 3 seconds of audio before
+		// trusting the integrated loudness and limit the gain to +-20 dB.
+		if (loud->normalize && loud->subblock_count >= 30){
+			double integrated = enc_loudness_integrated(loud);
+			if (integrated > -HUGE_VAL){
+				double wanted_db = loud->target - integrated;
+				wanted_db = (wanted_db > 20.0) ? 20.0 : (wanted_db < -20.0) ? -20.0 : wanted_db;
+				// Move 5% towards the wanted gain per sub block (about 2 seconds time constant)
+				double gain_db = 20 * log10(loud->gain);
+				loud->gain = pow(10.0, (gain_db + 0.05 * (wanted_db - gain_db)) / 20.0);
+			}
+		}
+	}
+}
+
+/**
+ * Pushes one frame through the look-ahead limiter. Returns `true` if a delayed frame was written to
+ * `output_ptr` (no output until the look-ahead is filled).
+ */
+static bool enc_loudness_limit_frame(enc_loudness_t *loud, const double *frame_ptr, float *output_ptr){
+	int size = loud->lookahead + 1;
+	int index = loud->frames_in % size;
+	
+	double peak = 0;
+	for(int c = 0; c < loud->channels; c++){
+		loud->delay_ptr[index * loud->channels + c] = frame_ptr[c];
+		if (fabs(frame_ptr[c]) > peak)
+			peak = fabs(frame_ptr[c]);
+	}
+	loud->required_gain_ptr[index] = (peak > loud->ceiling) ? loud->ceiling / peak : 1.0;
+	
+	// Sliding window minimum of the required gains (monotonic queue of frame numbers). The frame that left
+	// the window is removed first, otherwise a full queue would overwrite its own front.
+	while (loud->min_queue_end > loud->min_queue_start && loud->min_queue_ptr[loud->min_queue_start % size] <= loud->frames_in - size)
+		loud->min_queue_start++;
+	while (loud->min_queue_end > loud->min_queue_start && loud->required_gain_ptr[loud->min_queue_ptr[(loud->min_queue_end - 1) % size] % size] >= loud->required_gain_ptr[index])
+		loud->min_queue_end--;
+	loud->min_queue_ptr[loud->min_queue_end % size] = loud->frames_in;
+	loud->min_queue_end++;
+	
+	loud->frames_in++;
+	if (loud->frames_in <= loud->lookahead)
+		return false;
+	
+	// Attack instantly (the look-ahead makes sure we're early enough), release slowly
+	double wanted_gain = loud->required_gain_ptr[loud->min_queue_ptr[loud->min_queue_start % size] % size];
+	if (wanted_gain < loud->limiter_gain)
+		loud->limiter_gain = wanted_gain;
+	else
+		loud->limiter_gain += (wanted_gain - loud->limiter_gain) * loud->release;
+	
+	int output_index = loud->frames_in % size;
+	for(int c = 0; c < loud->channels; c++){
+		double y = loud->delay_ptr[output_index * loud->channels + c] * loud->limiter_gain;
+		output_ptr[c] = (y > 32767.0) ? 32767 : (y < -32768.0) ? -32768 : y;
+	}
+	
+	return true;
+}
+
+/**
+ * Measures the interleaved samples (floats in the range of 16 bit samples) and, if normalization is enabled,
+ * applies the gain and the limiter in place. Because of the limiter look-ahead the output is delayed. Returns
+ * the number of frames written back into the buffer (less than `frame_count` at the start).
+ */
+int enc_loudness_process(enc_loudness_t *loud, float *samples_ptr, int frame_count){
+	if (!loud->normalize){
+		for(int i = 0; i < frame_count; i++)
+			enc_loudness_measure_frame(loud, samples_ptr + i * loud->channels);
+		return frame_count;
+	}
+	
+	int output_frames = 0;
+	double frame[loud->channels];
+	for(int i = 0; i < frame_count; i++){
+		float *frame_ptr = samples_ptr + i * loud->channels;
+		enc_loudness_measure_frame(loud, frame_ptr);
+		for(int c = 0; c < loud->channels; c++)
+			frame[c] = frame_ptr[c] * loud->gain;
+		// Output frames are never ahead of the input frames so we can write them into the same buffer
+		if ( enc_loudness_limit_frame(loud, frame, samples_ptr + output_frames * loud->channels) )
+			output_frames++;
+	}
+	
+	return output_frames;
+}
+
+/**
+ * Pushes the frames still in the look-ahead of the limiter out. `samples_ptr` needs space for
+ * `lookahead` frames. Returns the number of frames written.
+ */
+int enc_loudness_flush(enc_loudness_t *loud, float *samples_ptr){
+	if (!loud->normalize)
+		return 0;
+	
+	int output_frames = 0;
+	double silence[loud->channels];
+	memset(silence, 0, sizeof(silence));
+	for(int i = 0; i < loud->lookahead; i++){
+		if ( enc_loudness_limit_frame(loud, silence, samples_ptr + output_frames * loud->channels) )
+			output_frames++;
+	}
+	
+	return output_frames;
+}
+
+/**
+ * Prints the measured values of an audio stream and writes them as JSON object into the sidecar file
+ * (if not `NULL`). A later remux can apply `gain_db` to reach the target exactly.
+ */
+void enc_loudness_report(enc_loudness_t *loud, double target, int stream_index, const char *language, FILE *sidecar_file){
+	double integrated = enc_loudness_integrated(loud);
+	double true_peak_db = 20 * log10(loud->true_peak), sample_peak_db = 20 * log10(loud->sample_peak);
+	
+	printf("Loudness of audio stream %d (%s): integrated %.1f LUFS, true peak %.1f dBTP, sample peak %.1f dBFS",
+		stream_index, language, integrated, true_peak_db, sample_peak_db);
+	if (loud->normalize)
+		printf(", normalized to %.1f LUFS (final gain %.1f dB)", target, 20 * log10(loud->gain));
+	printf("\n");
+	
+	if (sidecar_file == NULL)
+		return;
+	
+	fprintf(sidecar_file, "\t{\n\t\t\"stream\": %d,\n\t\t\"language\": \"%s\",\n", stream_index, language);
+	// JSON has no infinity, use null for silent input
+	if (integrated > -HUGE_VAL)
+		fprintf(sidecar_file, "\t\t\"integrated_lufs\": %.2f,\n\t\t\"gain_db\": %.2f,\n", integrated, target - integrated);
+	else
+		fprintf(sidecar_file, "\t\t\"integrated_lufs\": null,\n\t\t\"gain_db\": null,\n");
+	fprintf(sidecar_file, "\t\t\"target_lufs\": %.2f,\n\t\t\"true_peak_dbtp\": %.2f,\n\t\t\"sample_peak_dbfs\": %.2f,\n\t\t\"normalized\": %s\n\t}",
+		target, (loud->true_peak > 0) ? true_peak_db : -99.0, (loud->sample_peak > 0) ? sample_peak_db : -99.0,
+		loud->normalize ? "true" : "false");
+}
+
+
+//
+// Audio conversion stuff (sample format, downmix and resampling ahead of FAAC)
+//
+
+// Taps of each phase of the resampling filter, a multiple of 4 for the SSE dot product
+#define ENC_RESAMPLE_TAPS 64
+// Limits the size of the filter table (phases * taps), rates like 44100 -> 48000 need 160 phases
+#define ENC_RESAMPLE_MAX_PHASES 4096
+// Most channels passed through without a downmix (7.1)
+#define ENC_AUDIO_MAX_CHANNELS 8
+
+/**
+ * Converts the decoder output (any sample format, planar or interleaved) into interleaved float samples
+ * with at most `max_channels` channels at the output rate. The float samples use the range of 16 bit
+ * samples, that's what FAAC expects for `FAAC_INPUT_FLOAT`.
+ */
+typedef struct {
+	enum AVSampleFormat format;
+	bool planar;
+	int input_rate, input_channels, output_rate, output_channels;
+	// Gain of each input channel in each output channel (`output_channels` rows), NULL if the channels are
+	// passed through unchanged
+	float *matrix_ptr;
+	// Decoder output converted to float, still with the input channel layout
+	float *float_ptr;
+	int max_input_frames;
+	
+	// Polyphase filter of the resampler, NULL if the rate stays the same. Each output frame advances the
+	// input by `step / phases` frames, `position` and `phase` are the integer and fractional part.
+	float *filter_ptr;
+	int phases, step, position, phase;
+	// Input of the resampler for each output channel. The frames still needed by the filter are kept
+	// for the next call.
+	float *history_ptr[ENC_AUDIO_MAX_CHANNELS];
+	int history_used;
+} enc_audio_convert_t;
+
+/**
+ * Stereo downmix gains (ITU-R BS.775) of each input channel, in the channel order of the layout. The
+ * LFE channel is dropped. Each output row is normalized so the downmix can't clip.
+ */
+static void enc_audio_convert_build_matrix(enc_audio_convert_t *conv, uint64_t channel_layout){
+	const float center = M_SQRT1_2, surround = M_SQRT1_2;
+	
+	// Guess the layout of streams without one, 5.1 is by far the most common multichannel layout
+	if (av_get_channel_layout_nb_channels(channel_layout) != conv->input_channels)
+		channel_layout = (conv->input_channels == 6) ? AV_CH_LAYOUT_5POINT1 : 0;
+	
+	float left[conv->input_channels], right[conv->input_channels];
+	int c = 0;
+	for(int bit = 0; bit < 64 && c < conv->input_channels; bit++){
+		uint64_t channel = 1ULL << bit;
+		if ( !(channel_layout & channel) )
+			continue;
+		
+		left[c] = right[c] = 0;
+		if (channel == AV_CH_FRONT_LEFT)
+			left[c] = 1;
+		else if (channel == AV_CH_FRONT_RIGHT)
+			right[c] = 1;
+		else if (channel == AV_CH_FRONT_CENTER || channel == AV_CH_BACK_CENTER)
+			left[c] = right[c] = center;
+		else if (channel == AV_CH_BACK_LEFT || channel == AV_CH_SIDE_LEFT || channel == AV_CH_FRONT_LEFT_OF_CENTER)
+			left[c] = surround;
+		else if (channel == AV_CH_BACK_RIGHT || channel == AV_CH_SIDE_RIGHT || channel == AV_CH_FRONT_RIGHT_OF_CENTER)
+			right[c] = surround;
+		else if (channel != AV_CH_LOW_FREQUENCY)
+			left[c] = right[c] = 0.5;
+		c++;
+	}
+	
+	// Unknown layout: the first two channels are left and right, the others go into both
+	for(; c < conv->input_channels; c++){
+		left[c] = (c == 0) ? 1 : (c == 1) ? 0 : 0.5;
+		right[c] = (c == 1) ? 1 : (c == 0) ? 0 : 0.5;
+	}
+	
+	for(int o = 0; o < conv->output_channels; o++){
+		float *row_ptr = conv->matrix_ptr + o * conv->input_channels;
+		float sum = 0;
+		for(int i = 0; i < conv->input_channels; i++){
+			// Mono gets the average of the stereo downmix
+			row_ptr[i] = (conv->output_channels == 1) ? (left[i] + right[i]) / 2 : (o == 0) ? left[i] : right[i];
+			sum += row_ptr[i];
+		}
+		for(int i = 0; i < conv->input_channels && sum > 1; i++)
+			row_ptr[i] /= sum;
+	}
+}
+
+/**
+ * Windowed sinc filter for each phase (Blackman-Harris window). The cutoff is a bit below the lower of
+ * both Nyquist frequencies. Every phase is normalized to a gain of 1.
+ */
+static void enc_audio_convert_build_filter(enc_audio_convert_t *conv){
+	double cutoff = 0.97 * ((conv->output_rate < conv->input_rate) ? (double)conv->output_rate / conv->input_rate : 1.0);
+	for(int p = 0; p < conv->phases; p++){
+		float *taps_ptr = conv->filter_ptr + p * ENC_RESAMPLE_TAPS;
+		double sum = 0;
+		for(int k = 0; k < ENC_RESAMPLE_TAPS; k++){
+			double x = k - (ENC_RESAMPLE_TAPS / 2 - 1) - (double)p / conv->phases;
+			double t = x / (ENC_RESAMPLE_TAPS / 2);
+			double window = 0.35875 + 0.48829 * cos(M_PI * t) + 0.14128 * cos(2 * M_PI * t) + 0.01168 * cos(3 * M_PI * t);
+			double sinc = (x == 0) ? cutoff : sin(M_PI * cutoff * x) / (M_PI * x);
+			taps_ptr[k] = sinc * window;
+			sum += taps_ptr[k];
+		}
+		for(int k = 0; k < ENC_RESAMPLE_TAPS; k++)
+			taps_ptr[k] /= sum;
+	}
+}
+
+/**
+ * Sets up the conversion of the decoder output. `output_rate` 0 keeps the rate of the stream, `max_channels`
+ * 0 keeps the channels. Streams with more channels are downmixed to stereo (or mono if `max_channels` is 1).
+ */
+bool enc_audio_convert_open(AVCodecContext *codec_context_ptr, int output_rate, int max_channels, enc_audio_convert_t *conv){
+	memset(conv, 0, sizeof(enc_audio_convert_t));
+	conv->format = codec_context_ptr->sample_fmt;
+	conv->planar = av_sample_fmt_is_planar(conv->format);
+	conv->input_rate = codec_context_ptr->sample_rate;
+	conv->input_channels = codec_context_ptr->channels;
+	conv->output_rate = (output_rate > 0) ? output_rate : conv->input_rate;
+	conv->output_channels = (max_channels > 0 && conv->input_channels > max_channels) ? ((max_channels == 1) ? 1 : 2) : conv->input_channels;
+	
+	int sample_size = av_get_bytes_per_sample(conv->format);
+	if (sample_size == 0 || conv->input_channels < 1 || conv->input_rate < 1){
+		fprintf(stderr, "audio: unsupported decoder output (format %d, %d channels, %d Hz)\n", conv->format, conv->input_channels, conv->input_rate);
+		return false;
+	}
+	if (conv->output_channels > ENC_AUDIO_MAX_CHANNELS){
+		fprintf(stderr, "audio: %d channels are too many, downmix them with --audio-channels\n", conv->output_channels);
+		return false;
+	}
+	
+	conv->max_input_frames = AVCODEC_MAX_AUDIO_FRAME_SIZE / (sample_size * conv->input_channels);
+	conv->float_ptr = av_malloc(conv->max_input_frames * conv->input_channels * sizeof(float));
+	if (conv->float_ptr == NULL)
+		return false;
+	
+	if (conv->output_channels != conv->input_channels){
+		conv->matrix_ptr = av_malloc(conv->output_channels * conv->input_channels * sizeof(float));
+		if (conv->matrix_ptr == NULL)
+			return false;
+		enc_audio_convert_build_matrix(conv, codec_context_ptr->channel_layout);
+	}
+	
+	if (conv->output_rate != conv->input_rate){
+		int a = conv->input_rate, b = conv->output_rate;
+		while (b != 0){
+			int r = a % b;
+			a = b;
+			b = r;
+		}
+		conv->phases = conv->output_rate / a;
+		conv->step = conv->input_rate / a;
+		if (conv->phases > ENC_RESAMPLE_MAX_PHASES){
+			fprintf(stderr, "audio: resampling from %d Hz to %d Hz is not supported\n", conv->input_rate, conv->output_rate);
+			return false;
+		}
+		
+		conv->filter_ptr = av_malloc(conv->phases * ENC_RESAMPLE_TAPS * sizeof(float));
+		if (conv->filter_ptr == NULL)
+			return false;
+		enc_audio_convert_build_filter(conv);
+		
+		// Start with half a filter of silence so the output isn't delayed against the input
+		conv->history_used = ENC_RESAMPLE_TAPS / 2 - 1;
+		for(int c = 0; c < conv->output_channels; c++){
+			conv->history_ptr[c] = av_mallocz((conv->max_input_frames + ENC_RESAMPLE_TAPS) * sizeof(float));
+			if (conv->history_ptr[c] == NULL)
+				return false;
+		}
+	}
+	
+	return true;
+}
+
+void enc_audio_convert_close(enc_audio_convert_t *conv){
+	av_free(conv->float_ptr);
+	av_free(conv->matrix_ptr);
+	av_free(conv->filter_ptr);
+	for(int c = 0; c < ENC_AUDIO_MAX_CHANNELS; c++)
+		av_free(conv->history_ptr[c]);
+	memset(conv, 0, sizeof(enc_audio_convert_t));
+}
+
+/**
+ * Upper limit of output frames for `input_frames` frames (or for the flush).
+ */
+int enc_audio_convert_max_output(enc_audio_convert_t *conv, int input_frames){
+	if (conv->filter_ptr == NULL)
+		return input_frames;
+	return (int64_t)(input_frames + ENC_RESAMPLE_TAPS) * conv->phases / conv->step + 1;
+}
+
+/**
+ * Converts `count` samples into floats in the range of 16 bit samples.
+ */
+static void enc_audio_convert_samples(enum AVSampleFormat format, const uint8_t *input_ptr, float *output_ptr, int count){
+	int i = 0;
+	switch(format){
+		case AV_SAMPLE_FMT_S16:
+		case AV_SAMPLE_FMT_S16P: {
+			const int16_t *samples_ptr = (const int16_t*)input_ptr;
+#ifdef __SSE2__
+			for(; i + 8 <= count; i += 8){
+				// Sign extend to 32 bit by putting each sample into the upper half and shifting it down
+				__m128i x = _mm_loadu_si128((const __m128i*)(samples_ptr + i));
+				_mm_storeu_ps(output_ptr + i, _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16)));
+				_mm_storeu_ps(output_ptr + i + 4, _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16)));
+			}
+#endif
+			for(; i < count; i++)
+				output_ptr[i] = samples_ptr[i];
+			break;
+		}
+		case AV_SAMPLE_FMT_S32:
+		case AV_SAMPLE_FMT_S32P: {
+			const int32_t *samples_ptr = (const int32_t*)input_ptr;
+#ifdef __SSE2__
+			__m128 scale = _mm_set1_ps(1.0f / 65536);
+			for(; i + 4 <= count; i += 4)
+				_mm_storeu_ps(output_ptr + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)(samples_ptr + i))), scale));
+#endif
+			for(; i < count; i++)
+				output_ptr[i] = samples_ptr[i] / 65536.0f;
+			break;
+		}
+		case AV_SAMPLE_FMT_FLT:
+		case AV_SAMPLE_FMT_FLTP: {
+			const float *samples_ptr = (const float*)input_ptr;
+#ifdef __SSE2__
+			__m128 scale = _mm_set1_ps(32768.0f);
+			for(; i + 4 <= count; i += 4)
+				_mm_storeu_ps(output_ptr + i, _mm_mul_ps(_mm_loadu_ps(samples_ptr + i), scale));
+#endif
+			for(; i < count; i++)
+				output_ptr[i] = samples_ptr[i] * 32768.0f;
+			break;
+		}
+		case AV_SAMPLE_FMT_DBL:
+		case AV_SAMPLE_FMT_DBLP:
+			for(; i < count; i++)
+				output_ptr[i] = ((const double*)input_ptr)[i] * 32768.0;
+			break;
+		default:
+			for(; i < count; i++)
+				output_ptr[i] = (input_ptr[i] - 128) * 256.0f;
+			break;
+	}
+}
+
+/**
+ * Dot product of `ENC_RESAMPLE_TAPS` input samples with the filter taps of one phase.
+ */
+static inline float enc_audio_convert_dot(const float *samples_ptr, const float *taps_ptr){
+#ifdef __SSE2__
+	__m128 sum = _mm_setzero_ps();
+	for(int k = 0; k < ENC_RESAMPLE_TAPS; k += 4)
+		sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(samples_ptr + k), _mm_load_ps(taps_ptr + k)));
+	sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+	sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+	return _mm_cvtss_f32(sum);
+#else
+	float sum = 0;
+	for(int k = 0; k < ENC_RESAMPLE_TAPS; k++)
+		sum += samples_ptr[k] * taps_ptr[k];
+	return sum;
+#endif
+}
+
+/**
+ * Runs the resampler over the frames in the history and writes the interleaved output frames. Returns the
+ * number of output frames.
+ */
+static int enc_audio_convert_resample(enc_audio_convert_t *conv, float *output_ptr){
+	int output_frames = 0;
+	while (conv->position + ENC_RESAMPLE_TAPS <= conv->history_used){
+		const float *taps_ptr = conv->filter_ptr + conv->phase * ENC_RESAMPLE_TAPS;
+		for(int c = 0; c < conv->output_channels; c++)
+			output_ptr[output_frames * conv->output_channels + c] = enc_audio_convert_dot(conv->history_ptr[c] + conv->position, taps_ptr);
+		output_frames++;
+		
+		conv->phase += conv->step;
+		conv->position += conv->phase / conv->phases;
+		conv->phase %= conv->phases;
+	}
+	
+	// Keep the frames still needed for the next output frames
+	int consumed = (conv->position < conv->history_used) ? conv->position : conv->history_used;
+	for(int c = 0; c < conv->output_channels; c++)
+		memmove(conv->history_ptr[c], conv->history_ptr[c] + consumed, (conv->history_used - consumed) * sizeof(float));
+	conv->history_used -= consumed;
+	conv->position -= consumed;
+	
+	return output_frames;
+}
+
+#ifdef __SSE2__
+/**
+ * Horizontal sums of 4 interleaved 5.1 frames (6 vectors) weighted with the gains of one output channel.
+ * Two frames span 3 vectors with the channels c0-c3 | c4 c5 c0 c1 | c2-c5, the gains are arranged the same.
+ */
+static inline __m128 enc_audio_convert_mix_5_1(const __m128 *x, __m128 gains_a, __m128 gains_b, __m128 gains_c){
+	__m128 zero = _mm_setzero_ps();
+	__m128 pair_0 = _mm_mul_ps(x[1], gains_b), pair_1 = _mm_mul_ps(x[4], gains_b);
+	__m128 f0 = _mm_add_ps(_mm_mul_ps(x[0], gains_a), _mm_movelh_ps(pair_0, zero));
+	__m128 f1 = _mm_add_ps(_mm_mul_ps(x[2], gains_c), _mm_movehl_ps(zero, pair_0));
+	__m128 f2 = _mm_add_ps(_mm_mul_ps(x[3], gains_a), _mm_movelh_ps(pair_1, zero));
+	__m128 f3 = _mm_add_ps(_mm_mul_ps(x[5], gains_c), _mm_movehl_ps(zero, pair_1));
+	_MM_TRANSPOSE4_PS(f0, f1, f2, f3);
+	return _mm_add_ps(_mm_add_ps(f0, f1), _mm_add_ps(f2, f3));
+}
+
+/**
+ * SSE2 version of the 5.1 to stereo downmix, 4 frames per iteration. The gains are loaded once. Returns the
+ * number of frames done, the rest is left to the generic loop.
+ */
+static int enc_audio_convert_downmix_stereo(enc_audio_convert_t *conv, int frame_count, float **dest_ptrs, int dest_step){
+	const float *left_ptr = conv->matrix_ptr, *right_ptr = conv->matrix_ptr + 6;
+	// Planar input: each gain for all 4 frames. Interleaved input: the gains in the order of the vectors.
+	__m128 left_gains[6], right_gains[6];
+	if (conv->planar){
+		for(int c = 0; c < 6; c++){
+			left_gains[c] = _mm_set1_ps(left_ptr[c]);
+			right_gains[c] = _mm_set1_ps(right_ptr[c]);
+		}
+	} else {
+		left_gains[0] = _mm_loadu_ps(left_ptr);
+		left_gains[1] = _mm_setr_ps(left_ptr[4], left_ptr[5], left_ptr[0], left_ptr[1]);
+		left_gains[2] = _mm_loadu_ps(left_ptr + 2);
+		right_gains[0] = _mm_loadu_ps(right_ptr);
+		right_gains[1] = _mm_setr_ps(right_ptr[4], right_ptr[5], right_ptr[0], right_ptr[1]);
+		right_gains[2] = _mm_loadu_ps(right_ptr + 2);
+	}
+	
+	int i = 0;
+	for(; i + 4 <= frame_count; i += 4){
+		__m128 left, right;
+		if (conv->planar){
+			left = right = _mm_setzero_ps();
+			for(int c = 0; c < 6; c++){
+				__m128 x = _mm_loadu_ps(conv->float_ptr + c * frame_count + i);
+				left = _mm_add_ps(left, _mm_mul_ps(x, left_gains[c]));
+				right = _mm_add_ps(right, _mm_mul_ps(x, right_gains[c]));
+			}
+		} else {
+			__m128 x[6];
+			for(int k = 0; k < 6; k++)
+				x[k] = _mm_loadu_ps(conv->float_ptr + i * 6 + k * 4);
+			left = enc_audio_convert_mix_5_1(x, left_gains[0], left_gains[1], left_gains[2]);
+			right = enc_audio_convert_mix_5_1(x, right_gains[0], right_gains[1], right_gains[2]);
+		}
+		
+		if (dest_step == 2){
+			// Interleaved output, the right channel directly follows the left one
+			_mm_storeu_ps(dest_ptrs[0] + i * 2, _mm_unpacklo_ps(left, right));
+			_mm_storeu_ps(dest_ptrs[0] + i * 2 + 4, _mm_unpackhi_ps(left, right));
+		} else {
+			_mm_storeu_ps(dest_ptrs[0] + i, left);
+			_mm_storeu_ps(dest_ptrs[1] + i, right);
+		}
+	}
+	return i;
+}
+#endif
+
+/**
+ * Converts `input_bytes` of decoder output and writes the interleaved result to `output_ptr`, which needs
+ * space for `enc_audio_convert_max_output()` frames. Returns the number of output frames.
+ */
+int enc_audio_convert(enc_audio_convert_t *conv, const uint8_t *input_ptr, int input_bytes, float *output_ptr){
+	int frame_count = input_bytes / (av_get_bytes_per_sample(conv->format) * conv->input_channels);
+	if (frame_count > conv->max_input_frames)
+		frame_count = conv->max_input_frames;
+	
+	// Format conversion, planar formats have the channels one after the other
+	enc_audio_convert_samples(conv->format, input_ptr, conv->float_ptr, frame_count * conv->input_channels);
+	int channel_step = conv->planar ? frame_count : 1, frame_step = conv->planar ? 1 : conv->input_channels;
+	
+	// Downmix (or deinterleave) into the resampler input or directly into the interleaved output
+	float *dest_ptrs[ENC_AUDIO_MAX_CHANNELS];
+	int dest_step = (conv->filter_ptr != NULL) ? 1 : conv->output_channels;
+	for(int c = 0; c < conv->output_channels; c++)
+		dest_ptrs[c] = (conv->filter_ptr != NULL) ? conv->history_ptr[c] + conv->history_used : output_ptr + c;
+	
+	int i = 0;
+#ifdef __SSE2__
+	if (conv->matrix_ptr != NULL && conv->input_channels == 6 && conv->output_channels == 2)
+		i = enc_audio_convert_downmix_stereo(conv, frame_count, dest_ptrs, dest_step);
+#endif
+	for(; i < frame_count; i++){
+		const float *frame_ptr = conv->float_ptr + i * frame_step;
+		for(int o = 0; o < conv->output_channels; o++){
+			float sample = 0;
+			if (conv->matrix_ptr != NULL){
+				const float *row_ptr = conv->matrix_ptr + o * conv->input_channels;
+				for(int c = 0; c < conv->input_channels; c++)
+					sample += row_ptr[c] * frame_ptr[c * channel_step];
+			} else {
+				sample = frame_ptr[o * channel_step];
+			}
+			dest_ptrs[o][i * dest_step] = sample;
+		}
+	}
+	
+	if (conv->filter_ptr == NULL)
+		return frame_count;
+	
+	conv->history_used += frame_count;
+	return enc_audio_convert_resample(conv, output_ptr);
+}
+
+/**
+ * Pushes the frames still in the resampler out. Returns the number of frames written to `output_ptr`.
+ */
+int enc_audio_convert_flush(enc_audio_convert_t *conv, float *output_ptr){
+	if (conv->filter_ptr == NULL)
+		return 0;
+	
+	for(int c = 0; c < conv->output_channels; c++)
+		memset(conv->history_ptr[c] + conv->history_used, 0, ENC_RESAMPLE_TAPS / 2 * sizeof(float));
+	conv->history_used += ENC_RESAMPLE_TAPS / 2;
+	return enc_audio_convert_resample(conv, output_ptr);
+}
+
+
+//
+// FAAC stuff
+//
+
+typedef struct {
+	faacEncHandle encoder;
+	unsigned long input_sample_count;
+	// Number of samples on AAC frame is long (only one channel). This is useful for MP4 muxing.
+	uint32_t frame_length;
+	int64_t last_pts;
+	// Buffer for the FAAC output (the AAC bitstream)
+	int buffer_size;
+	uint8_t *buffer_ptr;
+} faac_context_t;
+
+/**
+ * Opens the FAAC encoder for float input (see `enc_audio_convert_t`). If `bit_rate` (per channel) is 0 FAAC
+ * uses its default quality (VBR), otherwise it encodes with that average bitrate.
+ */
+bool enc_faac_open(int sample_rate, int channels, int bit_rate, faac_context_t *faac){
+	unsigned long max_output_byte_count;
+	
+	faac->encoder = faacEncOpen(sample_rate, channels, &faac->input_sample_count, &max_output_byte_count);
+	
+	if (faac->encoder == NULL){
+		fprintf(stderr, "faac: failed to initialize encoder\n");
+		return false;
+	}
+	
+	faac->frame_length = faac->input_sample_count / channels;
+	faac->last_pts = 0;
+	faac->buffer_size = max_output_byte_count;
+	faac->buffer_ptr = (uint8_t*) av_mallocz(max_output_byte_count);
+	
+	if (faac->buffer_ptr == NULL){
+		fprintf(stderr, "faac: failed to allocate AAC buffer\n");
+		return false;
+	}
+	
+	// Detail config of the encoder
+	faacEncConfigurationPtr faac_config_ptr = faacEncGetCurrentConfiguration(faac->encoder);
+	faac_config_ptr->mpegVersion = MPEG4;  // for Windows Media Player. It only accpets mpeg4 audio
+	faac_config_ptr->aacObjectType = LOW;  // for apple, these things can only play low profile
+	faac_config_ptr->inputFormat = FAAC_INPUT_FLOAT;  // matches the output of enc_audio_convert()
+	if (bit_rate > 0)
+		faac_config_ptr->bitRate = bit_rate;
+	faacEncSetConfiguration(faac->encoder, faac_config_ptr);
+	
+	return true;
+}
+
+
+//
+// MP4 file stuff (a small muxer and demuxer for the files of av_encode)
+//
+
+// Sample data is collected and written into the mdat box in blocks of this size
+#define ENC_MP4_WRITE_BUFFER_SIZE (4 * 1024 * 1024)
+// One video track and the audio tracks
+#define ENC_MP4_MAX_TRACKS (ENC_MAX_AUDIO_TRACKS + 1)
+#define ENC_MP4_MAX_PARAMETER_SETS 32
+// Timescale of the movie header. The tracks use their own timescale, only the movie duration is in this one.
+#define ENC_MP4_MOVIE_TIMESCALE 1000
+// Seconds from 1904-01-01 (MP4 time) to 1970-01-01 (Unix time)
+#define ENC_MP4_EPOCH_OFFSET 2082844800ULL
+
+#define ENC_MP4_FOURCC(a, b, c, d) (((uint32_t)(a) << 24) | ((uint32_t)(b) << 16) | ((uint32_t)(c) << 8) | (uint32_t)(d))
+#define ENC_MP4_VIDEO ENC_MP4_FOURCC('v', 'i', 'd', 'e')
+#define ENC_MP4_AUDIO ENC_MP4_FOURCC('s', 'o', 'u', 'n')
+#define ENC_MP4_INVALID_TRACK -1
+
+/**
+ * Run length coded sample table (stts and ctts): `count` samples in a row have the same `value`.
+ */
+typedef struct {
+	uint32_t count;
+	int64_t value;
+} enc_mp4_run_t;
+
+typedef struct {
+	enc_mp4_run_t *runs;
+	uint32_t count, capacity;
+} enc_mp4_run_table_t;
+
+// All chunks from `first_chunk` (1-based) up to the next entry have the same number of samples (stsc)
+typedef struct {
+	uint32_t first_chunk, samples_per_chunk;
+} enc_mp4_chunk_run_t;
+
+// A sample of a file that is read, all positions and times already resolved
+typedef struct {
+	uint64_t offset;
+	uint32_t size, duration;
+	int64_t dts;
+	int32_t composition_offset;
+	bool sync;
+} enc_mp4_sample_t;
+
+/**
+ * A track with its codec details and sample tables. When writing, the sample tables are kept as compact as
+ * the boxes they end up in: 4 bytes per sample size, 1 bit per sync flag and one entry per run of equal
+ * durations, composition offsets and chunk sizes. Nothing else grows with the number of samples.
+ */
+typedef struct {
+	uint32_t handler, timescale;
+	
+	// Track header details. `flags`: 1 = enabled, 2 = in movie.
+	uint32_t flags;
+	uint16_t alternate_group;
+	char language[4];
+	
+	// Video: the coded size, the display width (differs for anamorphic video) and the pixel aspect ratio
+	// (0:0 if unknown). The avcC details and parameter sets are taken from the h264 stream.
+	uint16_t width, height;
+	double display_width;
+	uint32_t h_spacing, v_spacing;
+	uint8_t profile_idc, profile_compat, level_idc, nal_length_size;
+	uint8_t *sps[ENC_MP4_MAX_PARAMETER_SETS], *pps[ENC_MP4_MAX_PARAMETER_SETS];
+	uint16_t sps_sizes[ENC_MP4_MAX_PARAMETER_SETS], pps_sizes[ENC_MP4_MAX_PARAMETER_SETS];
+	int sps_count, pps_count;
+	
+	// Audio: number of channels and the decoder specific info of the esds box (not written if `NULL`)
+	uint16_t channels;
+	uint8_t *es_config;
+	uint32_t es_config_size;
+	
+	// Sample tables of a written track
+	uint32_t sample_count, sample_capacity;
+	uint32_t *sample_sizes;
+	uint8_t *sync_bits;
+	uint32_t sync_count;
+	uint64_t duration, data_size;
+	enc_mp4_run_table_t durations, composition_offsets;
+	bool negative_composition_offsets;
+	uint64_t *chunk_offsets;
+	uint32_t chunk_count, chunk_capacity;
+	enc_mp4_chunk_run_t *chunk_runs;
+	uint32_t chunk_run_count, chunk_run_capacity;
+	// Number of samples in the last chunk, it's only added to `chunk_runs` when the chunk is complete
+	uint32_t chunk_samples;
+	
+	// Samples of a track that is read
+	enc_mp4_sample_t *samples;
+} enc_mp4_track_t;
+
+/**
+ * An MP4 file that is written or read. Written files get an mdat box with a 64 bit size right after the
+ * ftyp box. The samples are appended to it in large blocks and a new chunk starts whenever the samples
+ * switch to another track. The moov box is put together in memory and appended when the file is closed.
+ * Changes to the written files need a new ENC_RESULT_CACHE_VERSION.
+ */
+typedef struct {
+	FILE *file;
+	bool writing, write_failed;
+	uint8_t audio_profile_level, video_profile_level;
+	// Bandwidth limit of the writes (`NULL` = none)
+	enc_io_limit_t *write_limit;
+	
+	uint8_t *buffer_ptr;
+	size_t buffer_used;
+	// File offset of the mdat box and of the next sample (including the buffered samples)
+	uint64_t mdat_offset, write_offset;
+	int last_track;
+	
+	enc_mp4_track_t tracks[ENC_MP4_MAX_TRACKS];
+	int track_count;
+	
+	// Buffer for the sample read last
+	uint8_t *read_buffer_ptr;
+	uint32_t read_buffer_size;
+} enc_mp4_file_t;
+
+/**
+ * Makes sure an array has room for the element at `index`, it grows in powers of two.
+ */
+static bool enc_mp4_reserve(void **array_dptr, uint32_t *capacity_ptr, uint32_t index, size_t element_size){
+	if (index < *capacity_ptr)
+		return true;
+	
+	uint32_t capacity = (*capacity_ptr > 0) ? *capacity_ptr * 2 : 256;
+	void *array_ptr = realloc(*array_dptr, (size_t)capacity * element_size);
+	if (array_ptr == NULL){
+		fprintf(stderr, "mp4: failed to allocate %u sample table entries\n", capacity);
+		return false;
+	}
+	
+	*array_dptr = array_ptr;
+	*capacity_ptr = capacity;
+	return true;
+}
+
+static bool enc_mp4_run_table_append(enc_mp4_run_table_t *table, int64_t value){
+	if (table->count > 0 && table->runs[table->count - 1].value == value && table->runs[table->count - 1].count < UINT32_MAX){
+		table->runs[table->count - 1].count++;
+		return true;
+	}
+	
+	if ( ! enc_mp4_reserve((void**)&table->runs, &table->capacity, table->count, sizeof(enc_mp4_run_t)) )
+		return false;
+	table->runs[table->count++] = (enc_mp4_run_t){ .count = 1, .value = value };
+	return true;
+}
+
+static void enc_mp4_track_free(enc_mp4_track_t *track){
+	for(int i = 0; i < track->sps_count; i++)
+		free(track->sps[i]);
+	for(int i = 0; i < track->pps_count; i++)
+		free(track->pps[i]);
+	free(track->es_config);
+	free(track->sample_sizes);
+	free(track->sync_bits);
+	free(track->durations.runs);
+	free(track->composition_offsets.runs);
+	free(track->chunk_offsets);
+	free(track->chunk_runs);
+	free(track->samples);
+}
+
+static bool enc_mp4_flush_buffer(enc_mp4_file_t *file){
+	if (file->buffer_used > 0 && fwrite(file->buffer_ptr, file->buffer_used, 1, file->file) != 1){
+		perror("mp4: failed to write sample data");
+		file->write_failed = true;
+	}
+	enc_io_limit_account(file->write_limit, file->buffer_used);
+	file->buffer_used = 0;
+	return !file->write_failed;
+}
+
+static bool enc_mp4_write_data(enc_mp4_file_t *file, const uint8_t *data_ptr, size_t size){
+	if (file->buffer_used + size > ENC_MP4_WRITE_BUFFER_SIZE && ! enc_mp4_flush_buffer(file))
+		return false;
+	
+	if (size >= ENC_MP4_WRITE_BUFFER_SIZE) {
+		if (fwrite(data_ptr, size, 1, file->file) != 1){
+			perror("mp4: failed to write sample data");
+			file->write_failed = true;
+			return false;
+		}
+		enc_io_limit_account(file->write_limit, size);
+	} else {
+		memcpy(file->buffer_ptr + file->buffer_used, data_ptr, size);
+		file->buffer_used += size;
+	}
+	
+	file->write_offset += size;
+	return true;
+}
+
+/**
+ * Creates an MP4 file and writes the ftyp box and the header of the mdat box. Add the tracks with
+ * `enc_mp4_add_track()` before writing the first sample.
+ */
+bool enc_mp4_create(const char *filename, enc_mp4_file_t **file_dptr){
+	enc_mp4_file_t *file = calloc(1, sizeof(enc_mp4_file_t));
+	*file_dptr = file;
+	if (file == NULL){
+		fprintf(stderr, "mp4: failed to allocate file %s\n", filename);
+		return false;
+	}
+	
+	file->audio_profile_level = 0xff;
+	file->video_profile_level = 0xff;
+	file->last_track = ENC_MP4_INVALID_TRACK;
+	file->buffer_ptr = malloc(ENC_MP4_WRITE_BUFFER_SIZE);
+	file->file = fopen(filename, "wb");
+	if (file->buffer_ptr == NULL || file->file == NULL){
+		perror(filename);
+		return false;
+	}
+	
+	// ftyp box (brands "isom", "iso2", "avc1" and "mp41") and the mdat header with a 64 bit size, the size
+	// is filled in on close.
+	uint8_t header[] = {
+		0, 0, 0, 32, 'f', 't', 'y', 'p', 'i', 's', 'o', 'm', 0, 0, 2, 0,
+		'i', 's', 'o', 'm', 'i', 's', 'o', '2', 'a', 'v', 'c', '1', 'm', 'p', '4', '1',
+		0, 0, 0, 1, 'm', 'd', 'a', 't', 0, 0, 0, 0, 0, 0, 0, 0
+	};
+	if (fwrite(header, sizeof(header), 1, file->file) != 1){
+		perror(filename);
+		return false;
+	}
+	file->mdat_offset = 32;
+	file->write_offset = sizeof(header);
+	file->writing = true;
+	
+	return true;
+}
+
+/**
+ * Adds a track (ENC_MP4_VIDEO or ENC_MP4_AUDIO) and returns its index or ENC_MP4_INVALID_TRACK if there are
+ * too many. The track is enabled, its codec details are set on `file->tracks[index]`.
+ */
+int enc_mp4_add_track(enc_mp4_file_t *file, uint32_t handler, uint32_t timescale){
+	if (file->track_count == ENC_MP4_MAX_TRACKS){
+		fprintf(stderr, "mp4: more than %d tracks\n", ENC_MP4_MAX_TRACKS);
+		return ENC_MP4_INVALID_TRACK;
+	}
+	
+	enc_mp4_track_t *track = &file->tracks[file->track_count];
+	memset(track, 0, sizeof(enc_mp4_track_t));
+	track->handler = handler;
+	track->timescale = timescale;
+	track->flags = 3;
+	track->nal_length_size = 4;
+	track->channels = 2;
+	strcpy(track->language, "und");
+	
+	return file->track_count++;
+}
+
+/**
+ * Adds an h264 sequence or picture parameter set (without the NAL size) to a video track. Parameter sets
+ * the track already has are ignored.
+ */
+bool enc_mp4_add_parameter_set(enc_mp4_track_t *track, bool is_sps, const uint8_t *data_ptr, uint16_t size){
+	uint8_t **sets = is_sps ? track->sps : track->pps;
+	uint16_t *sizes = is_sps ? track->sps_sizes : track->pps_sizes;
+	int *count_ptr = is_sps ? &track->sps_count : &track->pps_count;
+	
+	for(int i = 0; i < *count_ptr; i++){
+		if (sizes[i] == size && memcmp(sets[i], data_ptr, size) == 0)
+			return true;
+	}
+	
+	if (*count_ptr == ENC_MP4_MAX_PARAMETER_SETS){
+		fprintf(stderr, "mp4: more than %d parameter sets\n", ENC_MP4_MAX_PARAMETER_SETS);
+		return false;
+	}
+	
+	sets[*count_ptr] = malloc(size);
+	if (sets[*count_ptr] == NULL)
+		return false;
+	memcpy(sets[*count_ptr], data_ptr, size);
+	sizes[*count_ptr] = size;
+	(*count_ptr)++;
+	
+	return true;
+}
+
+/**
+ * Copies the codec details (but not the samples) of a track, e.g. from a file that is read to one that
+ * is written.
+ */
+bool enc_mp4_copy_track_config(enc_mp4_track_t *dest, const enc_mp4_track_t *src){
+	dest->flags = src->flags;
+	dest->alternate_group = src->alternate_group;
+	memcpy(dest->language, src->language, sizeof(dest->language));
+	dest->width = src->width;
+	dest->height = src->height;
+	dest->display_width = src->display_width;
+	dest->h_spacing = src->h_spacing;
+	dest->v_spacing = src->v_spacing;
+	dest->profile_idc = src->profile_idc;
+	dest->profile_compat = src->profile_compat;
+	dest->level_idc = src->level_idc;
+	dest->nal_length_size = src->nal_length_size;
+	dest->channels = src->channels;
+	
+	for(int i = 0; i < src->sps_count; i++){
+		if ( ! enc_mp4_add_parameter_set(dest, true, src->sps[i], src->sps_sizes[i]) )
+			return false;
+	}
+	for(int i = 0; i < src->pps_count; i++){
+		if ( ! enc_mp4_add_parameter_set(dest, false, src->pps[i], src->pps_sizes[i]) )
+			return false;
+	}
+	
+	if (src->es_config != NULL){
+		free(dest->es_config);
+		dest->es_config = malloc(src->es_config_size);
+		if (dest->es_config == NULL)
+			return false;
+		memcpy(dest->es_config, src->es_config, src->es_config_size);
+		dest->es_config_size = src->es_config_size;
+	}
+	
+	return true;
+}
+
+/**
+ * Ends the current chunk of a track. Only chunks with a different number of samples than the previous one
+ * need an stsc entry.
+ */
+static bool enc_mp4_end_chunk(enc_mp4_track_t *track){
+	if (track->chunk_samples == 0)
+		return true;
+	
+	if (track->chunk_run_count == 0 || track->chunk_runs[track->chunk_run_count - 1].samples_per_chunk != track->chunk_samples){
+		if ( ! enc_mp4_reserve((void**)&track->chunk_runs, &track->chunk_run_capacity, track->chunk_run_count, sizeof(enc_mp4_chunk_run_t)) )
+			return false;
+		track->chunk_runs[track->chunk_run_count++] = (enc_mp4_chunk_run_t){ .first_chunk = track->chunk_count, .samples_per_chunk = track->chunk_samples };
+	}
+	
+	track->chunk_samples = 0;
+	return true;
+}
+
+/**
+ * Appends a sample to a track. `duration` and `composition_offset` are in the timescale of the track.
+ */
+bool enc_mp4_write_sample(enc_mp4_file_t *file, int track_index, const uint8_t *data_ptr, uint32_t size,
+	uint32_t duration, int32_t composition_offset, bool is_sync_sample
+){
+	enc_mp4_track_t *track = &file->tracks[track_index];
+	
+	// Samples of another track were written in between, start a new chunk
+	if (file->last_track != track_index){
+		if ( ! enc_mp4_end_chunk(track) )
+			return false;
+		if ( ! enc_mp4_reserve((void**)&track->chunk_offsets, &track->chunk_capacity, track->chunk_count, sizeof(uint64_t)) )
+			return false;
+		track->chunk_offsets[track->chunk_count++] = file->write_offset;
+		file->last_track = track_index;
+	}
+	
+	if ( ! enc_mp4_write_data(file, data_ptr, size) )
+		return false;
+	
+	// The sync bits grow together with the sample sizes
+	if (track->sample_count == track->sample_capacity){
+		uint32_t old_capacity = track->sample_capacity;
+		if ( ! enc_mp4_reserve((void**)&track->sample_sizes, &track->sample_capacity, track->sample_count, sizeof(uint32_t)) )
+			return false;
+		uint8_t *sync_bits = realloc(track->sync_bits, track->sample_capacity / 8);
+		if (sync_bits == NULL){
+			fprintf(stderr, "mp4: failed to allocate %u sample table entries\n", track->sample_capacity);
+			return false;
+		}
+		memset(sync_bits + old_capacity / 8, 0, (track->sample_capacity - old_capacity) / 8);
+		track->sync_bits = sync_bits;
+	}
+	
+	track->sample_sizes[track->sample_count] = size;
+	if (is_sync_sample){
+		track->sync_bits[track->sample_count / 8] |= 1 << (track->sample_count % 8);
+		track->sync_count++;
+	}
+	if (composition_offset < 0)
+		track->negative_composition_offsets = true;
+	if ( ! enc_mp4_run_table_append(&track->durations, duration) || ! enc_mp4_run_table_append(&track->composition_offsets, composition_offset) )
+		return false;
+	
+	track->sample_count++;
+	track->chunk_samples++;
+	track->duration += duration;
+	track->data_size += size;
+	return true;
+}
+
+// Buffer the moov box is put together in, the box sizes are filled in as soon as a box is complete
+typedef struct {
+	uint8_t *data_ptr;
+	size_t size, capacity;
+	bool failed;
+} enc_mp4_box_buffer_t;
+
+static void enc_mp4_put(enc_mp4_box_buffer_t *buffer, const void *data_ptr, size_t size){
+	if (buffer->size + size > buffer->capacity){
+		size_t capacity = (buffer->capacity > 0) ? buffer->capacity : 64 * 1024;
+		while (capacity < buffer->size + size)
+			capacity *= 2;
+		uint8_t *new_data_ptr = realloc(buffer->data_ptr, capacity);
+		if (new_data_ptr == NULL){
+			buffer->failed = true;
+			return;
+		}
+		buffer->data_ptr = new_data_ptr;
+		buffer->capacity = capacity;
+	}
+	
+	memcpy(buffer->data_ptr + buffer->size, data_ptr, size);
+	buffer->size += size;
+}
+
+static void enc_mp4_put8(enc_mp4_box_buffer_t *buffer, uint8_t value){
+	enc_mp4_put(buffer, &value, 1);
+}
+
+static void enc_mp4_put16(enc_mp4_box_buffer_t *buffer, uint16_t value){
+	uint8_t bytes[2] = { value >> 8, value };
+	enc_mp4_put(buffer, bytes, 2);
+}
+
+static void enc_mp4_put32(enc_mp4_box_buffer_t *buffer, uint32_t value){
+	uint8_t bytes[4] = { value >> 24, value >> 16, value >> 8, value };
+	enc_mp4_put(buffer, bytes, 4);
+}
+
+static void enc_mp4_put64(enc_mp4_box_buffer_t *buffer, uint64_t value){
+	enc_mp4_put32(buffer, value >> 32);
+	enc_mp4_put32(buffer, value);
+}
+
+static void enc_mp4_put_zeros(enc_mp4_box_buffer_t *buffer, size_t count){
+	for(size_t i = 0; i < count; i++)
+		enc_mp4_put8(buffer, 0);
+}
+
+// Starts a box with a size of 0, `enc_mp4_box_end()` fills in the size. Returns the offset of the box.
+static size_t enc_mp4_box_start(enc_mp4_box_buffer_t *buffer, const char *type){
+	size_t start = buffer->size;
+	enc_mp4_put32(buffer, 0);
+	enc_mp4_put(buffer, type, 4);
+	return start;
+}
+
+static size_t enc_mp4_full_box_start(enc_mp4_box_buffer_t *buffer, const char *type, uint8_t version, uint32_t flags){
+	size_t start = enc_mp4_box_start(buffer, type);
+	enc_mp4_put32(buffer, ((uint32_t)version << 24) | (flags & 0xffffff));
+	return start;
+}
+
+static void enc_mp4_box_end(enc_mp4_box_buffer_t *buffer, size_t start){
+	if (buffer->failed)
+		return;
+	uint32_t size = buffer->size - start;
+	uint8_t *size_ptr = buffer->data_ptr + start;
+	size_ptr[0] = size >> 24;
+	size_ptr[1] = size >> 16;
+	size_ptr[2] = size >> 8;
+	size_ptr[3] = size;
+}
+
+// Descriptors of the esds box use a variable length size, always written with 4 bytes here
+static void enc_mp4_put_descriptor_header(enc_mp4_box_buffer_t *buffer, uint8_t tag, uint32_t size){
+	uint8_t bytes[5] = { tag, 0x80 | ((size >> 21) & 0x7f), 0x80 | ((size >> 14) & 0x7f), 0x80 | ((size >> 7) & 0x7f), size & 0x7f };
+	enc_mp4_put(buffer, bytes, 5);
+}
+
+// Creation and modification time plus the duration, with 64 bit values if the duration doesn't fit in 32 bit
+static void enc_mp4_put_times(enc_mp4_box_buffer_t *buffer, uint8_t version, uint64_t now, uint32_t track_id_or_timescale, uint64_t duration, bool id_before_reserved){
+	if (version == 1) {
+		enc_mp4_put64(buffer, now);
+		enc_mp4_put64(buffer, now);
+		enc_mp4_put32(buffer, track_id_or_timescale);
+		if (id_before_reserved)
+			enc_mp4_put32(buffer, 0);
+		enc_mp4_put64(buffer, duration);
+	} else {
+		enc_mp4_put32(buffer, now);
+		enc_mp4_put32(buffer, now);
+		enc_mp4_put32(buffer, track_id_or_timescale);
+		if (id_before_reserved)
+			enc_mp4_put32(buffer, 0);
+		enc_mp4_put32(buffer, duration);
+	}
+}
+
+static void enc_mp4_put_matrix(enc_mp4_box_buffer_t *buffer){
+	uint32_t matrix[9] = { 0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000 };
+	for(int i = 0; i < 9; i++)
+		enc_mp4_put32(buffer, matrix[i]);
+}
+
+static void enc_mp4_put_sample_entry(enc_mp4_box_buffer_t *buffer, enc_mp4_track_t *track){
+	if (track->handler == ENC_MP4_VIDEO) {
+		size_t avc1 = enc_mp4_box_start(buffer, "avc1");
+		enc_mp4_put_zeros(buffer, 6);
+		enc_mp4_put16(buffer, 1);
+		enc_mp4_put_zeros(buffer, 16);
+		enc_mp4_put16(buffer, track->width);
+		enc_mp4_put16(buffer, track->height);
+		enc_mp4_put32(buffer, 0x00480000);
+		enc_mp4_put32(buffer, 0x00480000);
+		enc_mp4_put32(buffer, 0);
+		enc_mp4_put16(buffer, 1);
+		enc_mp4_put_zeros(buffer, 32);
+		enc_mp4_put16(buffer, 0x0018);
+		enc_mp4_put16(buffer, 0xffff);
+		
+		size_t avcc = enc_mp4_box_start(buffer, "avcC");
+		enc_mp4_put8(buffer, 1);
+		enc_mp4_put8(buffer, track->profile_idc);
+		enc_mp4_put8(buffer, track->profile_compat);
+		enc_mp4_put8(buffer, track->level_idc);
+		enc_mp4_put8(buffer, 0xfc | (track->nal_length_size - 1));
+		enc_mp4_put8(buffer, 0xe0 | track->sps_count);
+		for(int i = 0; i < track->sps_count; i++){
+			enc_mp4_put16(buffer, track->sps_sizes[i]);
+			enc_mp4_put(buffer, track->sps[i], track->sps_sizes[i]);
+		}
+		enc_mp4_put8(buffer, track->pps_count);
+		for(int i = 0; i < track->pps_count; i++){
+			enc_mp4_put16(buffer, track->pps_sizes[i]);
+			enc_mp4_put(buffer, track->pps[i], track->pps_sizes[i]);
+		}
+		enc_mp4_box_end(buffer, avcc);
+		
+		// A pasp box with 0:0 or 0:1 is invalid, only write it if the pixel aspect ratio is known
+		if (track->h_spacing > 0 && track->v_spacing > 0){
+			size_t pasp = enc_mp4_box_start(buffer, "pasp");
+			enc_mp4_put32(buffer, track->h_spacing);
+			enc_mp4_put32(buffer, track->v_spacing);
+			enc_mp4_box_end(buffer, pasp);
+		}
+		enc_mp4_box_end(buffer, avc1);
+	} else {
+		size_t mp4a = enc_mp4_box_start(buffer, "mp4a");
+		enc_mp4_put_zeros(buffer, 6);
+		enc_mp4_put16(buffer, 1);
+		enc_mp4_put_zeros(buffer, 8);
+		enc_mp4_put16(buffer, track->channels);
+		enc_mp4_put16(buffer, 16);
+		enc_mp4_put32(buffer, 0);
+		enc_mp4_put32(buffer, (track->timescale < 65536) ? track->timescale << 16 : 0);
+		
+		// ES descriptor with the decoder config (MPEG-4 audio, audio stream) and the SL config
+		uint32_t max_sample_size = 0;
+		for(uint32_t i = 0; i < track->sample_count; i++){
+			if (track->sample_sizes[i] > max_sample_size)
+				max_sample_size = track->sample_sizes[i];
+		}
+		uint32_t bit_rate = (track->duration > 0) ? track->data_size * 8 * track->timescale / track->duration : 0;
+		uint32_t decoder_specific_size = (track->es_config != NULL) ? 5 + track->es_config_size : 0;
+		uint32_t decoder_config_size = 13 + decoder_specific_size;
+		
+		size_t esds = enc_mp4_full_box_start(buffer, "esds", 0, 0);
+		enc_mp4_put_descriptor_header(buffer, 0x03, 3 + 5 + decoder_config_size + 5 + 1);
+		enc_mp4_put16(buffer, 0);
+		enc_mp4_put8(buffer, 0);
+		enc_mp4_put_descriptor_header(buffer, 0x04, decoder_config_size);
+		enc_mp4_put8(buffer, 0x40);
+		enc_mp4_put8(buffer, (0x05 << 2) | 1);
+		enc_mp4_put8(buffer, max_sample_size >> 16);
+		enc_mp4_put16(buffer, max_sample_size);
+		enc_mp4_put32(buffer, bit_rate);
+		enc_mp4_put32(buffer, bit_rate);
+		if (track->es_config != NULL){
+			enc_mp4_put_descriptor_header(buffer, 0x05, track->es_config_size);
+			enc_mp4_put(buffer, track->es_config, track->es_config_size);
+		}
+		enc_mp4_put_descriptor_header(buffer, 0x06, 1);
+		enc_mp4_put8(buffer, 0x02);
+		enc_mp4_box_end(buffer, esds);
+		
+		enc_mp4_box_end(buffer, mp4a);
+	}
+}
+
+static void enc_mp4_put_sample_tables(enc_mp4_box_buffer_t *buffer, enc_mp4_track_t *track){
+	size_t stbl = enc_mp4_box_start(buffer, "stbl");
+	
+	size_t stsd = enc_mp4_full_box_start(buffer, "stsd", 0, 0);
+	enc_mp4_put32(buffer, 1);
+	enc_mp4_put_sample_entry(buffer, track);
+	enc_mp4_box_end(buffer, stsd);
+	
+	size_t stts = enc_mp4_full_box_start(buffer, "stts", 0, 0);
+	enc_mp4_put32(buffer, track->durations.count);
+	for(uint32_t i = 0; i < track->durations.count; i++){
+		enc_mp4_put32(buffer, track->durations.runs[i].count);
+		enc_mp4_put32(buffer, track->durations.runs[i].value);
+	}
+	enc_mp4_box_end(buffer, stts);
+	
+	// The composition offsets are only needed if there are any (B-frames)
+	enc_mp4_run_table_t *offsets = &track->composition_offsets;
+	if ( offsets->count > 1 || (offsets->count == 1 && offsets->runs[0].value != 0) ){
+		size_t ctts = enc_mp4_full_box_start(buffer, "ctts", track->negative_composition_offsets ? 1 : 0, 0);
+		enc_mp4_put32(buffer, offsets->count);
+		for(uint32_t i = 0; i < offsets->count; i++){
+			enc_mp4_put32(buffer, offsets->runs[i].count);
+			enc_mp4_put32(buffer, offsets->runs[i].value);
+		}
+		enc_mp4_box_end(buffer, ctts);
+	}
+	
+	// Without an stss box every sample is a sync sample
+	if (track->sync_count < track->sample_count){
+		size_t stss = enc_mp4_full_box_start(buffer, "stss", 0, 0);
+		enc_mp4_put32(buffer, track->sync_count);
+		for(uint32_t i = 0; i < track->sample_count; i++){
+			if (track->sync_bits[i / 8] & (1 << (i % 8)))
+				enc_mp4_put32(buffer, i + 1);
+		}
+		enc_mp4_box_end(buffer, stss);
+	}
+	
+	size_t stsc = enc_mp4_full_box_start(buffer, "stsc", 0, 0);
+	enc_mp4_put32(buffer, track->chunk_run_count);
+	for(uint32_t i = 0; i < track->chunk_run_count; i++){
+		enc_mp4_put32(buffer, track->chunk_runs[i].first_chunk);
+		enc_mp4_put32(buffer, track->chunk_runs[i].samples_per_chunk);
+		enc_mp4_put32(buffer, 1);
+	}
+	enc_mp4_box_end(buffer, stsc);
+	
+	// If all samples have the same size the size is only stored once
+	bool same_size = (track->sample_count > 0);
+	for(uint32_t i = 1; i < track->sample_count && same_size; i++)
+		same_size = (track->sample_sizes[i] == track->sample_sizes[0]);
+	size_t stsz = enc_mp4_full_box_start(buffer, "stsz", 0, 0);
+	enc_mp4_put32(buffer, same_size ? track->sample_sizes[0] : 0);
+	enc_mp4_put32(buffer, track->sample_count);
+	for(uint32_t i = 0; i < track->sample_count && !same_size; i++)
+		enc_mp4_put32(buffer, track->sample_sizes[i]);
+	enc_mp4_box_end(buffer, stsz);
+	
+	// 32 bit chunk offsets unless the file is larger than 4 GiB
+	bool large_offsets = (track->chunk_count > 0 && track->chunk_offsets[track->chunk_count - 1] > UINT32_MAX);
+	size_t stco = enc_mp4_full_box_start(buffer, large_offsets ? "co64" : "stco", 0, 0);
+	enc_mp4_put32(buffer, track->chunk_count);
+	for(uint32_t i = 0; i < track->chunk_count; i++){
+		if (large_offsets)
+			enc_mp4_put64(buffer, track->chunk_offsets[i]);
+		else
+			enc_mp4_put32(buffer, track->chunk_offsets[i]);
+	}
+	enc_mp4_box_end(buffer, stco);
+	
+	enc_mp4_box_end(buffer, stbl);
+}
+
+static void enc_mp4_put_track(enc_mp4_box_buffer_t *buffer, enc_mp4_track_t *track, uint32_t track_id, uint64_t now){
+	bool is_video = (track->handler == ENC_MP4_VIDEO);
+	uint64_t movie_duration = av_rescale(track->duration, ENC_MP4_MOVIE_TIMESCALE, track->timescale);
+	size_t trak = enc_mp4_box_start(buffer, "trak");
+	
+	uint8_t version = (movie_duration > UINT32_MAX) ? 1 : 0;
+	size_t tkhd = enc_mp4_full_box_start(buffer, "tkhd", version, track->flags);
+	enc_mp4_put_times(buffer, version, now, track_id, movie_duration, true);
+	enc_mp4_put_zeros(buffer, 8);
+	enc_mp4_put16(buffer, 0);
+	enc_mp4_put16(buffer, track->alternate_group);
+	enc_mp4_put16(buffer, is_video ? 0 : 0x0100);
+	enc_mp4_put16(buffer, 0);
+	enc_mp4_put_matrix(buffer);
+	enc_mp4_put32(buffer, is_video ? (uint32_t)(track->display_width * 65536) : 0);
+	enc_mp4_put32(buffer, is_video ? (uint32_t)track->height << 16 : 0);
+	enc_mp4_box_end(buffer, tkhd);
+	
+	size_t mdia = enc_mp4_box_start(buffer, "mdia");
+	version = (track->duration > UINT32_MAX) ? 1 : 0;
+	size_t mdhd = enc_mp4_full_box_start(buffer, "mdhd", version, 0);
+	enc_mp4_put_times(buffer, version, now, track->timescale, track->duration, false);
+	enc_mp4_put16(buffer, ((track->language[0] - 0x60) & 0x1f) << 10 | ((track->language[1] - 0x60) & 0x1f) << 5 | ((track->language[2] - 0x60) & 0x1f));
+	enc_mp4_put16(buffer, 0);
+	enc_mp4_box_end(buffer, mdhd);
+	
+	const char *handler_name = is_video ? "VideoHandler" : "SoundHandler";
+	size_t hdlr = enc_mp4_full_box_start(buffer, "hdlr", 0, 0);
+	enc_mp4_put32(buffer, 0);
+	enc_mp4_put32(buffer, track->handler);
+	enc_mp4_put_zeros(buffer, 12);
+	enc_mp4_put(buffer, handler_name, strlen(handler_name) + 1);
+	enc_mp4_box_end(buffer, hdlr);
+	
+	size_t minf = enc_mp4_box_start(buffer, "minf");
+	if (is_video) {
+		size_t vmhd = enc_mp4_full_box_start(buffer, "vmhd", 0, 1);
+		enc_mp4_put_zeros(buffer, 8);
+		enc_mp4_box_end(buffer, vmhd);
+	} else {
+		size_t smhd = enc_mp4_full_box_start(buffer, "smhd", 0, 0);
+		enc_mp4_put_zeros(buffer, 4);
+		enc_mp4_box_end(buffer, smhd);
+	}
+	
+	// The samples are in the same file
+	size_t dinf = enc_mp4_box_start(buffer, "dinf");
+	size_t dref = enc_mp4_full_box_start(buffer, "dref", 0, 0);
+	enc_mp4_put32(buffer, 1);
+	enc_mp4_box_end(buffer, enc_mp4_full_box_start(buffer, "url ", 0, 1));
+	enc_mp4_box_end(buffer, dref);
+	enc_mp4_box_end(buffer, dinf);
+	
+	enc_mp4_put_sample_tables(buffer, track);
+	enc_mp4_box_end(buffer, minf);
+	enc_mp4_box_end(buffer, mdia);
+	enc_mp4_box_end(buffer, trak);
+}
+
+/**
+ * Writes the buffered samples, the size of the mdat box and the moov box with all sample tables.
+ */
+static bool enc_mp4_finish(enc_mp4_file_t *file){
+	for(int i = 0; i < file->track_count; i++){
+		if ( ! enc_mp4_end_chunk(&file->tracks[i]) )
+			return false;
+	}
+	if ( ! enc_mp4_flush_buffer(file) )
+		return false;
+	
+	uint8_t mdat_size[8];
+	uint64_t size = file->write_offset - file->mdat_offset;
+	for(int i = 0; i < 8; i++)
+		mdat_size[i] = size >> (56 - i * 8);
+	if ( fseeko(file->file, file->mdat_offset + 8, SEEK_SET) != 0 || fwrite(mdat_size, sizeof(mdat_size), 1, file->file) != 1 || fseeko(file->file, 0, SEEK_END) != 0 ){
+		perror("mp4: failed to write the mdat size");
+		return false;
+	}
+	
+	uint64_t now = time(NULL) + ENC_MP4_EPOCH_OFFSET;
+	uint64_t movie_duration = 0;
+	for(int i = 0; i < file->track_count; i++){
+		uint64_t duration = av_rescale(file->tracks[i].duration, ENC_MP4_MOVIE_TIMESCALE, file->tracks[i].timescale);
+		if (duration > movie_duration)
+			movie_duration = duration;
+	}
+	
+	enc_mp4_box_buffer_t buffer = { .data_ptr = NULL, .size = 0, .capacity = 0, .failed = false };
+	size_t moov = enc_mp4_box_start(&buffer, "moov");
+	
+	uint8_t version = (movie_duration > UINT32_MAX) ? 1 : 0;
+	size_t mvhd = enc_mp4_full_box_start(&buffer, "mvhd", version, 0);
+	enc_mp4_put_times(&buffer, version, now, ENC_MP4_MOVIE_TIMESCALE, movie_duration, false);
+	enc_mp4_put32(&buffer, 0x00010000);
+	enc_mp4_put16(&buffer, 0x0100);
+	enc_mp4_put_zeros(&buffer, 10);
+	enc_mp4_put_matrix(&buffer);
+	enc_mp4_put_zeros(&buffer, 24);
+	enc_mp4_put32(&buffer, file->track_count + 1);
+	enc_mp4_box_end(&buffer, mvhd);
+	
+	// Initial object descriptor with the profile levels, some older players want it
+	size_t iods = enc_mp4_full_box_start(&buffer, "iods", 0, 0);
+	enc_mp4_put_descriptor_header(&buffer, 0x10, 7);
+	enc_mp4_put16(&buffer, 0x004f);
+	enc_mp4_put8(&buffer, 0xff);
+	enc_mp4_put8(&buffer, 0xff);
+	enc_mp4_put8(&buffer, file->audio_profile_level);
+	enc_mp4_put8(&buffer, file->video_profile_level);
+	enc_mp4_put8(&buffer, 0xff);
+	enc_mp4_box_end(&buffer, iods);
+	
+	for(int i = 0; i < file->track_count; i++)
+		enc_mp4_put_track(&buffer, &file->tracks[i], i + 1, now);
+	enc_mp4_box_end(&buffer, moov);
+	
+	bool written = false;
+	if (buffer.failed)
+		fprintf(stderr, "mp4: failed to allocate the moov box\n");
+	else if (fwrite(buffer.data_ptr, buffer.size, 1, file->file) != 1)
+		perror("mp4: failed to write the moov box");
+	else
+		written = true;
+	
+	free(buffer.data_ptr);
+	return written;
+}
+
+/**
+ * Finishes a written file and frees everything. Returns `false` if anything couldn't be written.
+ */
+bool enc_mp4_close(enc_mp4_file_t *file){
+	if (file == NULL)
+		return true;
+	
+	bool success = true;
+	if (file->file != NULL){
+		if (file->writing)
+			success = !file->write_failed && enc_mp4_finish(file);
+		if (fclose(file->file) != 0)
+			success = false;
+	}
+	
+	for(int i = 0; i < file->track_count; i++)
+		enc_mp4_track_free(&file->tracks[i]);
+	free(file->buffer_ptr);
+	free(file->read_buffer_ptr);
+	free(file);
+	
+	return success;
+}
+
+
+//
+// MP4 reader stuff (only what the trim mode needs)
+//
+
+static uint16_t enc_mp4_get16(const uint8_t *data_ptr){
+	return (data_ptr[0] << 8) | data_ptr[1];
+}
+
+static uint32_t enc_mp4_get32(const uint8_t *data_ptr){
+	return ((uint32_t)data_ptr[0] << 24) | (data_ptr[1] << 16) | (data_ptr[2] << 8) | data_ptr[3];
+}
+
+static uint64_t enc_mp4_get64(const uint8_t *data_ptr){
+	return ((uint64_t)enc_mp4_get32(data_ptr) << 32) | enc_mp4_get32(data_ptr + 4);
+}
+
+/**
+ * Iterates over the boxes from `*pos_dptr` to `end_ptr`. Returns `false` at the end or if a box doesn't fit.
+ */
+static bool enc_mp4_next_box(const uint8_t **pos_dptr, const uint8_t *end_ptr, uint32_t *type_ptr, const uint8_t **payload_dptr, size_t *payload_size_ptr){
+	const uint8_t *pos = *pos_dptr;
+	if (end_ptr - pos < 8)
+		return false;
+	
+	uint64_t size = enc_mp4_get32(pos), header_size = 8;
+	if (size == 1) {
+		if (end_ptr - pos < 16)
+			return false;
+		size = enc_mp4_get64(pos + 8);
+		header_size = 16;
+	} else if (size == 0) {
+		size = end_ptr - pos;
+	}
+	if (size < header_size || size > (uint64_t)(end_ptr - pos))
+		return false;
+	
+	*type_ptr = enc_mp4_get32(pos + 4);
+	*payload_dptr = pos + header_size;
+	*payload_size_ptr = size - header_size;
+	*pos_dptr = pos + size;
+	return true;
+}
+
+// Reads the variable length size of an esds descriptor
+static uint32_t enc_mp4_get_descriptor_size(const uint8_t **pos_dptr, const uint8_t *end_ptr){
+	uint32_t size = 0;
+	for(int i = 0; i < 4 && *pos_dptr < end_ptr; i++){
+		uint8_t byte = *(*pos_dptr)++;
+		size = (size << 7) | (byte & 0x7f);
+		if ( !(byte & 0x80) )
+			break;
+	}
+	return size;
+}
+
+static void enc_mp4_parse_sample_entry(enc_mp4_track_t *track, uint32_t type, const uint8_t *data_ptr, size_t size){
+	const uint8_t *end_ptr = data_ptr + size, *pos, *payload_ptr;
+	uint32_t box_type;
+	size_t payload_size;
+	
+	if (type == ENC_MP4_FOURCC('a', 'v', 'c', '1') && size >= 78) {
+		track->width = enc_mp4_get16(data_ptr + 24);
+		track->height = enc_mp4_get16(data_ptr + 26);
+		for(pos = data_ptr + 78; enc_mp4_next_box(&pos, end_ptr, &box_type, &payload_ptr, &payload_size); ){
+			if (box_type == ENC_MP4_FOURCC('a', 'v', 'c', 'C') && payload_size >= 6) {
+				track->profile_idc = payload_ptr[1];
+				track->profile_compat = payload_ptr[2];
+				track->level_idc = payload_ptr[3];
+				track->nal_length_size = (payload_ptr[4] & 0x03) + 1;
+				
+				const uint8_t *set_ptr = payload_ptr + 5, *set_end_ptr = payload_ptr + payload_size;
+				for(int list = 0; list < 2 && set_ptr < set_end_ptr; list++){
+					int count = *set_ptr++ & ((list == 0) ? 0x1f : 0xff);
+					for(int i = 0; i < count && set_end_ptr - set_ptr >= 2; i++){
+						uint16_t set_size = enc_mp4_get16(set_ptr);
+						if (set_end_ptr - set_ptr - 2 < set_size)
+							break;
+						enc_mp4_add_parameter_set(track, list == 0, set_ptr + 2, set_size);
+						set_ptr += 2 + set_size;
+					}
+				}
+			} else if (box_type == ENC_MP4_FOURCC('p', 'a', 's', 'p') && payload_size >= 8) {
+				track->h_spacing = enc_mp4_get32(payload_ptr);
+				track->v_spacing = enc_mp4_get32(payload_ptr + 4);
+			}
+		}
+	} else if (type == ENC_MP4_FOURCC('m', 'p', '4', 'a') && size >= 28) {
+		track->channels = enc_mp4_get16(data_ptr + 16);
+		for(pos = data_ptr + 28; enc_mp4_next_box(&pos, end_ptr, &box_type, &payload_ptr, &payload_size); ){
+			if (box_type != ENC_MP4_FOURCC('e', 's', 'd', 's') || payload_size < 4)
+				continue;
+			
+			// Walk down ES descriptor -> decoder config -> decoder specific info
+			const uint8_t *desc_ptr = payload_ptr + 4, *desc_end_ptr = payload_ptr + payload_size;
+			while (desc_ptr < desc_end_ptr){
+				uint8_t tag = *desc_ptr++;
+				uint32_t desc_size = enc_mp4_get_descriptor_size(&desc_ptr, desc_end_ptr);
+				if (desc_size > (uint32_t)(desc_end_ptr - desc_ptr))
+					break;
+				
+				if (tag == 0x03 && desc_size >= 3) {
+					// ES_ID, flags, the optional dependency, URL and OCR stream
+					uint8_t flags = desc_ptr[2];
+					desc_ptr += 3;
+					if (flags & 0x80)
+						desc_ptr += 2;
+					if ((flags & 0x40) && desc_ptr < desc_end_ptr)
+						desc_ptr += 1 + *desc_ptr;
+					if (flags & 0x20)
+						desc_ptr += 2;
+				} else if (tag == 0x04 && desc_size >= 13) {
+					desc_ptr += 13;
+				} else {
+					if (tag == 0x05 && desc_size > 0 && track->es_config == NULL){
+						track->es_config = malloc(desc_size);
+						if (track->es_config != NULL){
+							memcpy(track->es_config, desc_ptr, desc_size);
+							track->es_config_size = desc_size;
+						}
+					}
+					desc_ptr += desc_size;
+				}
+			}
+		}
+	}
+}
+
+/**
+ * Resolves the sample tables into one entry per sample.
+ */
+static bool enc_mp4_parse_sample_tables(enc_mp4_track_t *track, const uint8_t *data_ptr, size_t size){
+	const uint8_t *end_ptr = data_ptr + size, *pos = data_ptr, *payload_ptr;
+	const uint8_t *tables[7] = { NULL };
+	size_t table_sizes[7] = { 0 };
+	const uint32_t table_types[7] = {
+		ENC_MP4_FOURCC('s', 't', 's', 'd'), ENC_MP4_FOURCC('s', 't', 's', 'z'), ENC_MP4_FOURCC('s', 't', 't', 's'), ENC_MP4_FOURCC('c', 't', 't', 's'),
+		ENC_MP4_FOURCC('s', 't', 's', 's'), ENC_MP4_FOURCC('s', 't', 's', 'c'), ENC_MP4_FOURCC('s', 't', 'c', 'o')
+	};
+	enum { STSD, STSZ, STTS, CTTS, STSS, STSC, STCO };
+	bool large_offsets = false;
+	uint32_t box_type;
+	size_t payload_size;
+	
+	while ( enc_mp4_next_box(&pos, end_ptr, &box_type, &payload_ptr, &payload_size) ){
+		if (box_type == ENC_MP4_FOURCC('c', 'o', '6', '4')){
+			box_type = table_types[STCO];
+			large_offsets = true;
+		}
+		for(int i = 0; i < 7; i++){
+			if (box_type == table_types[i] && payload_size >= 8){
+				tables[i] = payload_ptr;
+				table_sizes[i] = payload_size;
+			}
+		}
+	}
+	if (tables[STSD] == NULL || tables[STSZ] == NULL || tables[STTS] == NULL || tables[STSC] == NULL || tables[STCO] == NULL){
+		fprintf(stderr, "mp4: track without sample tables\n");
+		return false;
+	}
+	
+	// Codec details from the first sample entry
+	const uint8_t *entry_ptr = tables[STSD] + 8;
+	if ( enc_mp4_next_box(&entry_ptr, tables[STSD] + table_sizes[STSD], &box_type, &payload_ptr, &payload_size) )
+		enc_mp4_parse_sample_entry(track, box_type, payload_ptr, payload_size);
+	
+	// Sample sizes
+	if (table_sizes[STSZ] < 12)
+		return false;
+	uint32_t same_size = enc_mp4_get32(tables[STSZ] + 4), count = enc_mp4_get32(tables[STSZ] + 8);
+	if (same_size == 0 && (table_sizes[STSZ] - 12) / 4 < count)
+		return false;
+	track->samples = calloc(count, sizeof(enc_mp4_sample_t));
+	if (track->samples == NULL && count > 0){
+		fprintf(stderr, "mp4: failed to allocate %u samples\n", count);
+		return false;
+	}
+	track->sample_count = count;
+	for(uint32_t i = 0; i < count; i++)
+		track->samples[i].size = (same_size > 0) ? same_size : enc_mp4_get32(tables[STSZ] + 12 + i * 4);
+	
+	// Decode times and durations
+	uint32_t entries = enc_mp4_get32(tables[STTS] + 4), sample = 0;
+	int64_t dts = 0;
+	for(uint32_t i = 0; i < entries && 8 + (i + 1) * 8 <= table_sizes[STTS]; i++){
+		uint32_t run = enc_mp4_get32(tables[STTS] + 8 + i * 8), duration = enc_mp4_get32(tables[STTS] + 12 + i * 8);
+		for(uint32_t j = 0; j < run && sample < count; j++, sample++){
+			track->samples[sample].dts = dts;
+			track->samples[sample].duration = duration;
+			dts += duration;
+		}
+	}
+	track->duration = dts;
+	
+	// Composition offsets (signed in version 1 but x264 never writes negative ones in version 0)
+	if (tables[CTTS] != NULL){
+		entries = enc_mp4_get32(tables[CTTS] + 4);
+		sample = 0;
+		for(uint32_t i = 0; i < entries && 8 + (i + 1) * 8 <= table_sizes[CTTS]; i++){
+			uint32_t run = enc_mp4_get32(tables[CTTS] + 8 + i * 8);
+			int32_t offset = enc_mp4_get32(tables[CTTS] + 12 + i * 8);
+			for(uint32_t j = 0; j < run && sample < count; j++, sample++)
+				track->samples[sample].composition_offset = offset;
+		}
+	}
+	
+	// Sync samples, all of them if there is no stss box
+	if (tables[STSS] != NULL) {
+		entries = enc_mp4_get32(tables[STSS] + 4);
+		for(uint32_t i = 0; i < entries && 8 + (i + 1) * 4 <= table_sizes[STSS]; i++){
+			uint32_t sync_sample = enc_mp4_get32(tables[STSS] + 8 + i * 4);
+			if (sync_sample >= 1 && sync_sample <= count)
+				track->samples[sync_sample - 1].sync = true;
+		}
+	} else {
+		for(uint32_t i = 0; i < count; i++)
+			track->samples[i].sync = true;
+	}
+	
+	// File offsets: the samples of a chunk follow each other
+	uint32_t chunk_count = enc_mp4_get32(tables[STCO] + 4), run_count = enc_mp4_get32(tables[STSC] + 4);
+	uint32_t offset_size = large_offsets ? 8 : 4;
+	if ((table_sizes[STCO] - 8) / offset_size < chunk_count || (table_sizes[STSC] - 8) / 12 < run_count)
+		return false;
+	sample = 0;
+	for(uint32_t run = 0; run < run_count; run++){
+		uint32_t first_chunk = enc_mp4_get32(tables[STSC] + 8 + run * 12);
+		uint32_t samples_per_chunk = enc_mp4_get32(tables[STSC] + 12 + run * 12);
+		uint32_t next_first_chunk = (run + 1 < run_count) ? enc_mp4_get32(tables[STSC] + 8 + (run + 1) * 12) : chunk_count + 1;
+		for(uint32_t chunk = first_chunk; chunk < next_first_chunk && chunk >= 1 && chunk <= chunk_count; chunk++){
+			const uint8_t *offset_ptr = tables[STCO] + 8 + (chunk - 1) * offset_size;
+			uint64_t offset = large_offsets ? enc_mp4_get64(offset_ptr) : enc_mp4_get32(offset_ptr);
+			for(uint32_t j = 0; j < samples_per_chunk && sample < count; j++, sample++){
+				track->samples[sample].offset = offset;
+				offset += track->samples[sample].size;
+			}
+		}
+	}
+	if (sample < count){
+		fprintf(stderr, "mp4: only %u of %u samples are in chunks\n", sample, count);
+		return false;
+	}
+	
+	return true;
+}
+
+static bool enc_mp4_parse_track(enc_mp4_file_t *file, const uint8_t *data_ptr, size_t size){
+	if (file->track_count == ENC_MP4_MAX_TRACKS)
+		return true;
+	
+	enc_mp4_track_t *track = &file->tracks[file->track_count];
+	memset(track, 0, sizeof(enc_mp4_track_t));
+	strcpy(track->language, "und");
+	track->nal_length_size = 4;
+	
+	const uint8_t *pos = data_ptr, *end_ptr = data_ptr + size, *payload_ptr, *mdia_pos, *mdia_end_ptr, *minf_pos, *minf_end_ptr;
+	uint32_t type;
+	size_t payload_size;
+	bool has_samples = false;
+	while ( enc_mp4_next_box(&pos, end_ptr, &type, &payload_ptr, &payload_size) ){
+		if (type == ENC_MP4_FOURCC('t', 'k', 'h', 'd') && payload_size >= 84) {
+			track->flags = enc_mp4_get32(payload_ptr) & 0xffffff;
+			track->alternate_group = enc_mp4_get16(payload_ptr + ((payload_ptr[0] == 1) ? 42 : 30));
+			track->display_width = enc_mp4_get32(payload_ptr + payload_size - 8) / 65536.0;
+		} else if (type == ENC_MP4_FOURCC('m', 'd', 'i', 'a')) {
+			mdia_end_ptr = payload_ptr + payload_size;
+			for(mdia_pos = payload_ptr; enc_mp4_next_box(&mdia_pos, mdia_end_ptr, &type, &payload_ptr, &payload_size); ){
+				if (type == ENC_MP4_FOURCC('m', 'd', 'h', 'd') && payload_size >= 24) {
+					bool version_1 = (payload_ptr[0] == 1);
+					if (version_1 && payload_size < 36)
+						continue;
+					track->timescale = enc_mp4_get32(payload_ptr + (version_1 ? 20 : 12));
+					uint16_t language = enc_mp4_get16(payload_ptr + (version_1 ? 32 : 20));
+					track->language[0] = ((language >> 10) & 0x1f) + 0x60;
+					track->language[1] = ((language >> 5) & 0x1f) + 0x60;
+					track->language[2] = (language & 0x1f) + 0x60;
+				} else if (type == ENC_MP4_FOURCC('h', 'd', 'l', 'r') && payload_size >= 12) {
+					track->handler = enc_mp4_get32(payload_ptr + 8);
+				} else if (type == ENC_MP4_FOURCC('m', 'i', 'n', 'f')) {
+					minf_end_ptr = payload_ptr + payload_size;
+					for(minf_pos = payload_ptr; enc_mp4_next_box(&minf_pos, minf_end_ptr, &type, &payload_ptr, &payload_size); ){
+						if (type != ENC_MP4_FOURCC('s', 't', 'b', 'l'))
+							continue;
+						if ( ! enc_mp4_parse_sample_tables(track, payload_ptr, payload_size) ){
+							enc_mp4_track_free(track);
+							return false;
+						}
+						has_samples = true;
+					}
+				}
+			}
+		}
+	}
+	
+	// Only keep tracks we can make sense of
+	if (has_samples && track->timescale > 0 && (track->handler == ENC_MP4_VIDEO || track->handler == ENC_MP4_AUDIO))
+		file->track_count++;
+	else
+		enc_mp4_track_free(track);
+	
+	return true;
+}
+
+/**
+ * Opens an MP4 file for reading and resolves the sample tables of all video and audio tracks.
+ */
+bool enc_mp4_read(const char *filename, enc_mp4_file_t **file_dptr){
+	enc_mp4_file_t *file = calloc(1, sizeof(enc_mp4_file_t));
+	*file_dptr = file;
+	if (file == NULL){
+		fprintf(stderr, "mp4: failed to allocate file %s\n", filename);
+		return false;
+	}
+	
+	file->file = fopen(filename, "rb");
+	if (file->file == NULL){
+		perror(filename);
+		return false;
+	}
+	
+	// Look for the moov box on the top level and read it as a whole
+	uint8_t header[16];
+	uint8_t *moov_ptr = NULL;
+	uint64_t moov_size = 0;
+	while (moov_ptr == NULL && fread(header, 8, 1, file->file) == 1){
+		uint64_t size = enc_mp4_get32(header), header_size = 8;
+		if (size == 1) {
+			if (fread(header + 8, 8, 1, file->file) != 1)
+				break;
+			size = enc_mp4_get64(header + 8);
+			header_size = 16;
+		}
+		if (size != 0 && size < header_size)
+			break;
+		
+		if (enc_mp4_get32(header + 4) == ENC_MP4_FOURCC('m', 'o', 'o', 'v')){
+			moov_size = (size == 0) ? 0 : size - header_size;
+			moov_ptr = malloc(moov_size > 0 ? moov_size : 1);
+			if (moov_ptr == NULL || (moov_size > 0 && fread(moov_ptr, moov_size, 1, file->file) != 1)){
+				fprintf(stderr, "mp4: failed to read the moov box of %s\n", filename);
+				free(moov_ptr);
+				return false;
+			}
+		} else if (size == 0 || fseeko(file->file, size - header_size, SEEK_CUR) != 0) {
+			break;
+		}
+	}
+	
+	if (moov_ptr == NULL){
+		fprintf(stderr, "mp4: %s has no moov box\n", filename);
+		return false;
+	}
+	
+	const uint8_t *pos = moov_ptr, *payload_ptr;
+	uint32_t type;
+	size_t payload_size;
+	bool success = true;
+	while ( success && enc_mp4_next_box(&pos, moov_ptr + moov_size, &type, &payload_ptr, &payload_size) ){
+		if (type == ENC_MP4_FOURCC('t', 'r', 'a', 'k'))
+			success = enc_mp4_parse_track(file, payload_ptr, payload_size);
+	}
+	free(moov_ptr);
+	
+	if (!success)
+		fprintf(stderr, "mp4: broken sample tables in %s\n", filename);
+	return success;
+}
+
+/**
+ * Returns the index of the n-th track with the handler (ENC_MP4_VIDEO or ENC_MP4_AUDIO) or
+ * ENC_MP4_INVALID_TRACK if there is none.
+ */
+int enc_mp4_find_track(enc_mp4_file_t *file, uint32_t handler, int n){
+	for(int i = 0; i < file->track_count; i++){
+		if (file->tracks[i].handler == handler && n-- == 0)
+			return i;
+	}
+	return ENC_MP4_INVALID_TRACK;
+}
+
+/**
+ * Reads the data of a sample (0-based index). The data stays valid until the next sample is read.
+ */
+bool enc_mp4_read_sample(enc_mp4_file_t *file, int track_index, uint32_t sample_index, const uint8_t **data_dptr){
+	enc_mp4_sample_t *sample = &file->tracks[track_index].samples[sample_index];
+	if (sample->size > file->read_buffer_size){
+		uint8_t *buffer_ptr = realloc(file->read_buffer_ptr, sample->size);
+		if (buffer_ptr == NULL)
+			return false;
+		file->read_buffer_ptr = buffer_ptr;
+		file->read_buffer_size = sample->size;
+	}
+	
+	if ( fseeko(file->file, sample->offset, SEEK_SET) != 0 || (sample->size > 0 && fread(file->read_buffer_ptr, sample->size, 1, file->file) != 1) )
+		return false;
+	
+	*data_dptr = file->read_buffer_ptr;
+	return true;
+}
+
+
+//
+// MP4 stuff
+//
+
+/**
+ * Creates the MP4 file and adds the video track. Audio tracks are added with `enc_mp4_add_audio_track()`.
+ */
+bool enc_mp4_open(
+	const char *filename, AVRational video_time_base, int width, int height, AVRational sample_aspect_ratio,
+	enc_mp4_file_t **container_dptr, int *video_track_ptr
+){
+	if ( ! enc_mp4_create(filename, container_dptr) ){
+		enc_mp4_close(*container_dptr);
+		*container_dptr = NULL;
+		return false;
+	}
+	
+	// TODO: The spec doesn't list 0x0f as audio profile level. Look into the spec which profile and level this is (maybe low profile?)
+	enc_mp4_file_t *container = *container_dptr;
+	container->audio_profile_level = 0x0f;
+
+	// Add the video track to the container. Use the timebase denumerator as time scale (the number of ticks per
+	// second). Then we only have to multiply each PTS with the numerator. The sample duration
+	// is set for each sample since the duration of frames generated by x264 can vary.
+	// The profile_idc, profile_compat and level_idc are set to 0 for now but are updated with proper values as soon as
+	// the first SPS (sequence parameter set) NAL is received from x264. x264 puts the payload length into the first 4 byte
+	// before each NAL. This is perfect for MP4 (to be more exact AVC1 encapsulation in an MP4 container). Therefore the
+	// NAL length size of the track is 4.
+	*video_track_ptr = enc_mp4_add_track(container, ENC_MP4_VIDEO, video_time_base.den);
+	if (*video_track_ptr == ENC_MP4_INVALID_TRACK)
+		return false;
+	
+	enc_mp4_track_t *track = &container->tracks[*video_track_ptr];
+	track->width = width;
+	track->height = height;
+	track->display_width = width;
+
+	// Only store the pixel aspect ratio if we know it, a pasp box with 0:0 or 0:1 is invalid. The track header
+	// contains the display size so players that ignore the pasp box still show the right aspect ratio.
+	if (sample_aspect_ratio.num > 0 && sample_aspect_ratio.den > 0){
+		track->h_spacing = sample_aspect_ratio.num;
+		track->v_spacing = sample_aspect_ratio.den;
+		track->display_width = width * av_q2d(sample_aspect_ratio);
+	}
+	
+	return true;
+}
+
+/**
+ * Adds an AAC audio track to the container. `language` is an ISO 639-2 code. If there are several audio
+ * tracks they are put into the same alternate group, only the `enabled` one is played by default.
+ */
+bool enc_mp4_add_audio_track(
+	enc_mp4_file_t *container, int sample_rate, const char *language, bool enabled,
+	int *audio_track_ptr
+){
+	*audio_track_ptr = enc_mp4_add_track(container, ENC_MP4_AUDIO, sample_rate);
+	if (*audio_track_ptr == ENC_MP4_INVALID_TRACK)
+		return false;
+	
+	enc_mp4_track_t *track = &container->tracks[*audio_track_ptr];
+	snprintf(track->language, sizeof(track->language), "%s", language);
+	track->alternate_group = 1;
+	// Track header flags: 1 = enabled, 2 = in movie
+	track->flags = enabled ? 3 : 2;
+
+	/* TODO: Leads to files that can not be played with Totem (gstreamer). Figure out why and what this should do in the first place.
+	uint8_t *aac_config_ptr = NULL;
+	unsigned long aac_config_length = 0;
+	faacEncGetDecoderSpecificInfo(faac_encoder, &aac_config_ptr, &aac_config_length);
+	track->es_config = aac_config_ptr;
+	track->es_config_size = aac_config_length;
+	*/
+	
+	return true;
+}
+
+typedef struct {
+	uint8_t *payload_data;
+	size_t payload_size;
+	x264_nal_t *nal_data;
+	size_t nal_count;
+	x264_picture_t pic;
+} x264_frame_t;
+
+/**
+ * Muxing state of one h264 video track.
+ */
+typedef struct {
+	// Set as soon as the codec details of the track are configured based on the first SPS NAL
+	bool configured;
+	// enc_mp4_mux_video() buffers one frame to calculate the sample durations
+	x264_frame_t prev_frame;
+	// If not 0 every frame is written right away with this duration (in the MP4 timescale) instead of
+	// buffering it. Used by the live mode.
+	int64_t fixed_duration;
+	// Duration of the last sample written when flushing (in the MP4 timescale). If 0 the last sample gets
+	// a duration of one tick.
+	int64_t last_duration;
+} mp4_video_mux_t;
+
+/**
+ * Writes a video sample to the mp4 video track. If the track is not configured some codec details of the video track are updated
+ * based on the first SPS NAL received.
+ */
+void enc_mp4_write_video_sample(
+	enc_mp4_file_t *container, int video_track, bool *video_track_configured_ptr,
+	x264_nal_t *nals, int nal_count, size_t payload_size,
+	bool is_sync_sample, int64_t decode_delta, int64_t composition_offset
+){
+	x264_nal_t* nal_ptr = NULL;
+	enc_mp4_track_t *track = &container->tracks[video_track];
+	
+	enc_debug("    writing NALs:");
+	for(int i = 0; i < nal_count; i++){
+		nal_ptr = &nals[i];
+		enc_debug(" %d", nal_ptr->i_type);
+		switch(nal_ptr->i_type){
+			case NAL_SPS:
+				// If the codec details of the video track are not yet set to valid values do so based on the first
+				// sequence parameter set.
+				if (!*video_track_configured_ptr){
+					uint8_t profile_idc, profile_compat, level_idc;
+					
+					// Extract some information from the sequence parameter set and use them
+					// to configure the video track of the mp4 container.
+					// 
+					// SPS layout:
+					// 	byte 0 - 3	startcode (for Annex-B bytestreams) or payload size
+					//	byte 4		NAL header (for SPS NALs just the forbidden_zero_bit, nal_ref_idc and nal_unit_type)
+					// 	byte 5		profile_idc
+					//	byte 6		constraint set flags (profile compatibility flags)
+					//	byte 7		level_idc
+					//int j;
+					//printf("\nSPS size: %d header:", nal_ptr->i_payload);
+					//for(j = 0; j < 8; j++)
+					//	printf(" %02x", nal_ptr->p_payload[j]);
+					
+					profile_idc = nal_ptr->p_payload[5];
+					profile_compat = nal_ptr->p_payload[6];
+					level_idc = nal_ptr->p_payload[7];
+					enc_debug(" (configuring video track: profile_idc %d, profile_compat %x, level_idc: %d)", profile_idc, profile_compat, level_idc);
+					
+					// Update the codec details of the video track (the avcC box)
+					track->profile_idc = profile_idc;
+					track->profile_compat = profile_compat;
+					track->level_idc = level_idc;
+					
+					*video_track_configured_ptr = true;
+				}
+				
+				// Put the sequence parameter set into the MP4 container. Framing is provided
+				// by the container, therefore we don't need the leading 4 bytes (the payload size).
+				enc_mp4_add_parameter_set(track, true, nal_ptr->p_payload + 4, nal_ptr->i_payload - 4);
+				break;
+			case NAL_PPS:
+				// Put the picture parameter set into the MP4 container. Framing is provided
+				// by the container, therefore we don't need the leading 4 bytes (the payload size).
+				enc_mp4_add_parameter_set(track, false, nal_ptr->p_payload + 4, nal_ptr->i_payload - 4);
+				break;
+			case NAL_FILLER:
+				// Throw filler data away (AVC spec wants it)
+				break;
+			default:
+				// Every thing else is data for the video track. Collect all remaining NALs and
+				// put them into one MP4 sample.
+				{
+					int remaining_nals = nal_count - i;
+					uint8_t *start_ptr = nals[i].p_payload;
+					int size = payload_size - ((void*)start_ptr - (void*)(nals[0].p_payload));
+					
+					enc_debug(" storing %d NALs, %d bytes", remaining_nals, size);
+					if ( ! enc_mp4_write_sample(container, video_track, start_ptr, size, decode_delta, composition_offset, is_sync_sample) )
+						fprintf(stderr, "enc_mp4_write_video_sample: enc_mp4_write_sample (NAL %d) failed\n", i);
+					
+					i += remaining_nals;
+				}
+				break;
+		}
+	}
+
+	enc_debug("\n");
+}
+
+
+/**
+ * Initializes the muxing state of a video track. Has to be called before the first enc_mp4_mux_video() call.
+ */
+void enc_mp4_video_mux_init(mp4_video_mux_t *mux_ptr){
+	mux_ptr->configured = false;
+	mux_ptr->fixed_duration = 0;
+	mux_ptr->last_duration = 0;
+	mux_ptr->prev_frame = (x264_frame_t){
+		.payload_data = NULL, .payload_size = 0,
+		.nal_data = NULL, .nal_count = 0
+	};
+}
+
+bool enc_mp4_mux_video(enc_mp4_file_t *container, int video_track, mp4_video_mux_t *mux_ptr, x264_context_t *x264_ptr){
+	x264_frame_t *prev_frame_ptr = &mux_ptr->prev_frame;
+	
+	if (mux_ptr->fixed_duration > 0) {
+		// Low latency: don't wait for the next frame, nothing is buffered that needs to be flushed
+		if (x264_ptr->payload_size > 0){
+			int64_t composition_offset = (x264_ptr->pic_out.i_pts - x264_ptr->pic_out.i_dts) * x264_ptr->time_base.num;
+			enc_mp4_write_video_sample(container, video_track, &mux_ptr->configured, x264_ptr->nals, x264_ptr->nal_count,
+				x264_ptr->payload_size, x264_ptr->pic_out.b_keyframe, mux_ptr->fixed_duration, composition_offset);
+		}
+		return true;
+	}
+	
+	if (x264_ptr->payload_size > 0) {
+		// We got a fresh frame from the encoder
+		
+		// If we already have a previous frame buffered we can calculate the decoding delta and composition offset. Otherwise
+		// just buffer the current frame (it's the first one then).
+		if (prev_frame_ptr->payload_size > 0) {
+			int64_t decode_delta, composition_offset;
+			decode_delta = (x264_ptr->pic_out.i_dts - prev_frame_ptr->pic.i_dts) * x264_ptr->time_base.num;
+			composition_offset = (prev_frame_ptr->pic.i_pts - prev_frame_ptr->pic.i_dts) * x264_ptr->time_base.num;
+			
+			enc_debug("  writing mp4 sample: dec delta: %ld, comp offset: %ld, prev: (dts: %ld, pts: %ld), curr: (dts: %ld, pts: %ld)\n",
+				decode_delta, composition_offset, prev_frame_ptr->pic.i_dts, prev_frame_ptr->pic.i_pts,
+				x264_ptr->pic_out.i_dts, x264_ptr->pic_out.i_pts);
+			
+			enc_mp4_write_video_sample(container, video_track, &mux_ptr->configured, prev_frame_ptr->nal_data, prev_frame_ptr->nal_count,
+				prev_frame_ptr->payload_size, prev_frame_ptr->pic.b_keyframe, decode_delta, composition_offset);
+		}
+		
+		// Buffer the current frame for the next time
+		enc_debug("  buffering x264 frame\n");
+		
+		if (prev_frame_ptr->payload_data != NULL)
+			free(prev_frame_ptr->payload_data);
+		prev_frame_ptr->payload_data = (uint8_t*) malloc(x264_ptr->payload_size);
+		
+		if (prev_frame_ptr->nal_data != NULL)
+			free(prev_frame_ptr->nal_data);
+		prev_frame_ptr->nal_data = (x264_nal_t*) malloc(x264_ptr->nal_count * sizeof(x264_nal_t));
+		
+		if (prev_frame_ptr->payload_data == NULL || prev_frame_ptr->nal_data == NULL){
+			fprintf(stderr, "enc_mp4_mux_video: failed to allocate buffers for x264 frame\n");
+			return false;
+		}
+		
+		memcpy(prev_frame_ptr->payload_data, x264_ptr->nals[0].p_payload, x264_ptr->payload_size);
+		prev_frame_ptr->payload_size = x264_ptr->payload_size;
+		
+		prev_frame_ptr->pic = x264_ptr->pic_out;
+		
+		prev_frame_ptr->nal_count = x264_ptr->nal_count;
+		for(int i = 0; i < x264_ptr->nal_count; i++){
+			prev_frame_ptr->nal_data[i] = x264_ptr->nals[i];
+			int offset = x264_ptr->nals[i].p_payload - x264_ptr->nals[0].p_payload;
+			prev_frame_ptr->nal_data[i].p_payload = prev_frame_ptr->payload_data + offset;
+		}
+	} else {
+		// No new frame data, then this is the last call to flush the buffers. The last frame is allowed
+		// to have a decode delta (duration) of 0.
+		int64_t decode_delta, composition_offset;
+		decode_delta = (mux_ptr->last_duration > 0) ? mux_ptr->last_duration : x264_ptr->time_base.num;
+		composition_offset = (prev_frame_ptr->pic.i_pts - prev_frame_ptr->pic.i_dts) * x264_ptr->time_base.num;
+		
+		enc_debug("  flushing mp4 buffer, writing last sample: dec delta: %ld, comp offset: %ld, prev: (dts: %ld, pts: %ld)\n",
+			decode_delta, composition_offset, prev_frame_ptr->pic.i_dts, prev_frame_ptr->pic.i_pts);
+		
+		enc_mp4_write_video_sample(container, video_track, &mux_ptr->configured, prev_frame_ptr->nal_data, prev_frame_ptr->nal_count,
+			prev_frame_ptr->payload_size, prev_frame_ptr->pic.b_keyframe, decode_delta, composition_offset);
+		
+		// Clean up the buffered output data
+		free(prev_frame_ptr->payload_data);
+		prev_frame_ptr->payload_data = NULL;
+		free(prev_frame_ptr->nal_data);
+		prev_frame_ptr->nal_data = NULL;
+	}
+	
+	return true;
+}
+
+
+//
+// Audio track stuff
+//
+
+/**
+ * Everything needed to encode one audio stream into its own MP4 audio track: the decoder, the conversion,
+ * the loudness normalization, the FAAC encoder and the buffer with converted samples that are not yet encoded.
+ */
+typedef struct {
+	int stream_index;
+	AVCodec *codec_ptr;
+	AVCodecContext *codec_context_ptr;
+	// ISO 639-2 language code of the stream, "und" if unknown
+	char language[4];
+	
+	// Everything after the conversion (loudness, FAAC and the MP4 track) uses its output rate and channels
+	enc_audio_convert_t convert;
+	bool loudness_enabled;
+	enc_loudness_t loudness;
+	faac_context_t faac;
+	
+	// The AAC frames are written to the track of the output and (if not ENC_MP4_INVALID_TRACK) to the
+	// track of the preview.
+	enc_mp4_file_t *container, *preview_container;
+	int mp4_track, preview_track;
+	
+	// Audio decoder output buffer (the raw audio samples)
+	uint8_t *decode_buffer_ptr;
+	// Converted samples waiting for a complete FAAC batch (size and used part in samples, not frames)
+	float *sample_buffer_ptr;
+	int sample_buffer_size, sample_buffer_used;
+	// Number of samples (per channel) encoded so far, used for the progress information
+	int64_t encoded_pts;
+	// Number of samples (per channel) converted so far and the number of samples that are thrown away after
+	// switching to the next input file (see `enc_audio_track_switch_input()`)
+	int64_t decoded_frames, skip_frames;
+} enc_audio_track_t;
+
+/**
+ * Opens the decoder, the conversion, the loudness measurement and the FAAC encoder for an audio stream.
+ * `bit_rate` is passed on to `enc_faac_open()`, `sample_rate` and `max_channels` to `enc_audio_convert_open()`.
+ */
+bool enc_audio_track_open(AVFormatContext *format_context_ptr, int stream_index, bool loudness_enabled, bool normalize_loudness, double loudness_target,
+	int bit_rate, int sample_rate, int max_channels, enc_audio_track_t *track
+){
+	track->stream_index = stream_index;
+	if ( ! enc_avcodec_open(format_context_ptr, stream_index, AVMEDIA_TYPE_AUDIO, &track->codec_context_ptr, &track->codec_ptr) )
+		return false;
+	
+	AVDictionaryEntry *language_ptr = av_dict_get(format_context_ptr->streams[stream_index]->metadata, "language", NULL, 0);
+	snprintf(track->language, sizeof(track->language), "%s", (language_ptr != NULL && strlen(language_ptr->value) == 3) ? language_ptr->value : "und");
+	
+	if ( ! enc_audio_convert_open(track->codec_context_ptr, sample_rate, max_channels, &track->convert) )
+		return false;
+	int output_rate = track->convert.output_rate, output_channels = track->convert.output_channels;
+	
+	track->loudness_enabled = loudness_enabled;
+	if ( loudness_enabled && ! enc_loudness_open(output_rate, output_channels, normalize_loudness, loudness_target, &track->loudness) )
+		return false;
+	
+	if ( ! enc_faac_open(output_rate, output_channels, bit_rate, &track->faac) )
+		return false;
+	
+	track->container = NULL;
+	track->preview_container = NULL;
+	track->mp4_track = ENC_MP4_INVALID_TRACK;
+	track->preview_track = ENC_MP4_INVALID_TRACK;
+	
+	// Room for an incomplete FAAC batch, the converted output of one packet and the limiter look-ahead
+	track->decode_buffer_ptr = av_malloc(AVCODEC_MAX_AUDIO_FRAME_SIZE);
+	track->sample_buffer_size = track->faac.input_sample_count +
+		(enc_audio_convert_max_output(&track->convert, track->convert.max_input_frames) + output_rate / 100 + 1) * output_channels;
+	track->sample_buffer_used = 0;
+	track->sample_buffer_ptr = av_mallocz(track->sample_buffer_size * sizeof(float));
+	track->encoded_pts = 0;
+	track->decoded_frames = 0;
+	track->skip_frames = 0;
+	if (track->decode_buffer_ptr == NULL || track->sample_buffer_ptr == NULL){
+		fprintf(stderr, "failed to allocate audio decoding buffer\n");
+		return false;
+	}
+	
+	return true;
+}
+
+/**
+ * Writes an AAC frame into the MP4 track of the output and the preview.
+ */
+static void enc_audio_track_write_sample(enc_audio_track_t *track, int encoded_bytes){
+	if ( ! enc_mp4_write_sample(track->container, track->mp4_track, track->faac.buffer_ptr, encoded_bytes, track->faac.frame_length, 0, true) )
+		fprintf(stderr, "faac: enc_mp4_write_sample() failed for audio stream %d\n", track->stream_index);
+	if ( track->preview_track != ENC_MP4_INVALID_TRACK && ! enc_mp4_write_sample(track->preview_container, track->preview_track, track->faac.buffer_ptr, encoded_bytes, track->faac.frame_length, 0, true) )
+		fprintf(stderr, "faac: enc_mp4_write_sample() for preview failed\n");
+	
+	// Update the audio encoding progress
+	track->encoded_pts += track->faac.frame_length;
+}
+
+/**
+ * Takes `new_frames` of converted samples written right behind the used part of the sample buffer and
+ * encodes all complete FAAC batches in the sample buffer.
+ */
+static void enc_audio_track_encode_buffer(enc_audio_track_t *track, int new_frames){
+	int channels = track->convert.output_channels;
+	float *new_samples_ptr = track->sample_buffer_ptr + track->sample_buffer_used;
+	
+	// Throw samples away if the audio of the last input file was longer than the video
+	if (track->skip_frames > 0){
+		int skip_frames = (track->skip_frames < new_frames) ? track->skip_frames : new_frames;
+		memmove(new_samples_ptr, new_samples_ptr + skip_frames * channels, (new_frames - skip_frames) * channels * sizeof(float));
+		new_frames -= skip_frames;
+		track->skip_frames -= skip_frames;
+	}
+	track->decoded_frames += new_frames;
+	
+	// Measure and normalize the new samples, the limiter delays the output so there might be fewer samples afterwards.
+	if (track->loudness_enabled)
+		new_frames = enc_loudness_process(&track->loudness, new_samples_ptr, new_frames);
+	
+	track->sample_buffer_used += new_frames * channels;
+	
+	int samples_to_encode = track->sample_buffer_used;
+	int samples_encoded = 0;
+	
+	enc_debug("  samples to encode: %d, encoding batches:", samples_to_encode);
+	while (samples_to_encode >= track->faac.input_sample_count){
+		enc_debug(" %ld", track->faac.input_sample_count);
+		int encoded_bytes = faacEncEncode(track->faac.encoder,
+			(int32_t*)(track->sample_buffer_ptr + samples_encoded), track->faac.input_sample_count,
+			track->faac.buffer_ptr, track->faac.buffer_size);
+		
+		samples_to_encode -= track->faac.input_sample_count;
+		samples_encoded += track->faac.input_sample_count;
+		
+		if (encoded_bytes > 0) {
+			enc_debug(" w");
+			enc_audio_track_write_sample(track, encoded_bytes);
+		} else if (encoded_bytes < 0) {
+			fprintf(stderr, "    faac: faacEncEncode() failed\n    ");
+		}
+	}
+	enc_debug("\n");
+	
+	// If not all data of the buffer was encoded move the remaining data to the front again
+	if (samples_encoded > 0 && samples_encoded < track->sample_buffer_used){
+		enc_debug("  moving %d samples from position %d to the front\n", track->sample_buffer_used - samples_encoded, samples_encoded);
+		memmove(track->sample_buffer_ptr, track->sample_buffer_ptr + samples_encoded, (track->sample_buffer_used - samples_encoded) * sizeof(float));
+	}
+	
+	track->sample_buffer_used -= samples_encoded;
+}
+
+/**
+ * Decodes an audio packet of the stream, converts the samples and encodes all complete FAAC batches in the
+ * sample buffer.
+ */
+void enc_audio_track_decode(enc_audio_track_t *track, AVPacket *packet_ptr){
+	int decoded_bytes = AVCODEC_MAX_AUDIO_FRAME_SIZE;
+	int bytes_consumed = avcodec_decode_audio3(track->codec_context_ptr, (int16_t*)track->decode_buffer_ptr, &decoded_bytes, packet_ptr);
+	
+	enc_debug("audio packet: stream: %d, pts: %ld, dts: %ld size: %d, bytes uncompessed: %d\n",
+		track->stream_index, packet_ptr->pts, packet_ptr->dts, packet_ptr->size, decoded_bytes);
+	
+	if (bytes_consumed < 0) {
+		enc_av_perror("avcodec_decode_audio3", bytes_consumed);
+		return;
+	} else if (bytes_consumed == 0) {
+		return;
+	}
+	
+	// Convert the samples right behind the used part of the sample buffer
+	int new_frames = enc_audio_convert(&track->convert, track->decode_buffer_ptr, decoded_bytes, track->sample_buffer_ptr + track->sample_buffer_used);
+	enc_audio_track_encode_buffer(track, new_frames);
+}
+
+/**
+ * Switches the track to an audio stream of the next input file. The audio of the next file starts at
+ * `position` (in samples of the output rate), the same position as its video. If the audio of the previous
+ * file was shorter silence is inserted, if it was longer the start of the next file is skipped.
+ */
+bool enc_audio_track_switch_input(enc_audio_track_t *track, AVFormatContext *format_context_ptr, int stream_index, int64_t position){
+	enc_audio_convert_t *conv = &track->convert;
+	
+	avcodec_close(track->codec_context_ptr);
+	track->stream_index = stream_index;
+	if ( ! enc_avcodec_open(format_context_ptr, stream_index, AVMEDIA_TYPE_AUDIO, &track->codec_context_ptr, &track->codec_ptr) )
+		return false;
+	
+	// The conversion keeps running (so there's no gap in the resampler), the input has to stay the same
+	if (track->codec_context_ptr->sample_rate != conv->input_rate || track->codec_context_ptr->channels != conv->input_channels || track->codec_context_ptr->sample_fmt != conv->format){
+		fprintf(stderr, "audio stream %d: %d Hz with %d channels (format %d) differs from the previous input (%d Hz, %d channels, format %d)\n", stream_index,
+			track->codec_context_ptr->sample_rate, track->codec_context_ptr->channels, track->codec_context_ptr->sample_fmt, conv->input_rate, conv->input_channels, conv->format);
+		return false;
+	}
+	
+	int64_t difference = position - track->decoded_frames;
+	enc_debug("audio stream %d: switching input at sample %ld, difference to video: %ld samples\n", stream_index, track->decoded_frames, difference);
+	
+	track->skip_frames = 0;
+	if (difference < 0){
+		track->skip_frames = -difference;
+		return true;
+	}
+	
+	while (difference > 0){
+		int free_frames = (track->sample_buffer_size - track->sample_buffer_used) / conv->output_channels;
+		int frames = (difference < free_frames) ? difference : free_frames;
+		memset(track->sample_buffer_ptr + track->sample_buffer_used, 0, frames * conv->output_channels * sizeof(float));
+		enc_audio_track_encode_buffer(track, frames);
+		difference -= frames;
+	}
+	
+	return true;
+}
+
+/**
+ * Encodes all samples still buffered (in the resampler, the loudness limiter, the sample buffer and the
+ * FAAC encoder).
+ */
+void enc_audio_track_flush(enc_audio_track_t *track){
+	// Get the samples still delayed by the resampler and the loudness limiter
+	int output_frames = enc_audio_convert_flush(&track->convert, track->sample_buffer_ptr + track->sample_buffer_used);
+	enc_audio_track_encode_buffer(track, output_frames);
+	if (track->loudness_enabled){
+		output_frames = enc_loudness_flush(&track->loudness, track->sample_buffer_ptr + track->sample_buffer_used);
+		track->sample_buffer_used += output_frames * track->convert.output_channels;
+	}
+	
+	// Feed any remaining unencoded samples in the sample buffer to the FAAC encoder
+	int samples_encoded = 0;
+	while (samples_encoded < track->sample_buffer_used){
+		int samples_to_encode = track->sample_buffer_used - samples_encoded;
+		if (samples_to_encode > track->faac.input_sample_count)
+			samples_to_encode = track->faac.input_sample_count;
+		
+		enc_debug("delayed unencoded sample buffer: %d samples\n", samples_to_encode);
+		int encoded_bytes = faacEncEncode(track->faac.encoder,
+			(int32_t*)(track->sample_buffer_ptr + samples_encoded), samples_to_encode,
+			track->faac.buffer_ptr, track->faac.buffer_size);
+		samples_encoded += samples_to_encode;
+		
+		if (encoded_bytes > 0)
+			enc_audio_track_write_sample(track, encoded_bytes);
+		else if (encoded_bytes < 0)
+			fprintf(stderr, "  faac: faacEncEncode() failed\n");
+	}
+	track->sample_buffer_used = 0;
+	
+	// Flush any buffered AAC frames still in the encoder
+	int encoded_bytes = 0;
+	while ( (encoded_bytes = faacEncEncode(track->faac.encoder, NULL, 0, track->faac.buffer_ptr, track->faac.buffer_size)) > 0 ){
+		enc_debug("FAAC delayed frame\n");
+		enc_audio_track_write_sample(track, encoded_bytes);
+	}
+}
+
+void enc_audio_track_close(enc_audio_track_t *track){
+	if (track->loudness_enabled)
+		enc_loudness_close(&track->loudness);
+	enc_audio_convert_close(&track->convert);
+	av_free(track->decode_buffer_ptr);
+	av_free(track->sample_buffer_ptr);
+	av_free(track->faac.buffer_ptr);
+	faacEncClose(track->faac.encoder);
+	avcodec_close(track->codec_context_ptr);
+}
+
+
+//
+// Two pass stuff (encoding for a target file size)
+//
+
+// Bitrate of each audio channel in two pass mode, FAAC encodes with an average bitrate then so the size of
+// the audio is known before the video is encoded
+#define ENC_TWO_PASS_AUDIO_BIT_RATE 64000
+// Share of the target size reserved for the MP4 headers and sample tables
+#define ENC_TWO_PASS_MUX_OVERHEAD 0.005
+
+/**
+ * Returns the average video bitrate (kbit/s) so the output ends up at `target_size` bytes. The audio
+ * tracks are encoded with `ENC_TWO_PASS_AUDIO_BIT_RATE` per channel, what's left is for the video.
+ * Returns 0 if the target size is too small for the audio alone.
+ */
+int enc_two_pass_video_bit_rate(int64_t target_size, double duration_sec, const enc_audio_track_t *audio_tracks, int audio_track_count){
+	double audio_bits = 0;
+	for(int i = 0; i < audio_track_count; i++)
+		audio_bits += (double)audio_tracks[i].convert.output_channels * ENC_TWO_PASS_AUDIO_BIT_RATE * duration_sec;
+	
+	double video_bits = target_size * 8.0 * (1 - ENC_TWO_PASS_MUX_OVERHEAD) - audio_bits;
+	if (video_bits <= 0)
+		return 0;
+	return video_bits / duration_sec / 1000;
+}
+
+/**
+ * Runs the first pass: the whole input is decoded, piped through the same filters as in the second pass
+ * and encoded with x264's fast first pass settings. The encoded frames are thrown away, only the
+ * statistics file of x264 is kept. Afterwards the input is rewound to the start and the video decoder
+ * is flushed (like after the analysis).
+ */
+bool enc_two_pass_first_pass(
+	AVFormatContext *format_context_ptr, int video_stream_index, AVCodecContext *video_codec_context_ptr,
+	AVRational input_time_base, AVRational input_sample_aspect_ratio, const char *filters,
+	int width, int height, AVRational sample_aspect_ratio, AVRational time_base, AVRational frame_rate,
+	const char *preset, const char *tune, const char *profile, const enc_x264_two_pass_t *two_pass
+){
+	if (format_context_ptr->pb != NULL && !format_context_ptr->pb->seekable){
+		fprintf(stderr, "first pass: input is not seekable\n");
+		return false;
+	}
+	
+	AVFilterGraph *filter_graph_ptr = NULL;
+	AVFilterContext *src_filter_context_ptr = NULL, *sink_filter_context_ptr = NULL;
+	if ( ! enc_avfilter_build_graph(video_codec_context_ptr, input_time_base, input_sample_aspect_ratio, filters, &filter_graph_ptr, &src_filter_context_ptr, &sink_filter_context_ptr) )
+		return false;
+	
+	x264_context_t x264;
+	if ( ! enc_x264_open(video_codec_context_ptr, width, height, sample_aspect_ratio, input_time_base, time_base, frame_rate,
+		preset, tune, 0, profile, 0, 0, false, two_pass, &x264) )
+		return false;
+	
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	printf("First pass at %d kbit/s...\n", two_pass->bit_rate);
+	
+	AVFrame *frame_ptr = avcodec_alloc_frame();
+	AVPacket packet;
+	int frame_available = 0;
+	int64_t frame_count = 0;
+	while( av_read_frame(format_context_ptr, &packet) >= 0 ){
+		if (packet.stream_index == video_stream_index){
+			if ( avcodec_decode_video2(video_codec_context_ptr, frame_ptr, &frame_available, &packet) >= 0 && frame_available ){
+				// Same PTS fallback as in the second pass, both passes have to see the same frames
+				if (frame_ptr->pts == AV_NOPTS_VALUE || frame_ptr->pts == 0)
+					frame_ptr->pts = packet.pts;
+				
+				enc_frame_pool_add_frame(src_filter_context_ptr, video_codec_context_ptr, frame_ptr);
+			}
+			
+			while( enc_avfilter_pull_to_x264_context(sink_filter_context_ptr, frame_ptr, &x264) ){
+				if ( x264_encoder_encode(x264.encoder, &x264.nals, &x264.nal_count, &x264.pic_in, &x264.pic_out) < 0 )
+					fprintf(stderr, "x264: first pass encoder error\n");
+				frame_count++;
+			}
+		}
+		av_free_packet(&packet);
+	}
+	
+	while( x264_encoder_delayed_frames(x264.encoder) > 0 ){
+		if ( x264_encoder_encode(x264.encoder, &x264.nals, &x264.nal_count, NULL, &x264.pic_out) < 0 )
+			break;
+	}
+	
+	// Closing the encoder writes the statistics file
+	enc_x264_close(&x264);
+	avfilter_graph_free(&filter_graph_ptr);
+	av_free(frame_ptr);
+	
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("First pass done: %ld frames in %.1f s\n", frame_count, (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1000000000.0);
+	
+	// Go back to the start for the second pass
+	int64_t start_time = (format_context_ptr->start_time != AV_NOPTS_VALUE) ? format_context_ptr->start_time : 0;
+	avcodec_flush_buffers(video_codec_context_ptr);
+	if ( av_seek_frame(format_context_ptr, -1, start_time, AVSEEK_FLAG_BACKWARD) < 0 ){
+		fprintf(stderr, "first pass: failed to rewind input\n");
+		return false;
+	}
+	
+	return true;
+}
+
+/**
+ * Removes the statistics files x264 wrote in the first pass.
+ */
+void enc_two_pass_cleanup(const enc_x264_two_pass_t *two_pass){
+	char mbtree_file[PATH_MAX + 8];
+	snprintf(mbtree_file, sizeof(mbtree_file), "%s.mbtree", two_pass->stats_file);
+	unlink(two_pass->stats_file);
+	unlink(mbtree_file);
+}
+
+
+//
+// Estimate stuff (predicting encode time and output size without encoding)
+//
+
+// Number of segments sampled across the input and frames per segment. Enough frames to fill the x264
+// lookahead and frame threads a few times, few enough to finish in a few seconds.
+#define ENC_ESTIMATE_SEGMENTS 6
+#define ENC_ESTIMATE_SEGMENT_FRAMES 40
+// CPU time of x264's fast first pass settings compared to the real encode
+#define ENC_ESTIMATE_FIRST_PASS_COST 0.4
+
+/**
+ * Wall time, CPU time of the calling (main) thread and CPU time of the whole process, in seconds.
+ */
+typedef struct {
+	double wall, main_cpu, cpu;
+} enc_estimate_clocks_t;
+
+static enc_estimate_clocks_t enc_estimate_clocks(){
+	struct timespec wall, main_cpu, cpu;
+	clock_gettime(CLOCK_MONOTONIC, &wall);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &main_cpu);
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+	return (enc_estimate_clocks_t){
+		.wall = wall.tv_sec + wall.tv_nsec / 1000000000.0,
+		.main_cpu = main_cpu.tv_sec + main_cpu.tv_nsec / 1000000000.0,
+		.cpu = cpu.tv_sec + cpu.tv_nsec / 1000000000.0
+	};
+}
+
+/**
+ * State of the sampled encode. The time before the first frame of each segment is spent seeking and
+ * decoding up to the sampled position, it's not part of the encode. It's summed up in `preroll` for each
+ * clock, so it can be taken out of the matching measurement.
+ */
+typedef struct {
+	AVFilterContext *src_filter_context_ptr, *sink_filter_context_ptr;
+	AVCodecContext *video_codec_context_ptr;
+	AVFrame *filtered_frame_ptr;
+	x264_context_t x264;
+	int segment;
+	enc_estimate_clocks_t last_frame, preroll;
+	int64_t frames_out, bytes;
+} enc_estimate_t;
+
+/**
+ * Adds the time since the last encoded frame to the preroll.
+ */
+static void enc_estimate_add_preroll(enc_estimate_t *est){
+	enc_estimate_clocks_t now = enc_estimate_clocks();
+	est->preroll.wall += now.wall - est->last_frame.wall;
+	est->preroll.main_cpu += now.main_cpu - est->last_frame.main_cpu;
+	est->preroll.cpu += now.cpu - est->last_frame.cpu;
+}
+
+static void enc_estimate_encode_frame(AVFrame *frame_ptr, int sample_index, void *data_ptr){
+	enc_estimate_t *est = data_ptr;
+	if (sample_index != est->segment){
+		enc_estimate_add_preroll(est);
+		est->segment = sample_index;
+	}
+	
+	if (frame_ptr->pts == AV_NOPTS_VALUE || frame_ptr->pts == 0)
+		frame_ptr->pts = frame_ptr->pkt_pts;
+	enc_frame_pool_add_frame(est->src_filter_context_ptr, est->video_codec_context_ptr, frame_ptr);
+	
+	x264_context_t *x264_ptr = &est->x264;
+	while( enc_avfilter_pull_to_x264_context(est->sink_filter_context_ptr, est->filtered_frame_ptr, x264_ptr) ){
+		x264_ptr->payload_size = x264_encoder_encode(x264_ptr->encoder, &x264_ptr->nals, &x264_ptr->nal_count, &x264_ptr->pic_in, &x264_ptr->pic_out);
+		if (x264_ptr->payload_size > 0){
+			est->bytes += x264_ptr->payload_size;
+			est->frames_out++;
+		}
+	}
+	
+	est->last_frame = enc_estimate_clocks();
+}
+
+/**
+ * Predicts the encode time and the output size of the whole input without encoding it: a few short
+ * segments are piped through the filters and encoded with the real x264 settings. The results are
+ * extrapolated to the duration of the input and written as JSON into `output_file` (stdout if `NULL`).
+ *
+ * The main thread decodes and filters, x264 spreads the rest over its threads. The encode takes at least the
+ * main thread time and at least the CPU time divided by the cores (with the thread efficiency measured
+ * here). With a target size the size is known and the first pass is added to the time.
+ */
+bool enc_estimate(
+	AVFormatContext *format_context_ptr, int video_stream_index, AVCodecContext *video_codec_context_ptr,
+	AVRational input_time_base, AVRational input_sample_aspect_ratio, const char *filters,
+	int width, int height, AVRational sample_aspect_ratio, AVRational time_base, AVRational frame_rate,
+	const char *preset, const char *tune, float quality, const char *profile, float target_size,
+	const enc_audio_track_t *audio_tracks, int audio_track_count, const char *output_file
+){
+	if (format_context_ptr->duration == AV_NOPTS_VALUE || format_context_ptr->duration <= 0){
+		fprintf(stderr, "estimate: input has no known duration\n");
+		return false;
+	}
+	
+	enc_estimate_t est = { .video_codec_context_ptr = video_codec_context_ptr, .segment = -1 };
+	AVFilterGraph *filter_graph_ptr = NULL;
+	if ( ! enc_avfilter_build_graph(video_codec_context_ptr, input_time_base, input_sample_aspect_ratio, filters, &filter_graph_ptr, &est.src_filter_context_ptr, &est.sink_filter_context_ptr) )
+		return false;
+	if ( ! enc_x264_open(video_codec_context_ptr, width, height, sample_aspect_ratio, input_time_base, time_base, frame_rate,
+		preset, tune, quality, profile, 0, 0, false, NULL, &est.x264) ){
+		avfilter_graph_free(&filter_graph_ptr);
+		return false;
+	}
+	est.filtered_frame_ptr = avcodec_alloc_frame();
+	
+	enc_estimate_clocks_t start = enc_estimate_clocks();
+	est.last_frame = start;
+	
+	int frames = enc_analysis_sample_frames(format_context_ptr, video_stream_index, video_codec_context_ptr,
+		ENC_ESTIMATE_SEGMENTS, ENC_ESTIMATE_SEGMENT_FRAMES, enc_estimate_encode_frame, &est);
+	
+	// The rewind after the sampling is the last preroll, the delayed frames are part of the encode
+	enc_estimate_add_preroll(&est);
+	x264_context_t *x264_ptr = &est.x264;
+	while( x264_encoder_delayed_frames(x264_ptr->encoder) > 0 ){
+		x264_ptr->payload_size = x264_encoder_encode(x264_ptr->encoder, &x264_ptr->nals, &x264_ptr->nal_count, NULL, &x264_ptr->pic_out);
+		if (x264_ptr->payload_size < 0)
+			break;
+		est.bytes += x264_ptr->payload_size;
+		est.frames_out++;
+	}
+	
+	enc_estimate_clocks_t end = enc_estimate_clocks();
+	enc_x264_close(&est.x264);
+	avfilter_graph_free(&filter_graph_ptr);
+	av_free(est.filtered_frame_ptr);
+	
+	if (frames < 0)
+		return false;
+	if (est.frames_out == 0){
+		fprintf(stderr, "estimate: no frames could be sampled\n");
+		return false;
+	}
+	
+	// Times per encoded frame, each clock without its preroll
+	double wall_sec = end.wall - start.wall;
+	double main_per_frame = fmax(end.main_cpu - start.main_cpu - est.preroll.main_cpu, 0) / est.frames_out;
+	double cpu_per_frame = fmax(end.cpu - start.cpu - est.preroll.cpu, 0) / est.frames_out;
+	double wall_per_frame = fmax(wall_sec - est.preroll.wall, 1e-6) / est.frames_out;
+	
+	// If the sampled encode wasn't limited by the main thread its wall time shows how well x264 used the
+	// cores. Short segments fill and drain the x264 threads often, so that's a lower bound.
+	int cores = enc_cpu_count();
+	double efficiency = 1;
+	if (cpu_per_frame / cores > main_per_frame)
+		efficiency = fmin(1, fmax(cpu_per_frame / (cores * wall_per_frame), 0.1));
+	
+	double duration_sec = format_context_ptr->duration / (double) AV_TIME_BASE;
+	double total_frames = duration_sec * av_q2d(frame_rate);
+	double video_bit_rate = est.bytes * 8.0 / est.frames_out * av_q2d(frame_rate);
+	double audio_bit_rate = 0;
+	for(int i = 0; i < audio_track_count; i++)
+		audio_bit_rate += (double)audio_tracks[i].convert.output_channels * ENC_TWO_PASS_AUDIO_BIT_RATE;
+	double size = (video_bit_rate + audio_bit_rate) * duration_sec / 8 * (1 + ENC_TWO_PASS_MUX_OVERHEAD);
+	if (target_size > 0)
+		size = target_size * 1024 * 1024;
+	
+	FILE *file = stdout;
+	if (output_file != NULL){
+		file = fopen(output_file, "w");
+		if (file == NULL){
+			perror(output_file);
+			return false;
+		}
+	}
+	
+	fprintf(file, "{\n\t\"duration\": %.3f,\n\t\"frames\": %.0f,\n\t\"sampled_frames\": %ld,\n\t\"sampling_time\": %.3f,\n", duration_sec, total_frames, est.frames_out, wall_sec);
+	fprintf(file, "\t\"quality\": %.1f,\n\t\"video_bit_rate\": %.0f,\n\t\"audio_bit_rate\": %.0f,\n\t\"size\": %.0f,\n", quality, video_bit_rate / 1000, audio_bit_rate / 1000, size);
+	fprintf(file, "\t\"cpu_time\": %.1f,\n\t\"thread_efficiency\": %.2f,\n\t\"wall_time\": [\n", cpu_per_frame * total_frames * ((target_size > 0) ? 1 + ENC_ESTIMATE_FIRST_PASS_COST : 1), efficiency);
+	// Powers of two up to the CPUs we may use, and all of them
+	for(int c = 1; c <= cores; c = (c * 2 > cores && c < cores) ? cores : c * 2){
+		double frame_sec = fmax(main_per_frame, cpu_per_frame / (c * efficiency));
+		if (target_size > 0)
+			frame_sec += fmax(main_per_frame, cpu_per_frame * ENC_ESTIMATE_FIRST_PASS_COST / (c * efficiency));
+		fprintf(file, "\t\t{ \"cores\": %d, \"seconds\": %.1f }%s\n", c, frame_sec * total_frames, (c < cores) ? "," : "");
+	}
+	fprintf(file, "\t]\n}\n");
+	
+	if (file != stdout)
+		fclose(file);
+	return true;
+}
+
+
+//
+// Live mode stuff
+//
+
+// Number of frames whose input time is remembered for the latency measurement
+#define ENC_LIVE_MAX_PENDING 256
+
+typedef struct {
+	float budget_ms;
+	
+	// Segmented output: a new MP4 file is started with the first keyframe after `segment_duration` seconds
+	const char *output_file;
+	float segment_duration;
+	int segment_index;
+	int64_t segment_start_pts;
+	AVRational time_base;
+	
+	// Time each frame was read from the input (by PTS) until it's written to the output
+	int64_t pending_pts[ENC_LIVE_MAX_PENDING];
+	struct timespec pending_input_time[ENC_LIVE_MAX_PENDING];
+	int pending_start, pending_count;
+	
+	int64_t frames, frames_over_budget;
+	double latency_sum_ms, latency_max_ms;
+} enc_live_t;
+
+/**
+ * Builds the file name of a segment: "lecture.mp4" becomes "lecture-00001.mp4".
+ */
+void enc_live_segment_name(const char *output_file, int index, char *buffer, size_t buffer_size){
+	const char *extension = strrchr(output_file, '.');
+	if (extension == NULL || strchr(extension, '/') != NULL)
+		extension = output_file + strlen(output_file);
+	snprintf(buffer, buffer_size, "%.*s-%05d%s", (int)(extension - output_file), output_file, index, extension);
+}
+
+void enc_live_init(float budget_ms, const char *output_file, float segment_duration, AVRational time_base, enc_live_t *live){
+	*live = (enc_live_t){
+		.budget_ms = budget_ms,
+		.output_file = output_file, .segment_duration = segment_duration, .segment_index = 1, .segment_start_pts = 0,
+		.time_base = time_base,
+		.pending_start = 0, .pending_count = 0,
+		.frames = 0, .frames_over_budget = 0, .latency_sum_ms = 0, .latency_max_ms = 0
+	};
+}
+
+/**
+ * Remembers the time a frame (PTS in the encoder time base) was read from the input.
+ */
+void enc_live_frame_in(enc_live_t *live, int64_t pts, const struct timespec *input_time){
+	if (live->pending_count == ENC_LIVE_MAX_PENDING){
+		live->pending_start = (live->pending_start + 1) % ENC_LIVE_MAX_PENDING;
+		live->pending_count--;
+	}
+	int index = (live->pending_start + live->pending_count) % ENC_LIVE_MAX_PENDING;
+	live->pending_pts[index] = pts;
+	live->pending_input_time[index] = *input_time;
+	live->pending_count++;
+}
+
+/**
+ * Measures the latency of a frame that was just written to the output. Frames with an older PTS are
+ * forgotten, they were dropped somewhere on the way.
+ */
+void enc_live_frame_out(enc_live_t *live, int64_t pts){
+	while (live->pending_count > 0 && live->pending_pts[live->pending_start] <= pts){
+		int index = live->pending_start;
+		live->pending_start = (live->pending_start + 1) % ENC_LIVE_MAX_PENDING;
+		live->pending_count--;
+		if (live->pending_pts[index] != pts)
+			continue;
+		
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		double latency_ms = (now.tv_sec - live->pending_input_time[index].tv_sec) * 1000.0 + (now.tv_nsec - live->pending_input_time[index].tv_nsec) / 1000000.0;
+		
+		live->frames++;
+		live->latency_sum_ms += latency_ms;
+		if (latency_ms > live->latency_max_ms)
+			live->latency_max_ms = latency_ms;
+		if (latency_ms > live->budget_ms){
+			live->frames_over_budget++;
+			enc_debug("live: frame %ld took %.1f ms, over the budget of %.1f ms\n", pts, latency_ms, live->budget_ms);
+		}
+	}
+}
+
+/**
+ * Starts a new segment if the current one is long enough and the next frame is a keyframe. The current MP4
+ * file is closed and the next one is opened with the same video and audio tracks.
+ */
+bool enc_live_next_segment(
+	enc_live_t *live, x264_picture_t *pic_ptr, int width, int height, AVRational sample_aspect_ratio,
+	enc_mp4_file_t **container_dptr, int *video_track_ptr, mp4_video_mux_t *video_mux_ptr,
+	enc_audio_track_t *audio_tracks, int audio_track_count
+){
+	if ( live->segment_duration <= 0 || !pic_ptr->b_keyframe || (pic_ptr->i_pts - live->segment_start_pts) * av_q2d(live->time_base) < live->segment_duration )
+		return true;
+	
+	enc_mp4_close(*container_dptr);
+	*container_dptr = NULL;
+	live->segment_index++;
+	live->segment_start_pts = pic_ptr->i_pts;
+	
+	char segment_file[PATH_MAX];
+	enc_live_segment_name(live->output_file, live->segment_index, segment_file, sizeof(segment_file));
+	enc_debug("live: starting segment %s\n", segment_file);
+	
+	int64_t fixed_duration = video_mux_ptr->fixed_duration;
+	enc_mp4_video_mux_init(video_mux_ptr);
+	video_mux_ptr->fixed_duration = fixed_duration;
+	
+	if ( ! enc_mp4_open(segment_file, live->time_base, width, height, sample_aspect_ratio, container_dptr, video_track_ptr) )
+		return false;
+	for(int i = 0; i < audio_track_count; i++){
+		audio_tracks[i].container = *container_dptr;
+		if ( ! enc_mp4_add_audio_track(*container_dptr, audio_tracks[i].convert.output_rate, audio_tracks[i].language, i == 0, &audio_tracks[i].mp4_track) )
+			return false;
+	}
+	
+	return true;
+}
+
+void enc_live_report(enc_live_t *live){
+	printf("Live latency: %ld frames, average %.1f ms, max %.1f ms, %ld frames over the budget of %.0f ms, %d segments\n",
+		live->frames, (live->frames > 0) ? live->latency_sum_ms / live->frames : 0.0, live->latency_max_ms,
+		live->frames_over_budget, live->budget_ms, live->segment_index);
+}
+
+
+//
+// Trim stuff (smart rendering of already encoded files)
+//
+
+#define ENC_MAX_TRIM_RANGES 64
+
+// A time range to keep in seconds, `end` is HUGE_VAL if the range goes until the end of the file
+typedef struct {
+	double start, end;
+} enc_trim_range_t;
+
+typedef struct {
+	enc_mp4_file_t *input, *output;
+	int input_track, output_track;
+	enc_mp4_sample_t *samples;
+	uint32_t sample_count, timescale;
+	AVRational sample_aspect_ratio;
+	
+	// h264 decoder for the GOPs at the cut points and a buffer for its (padded) packets
+	AVCodecContext *decoder_context_ptr;
+	bool decoder_opened;
+	AVFrame *frame_ptr;
+	uint8_t *packet_buffer_ptr;
+	uint32_t packet_buffer_size;
+	
+	// x264 settings for the GOPs that are encoded again. `sps_id` is a parameter set id the input doesn't use.
+	const char *preset, *tune, *profile;
+	float quality;
+	int sps_id;
+	
+	int64_t samples_copied, frames_encoded;
+} enc_trim_t;
+
+/**
+ * Parses a list of time ranges to keep, e.g. "60-3540" or "0-600,900-" (in seconds, an empty end means
+ * until the end of the file). The ranges have to be in order and must not overlap.
+ */
+bool enc_trim_parse_ranges(const char *spec, enc_trim_range_t *ranges, int *range_count){
+	const char *pos = spec;
+	char *end_ptr = NULL;
+	*range_count = 0;
+	
+	while (*pos != '\0'){
+		if (*range_count == ENC_MAX_TRIM_RANGES){
+			fprintf(stderr, "trim: more than %d ranges\n", ENC_MAX_TRIM_RANGES);
+			return false;
+		}
+		
+		enc_trim_range_t *range = &ranges[*range_count];
+		range->start = strtod(pos, &end_ptr);
+		if (end_ptr == pos || *end_ptr != '-')
+			break;
+		pos = end_ptr + 1;
+		
+		range->end = HUGE_VAL;
+		if (*pos != ',' && *pos != '\0'){
+			range->end = strtod(pos, &end_ptr);
+			if (end_ptr == pos)
+				break;
+			pos = end_ptr;
+		}
+		
+		if ( range->end <= range->start || (*range_count > 0 && range->start < ranges[*range_count - 1].end) ){
+			fprintf(stderr, "trim: range %d is empty or overlaps the previous one\n", *range_count + 1);
+			return false;
+		}
+		(*range_count)++;
+		
+		if (*pos == ',')
+			pos++;
+		else if (*pos != '\0')
+			break;
+	}
+	
+	if (*pos != '\0' || *range_count == 0){
+		fprintf(stderr, "trim: can't parse the ranges \"%s\", expected something like \"60-3540\" or \"0-600,900-\"\n", spec);
+		return false;
+	}
+	
+	return true;
+}
+
+/**
+ * Presentation time of a video sample in the track timescale.
+ */
+static int64_t enc_trim_sample_pts(enc_trim_t *trim, uint32_t sample_index){
+	return trim->samples[sample_index].dts + trim->samples[sample_index].composition_offset;
+}
+
+/**
+ * Reads an unsigned Exp-Golomb value (ue(v) of the h264 spec) at `bit_pos` and moves `bit_pos` behind it.
+ * Returns -1 if the data ends before the value.
+ */
+static int enc_trim_read_ue(const uint8_t *data_ptr, int size, int *bit_pos){
+	int leading_zeros = 0;
+	while(true){
+		if (*bit_pos >= size * 8 || leading_zeros > 16)
+			return -1;
+		int bit = (data_ptr[*bit_pos / 8] >> (7 - *bit_pos % 8)) & 1;
+		(*bit_pos)++;
+		if (bit)
+			break;
+		leading_zeros++;
+	}
+	
+	int value = 0;
+	for(int i = 0; i < leading_zeros; i++){
+		if (*bit_pos >= size * 8)
+			return -1;
+		value = (value << 1) | ((data_ptr[*bit_pos / 8] >> (7 - *bit_pos % 8)) & 1);
+		(*bit_pos)++;
+	}
+	return (1 << leading_zeros) - 1 + value;
+}
+
+/**
+ * Returns the id of a parameter set (NAL unit with its header): the seq_parameter_set_id of an SPS or the
+ * pic_parameter_set_id of a PPS. -1 if it can't be read.
+ */
+static int enc_trim_parameter_set_id(const uint8_t *nal_ptr, uint16_t size, bool is_sps){
+	// The ids are right at the start, only the first few bytes are needed without emulation prevention bytes
+	uint8_t rbsp[16];
+	int rbsp_size = 0, zeros = 0;
+	for(int i = 1; i < size && rbsp_size < (int)sizeof(rbsp); i++){
+		if (zeros >= 2 && nal_ptr[i] == 3){
+			zeros = 0;
+			continue;
+		}
+		zeros = (nal_ptr[i] == 0) ? zeros + 1 : 0;
+		rbsp[rbsp_size++] = nal_ptr[i];
+	}
+	
+	// An SPS starts with profile_idc, the constraint flags and level_idc
+	int bit_pos = is_sps ? 24 : 0;
+	return enc_trim_read_ue(rbsp, rbsp_size, &bit_pos);
+}
+
+/**
+ * Creates the video track of the output with the same codec details and parameter sets as the input and
+ * opens the h264 decoder. The decoder gets the parameter sets and the samples as Annex B bytestream.
+ */
+bool enc_trim_open_video(enc_trim_t *trim){
+	enc_mp4_track_t *input_ptr = &trim->input->tracks[trim->input_track];
+	if (input_ptr->nal_length_size != 4){
+		fprintf(stderr, "trim: only h264 tracks with 4 byte NAL sizes are supported (like the ones written by av_encode)\n");
+		return false;
+	}
+	if (input_ptr->sps_count == 0 || input_ptr->pps_count == 0){
+		fprintf(stderr, "trim: input video track has no parameter sets\n");
+		return false;
+	}
+	
+	// The GOPs encoded again get parameter sets with an id the input doesn't use (a file trimmed before
+	// already has two). x264 gives its SPS and PPS the same id, at most 31.
+	bool used_ids[32] = { false };
+	for(int i = 0; i < input_ptr->sps_count + input_ptr->pps_count; i++){
+		bool is_sps = (i < input_ptr->sps_count);
+		int id = is_sps ? enc_trim_parameter_set_id(input_ptr->sps[i], input_ptr->sps_sizes[i], true)
+			: enc_trim_parameter_set_id(input_ptr->pps[i - input_ptr->sps_count], input_ptr->pps_sizes[i - input_ptr->sps_count], false);
+		if (id < 0){
+			fprintf(stderr, "trim: can't read the id of an input %s\n", is_sps ? "SPS" : "PPS");
+			return false;
+		}
+		if (id < 32)
+			used_ids[id] = true;
+	}
+	trim->sps_id = -1;
+	for(int id = 0; id < 32 && trim->sps_id == -1; id++){
+		if (!used_ids[id])
+			trim->sps_id = id;
+	}
+	if (trim->sps_id == -1){
+		fprintf(stderr, "trim: the input uses all parameter set ids, there is none left for the encoded GOPs\n");
+		return false;
+	}
+	enc_debug("trim: using parameter set id %d for the encoded GOPs\n", trim->sps_id);
+	
+	// The output track gets the same codec details and parameter sets
+	trim->output_track = enc_mp4_add_track(trim->output, ENC_MP4_VIDEO, trim->timescale);
+	if ( trim->output_track == ENC_MP4_INVALID_TRACK || ! enc_mp4_copy_track_config(&trim->output->tracks[trim->output_track], input_ptr) )
+		return false;
+	
+	trim->sample_aspect_ratio = (AVRational){ .num = 0, .den = 1 };
+	if (input_ptr->h_spacing > 0 && input_ptr->v_spacing > 0)
+		trim->sample_aspect_ratio = (AVRational){ .num = input_ptr->h_spacing, .den = input_ptr->v_spacing };
+	
+	// The decoder gets the parameter sets as extradata
+	size_t extradata_size = 0;
+	for(int i = 0; i < input_ptr->sps_count; i++)
+		extradata_size += 4 + input_ptr->sps_sizes[i];
+	for(int i = 0; i < input_ptr->pps_count; i++)
+		extradata_size += 4 + input_ptr->pps_sizes[i];
+	
+	uint8_t *extradata_ptr = av_mallocz(extradata_size + FF_INPUT_BUFFER_PADDING_SIZE), *pos = extradata_ptr;
+	if (extradata_ptr == NULL){
+		fprintf(stderr, "trim: failed to allocate the decoder extradata\n");
+		return false;
+	}
+	uint8_t start_code[4] = { 0, 0, 0, 1 };
+	for(int i = 0; i < input_ptr->sps_count; i++){
+		memcpy(pos, start_code, 4);
+		memcpy(pos + 4, input_ptr->sps[i], input_ptr->sps_sizes[i]);
+		pos += 4 + input_ptr->sps_sizes[i];
+	}
+	for(int i = 0; i < input_ptr->pps_count; i++){
+		memcpy(pos, start_code, 4);
+		memcpy(pos + 4, input_ptr->pps[i], input_ptr->pps_sizes[i]);
+		pos += 4 + input_ptr->pps_sizes[i];
+	}
+	
+	// From here on the extradata belongs to the decoder context, `enc_trim_close()` frees both
+	AVCodec *codec_ptr = avcodec_find_decoder(CODEC_ID_H264);
+	if (codec_ptr == NULL){
+		fprintf(stderr, "trim: found no h264 decoder\n");
+		av_free(extradata_ptr);
+		return false;
+	}
+	trim->decoder_context_ptr = avcodec_alloc_context3(codec_ptr);
+	if (trim->decoder_context_ptr == NULL){
+		fprintf(stderr, "trim: failed to allocate the h264 decoder\n");
+		av_free(extradata_ptr);
+		return false;
+	}
+	trim->decoder_context_ptr->extradata = extradata_ptr;
+	trim->decoder_context_ptr->extradata_size = extradata_size;
+	if ( avcodec_open(trim->decoder_context_ptr, codec_ptr) != 0 ){
+		fprintf(stderr, "trim: initialization of the h264 decoder failed\n");
+		return false;
+	}
+	trim->decoder_opened = true;
+	
+	trim->frame_ptr = avcodec_alloc_frame();
+	if (trim->frame_ptr == NULL){
+		fprintf(stderr, "trim: failed to allocate the decoded frame\n");
+		return false;
+	}
+	
+	return true;
+}
+
+/**
+ * Closes the files and frees the decoder of a trim. If `discard` is set the output is incomplete (e.g. it
+ * ends in the middle of a GOP), it's not finished but removed. Returns `true` if the output was written.
+ */
+static bool enc_trim_close(enc_trim_t *trim, const char *output_file, bool discard){
+	bool written = false;
+	if (trim->output != NULL){
+		bool created = (trim->output->file != NULL);
+		if (discard)
+			trim->output->write_failed = true;
+		written = enc_mp4_close(trim->output) && !discard;
+		if (discard && created)
+			unlink(output_file);
+	}
+	enc_mp4_close(trim->input);
+	
+	av_free(trim->packet_buffer_ptr);
+	av_free(trim->frame_ptr);
+	if (trim->decoder_context_ptr != NULL){
+		if (trim->decoder_opened)
+			avcodec_close(trim->decoder_context_ptr);
+		av_freep(&trim->decoder_context_ptr->extradata);
+		av_free(trim->decoder_context_ptr);
+	}
+	
+	*trim = (enc_trim_t){ 0 };
+	return written;
+}
+
+static void enc_trim_copy_sample(enc_mp4_file_t *input, int input_track, enc_mp4_file_t *output, int output_track, uint32_t sample_index){
+	enc_mp4_sample_t *sample = &input->tracks[input_track].samples[sample_index];
+	const uint8_t *data_ptr = NULL;
+	
+	if ( ! enc_mp4_read_sample(input, input_track, sample_index, &data_ptr) ){
+		fprintf(stderr, "trim: failed to read sample %u of track %d\n", sample_index, input_track);
+		return;
+	}
+	if ( ! enc_mp4_write_sample(output, output_track, data_ptr, sample->size, sample->duration, sample->composition_offset, sample->sync) )
+		fprintf(stderr, "trim: failed to write sample %u of track %d\n", sample_index, input_track);
+}
+
+/**
+ * Decodes the GOP from `first_id` to `last_id` and encodes the frames with a presentation time from `start`
+ * to `end` (in the track timescale) again. The x264 encoder uses the SPS/PPS id `sps_id` so its parameter sets
+ * don't collide with the ones of the copied GOPs.
+ */
+bool enc_trim_encode_gop(enc_trim_t *trim, uint32_t first_index, uint32_t last_index, int64_t start, int64_t end){
+	x264_context_t x264;
+	bool x264_opened = false;
+	int64_t frame_duration = trim->samples[first_index].duration;
+	AVRational time_base = (AVRational){ .num = 1, .den = trim->timescale };
+	
+	// The track is already configured with the codec details of the original encode
+	mp4_video_mux_t mux;
+	enc_mp4_video_mux_init(&mux);
+	mux.configured = true;
+	mux.last_duration = frame_duration;
+	
+	enc_debug("trim: encoding GOP %u-%u from %ld to %ld\n", first_index, last_index, start, end);
+	avcodec_flush_buffers(trim->decoder_context_ptr);
+	
+	AVPacket packet;
+	av_init_packet(&packet);
+	for(uint32_t sample_index = first_index; ; sample_index++){
+		bool flushing = (sample_index > last_index);
+		if (flushing) {
+			// Get the frames still delayed in the decoder
+			packet.data = NULL;
+			packet.size = 0;
+		} else {
+			const uint8_t *data_ptr = NULL;
+			uint32_t size = trim->samples[sample_index].size;
+			if ( ! enc_mp4_read_sample(trim->input, trim->input_track, sample_index, &data_ptr) ){
+				fprintf(stderr, "trim: failed to read video sample %u\n", sample_index);
+				continue;
+			}
+			
+			if (size + FF_INPUT_BUFFER_PADDING_SIZE > trim->packet_buffer_size){
+				av_free(trim->packet_buffer_ptr);
+				trim->packet_buffer_size = size + FF_INPUT_BUFFER_PADDING_SIZE;
+				trim->packet_buffer_ptr = av_malloc(trim->packet_buffer_size);
+				if (trim->packet_buffer_ptr == NULL){
+					fprintf(stderr, "trim: failed to allocate a packet buffer of %u bytes\n", trim->packet_buffer_size);
+					trim->packet_buffer_size = 0;
+					if (x264_opened)
+						enc_x264_close(&x264);
+					return false;
+				}
+			}
+			memcpy(trim->packet_buffer_ptr, data_ptr, size);
+			memset(trim->packet_buffer_ptr + size, 0, FF_INPUT_BUFFER_PADDING_SIZE);
+			
+			// Replace the 4 byte NAL sizes with Annex B start codes, they have the same length
+			uint8_t *nal_ptr = trim->packet_buffer_ptr;
+			for(uint32_t pos = 0; pos + 4 <= size; ){
+				uint32_t nal_size = (nal_ptr[pos] << 24) | (nal_ptr[pos + 1] << 16) | (nal_ptr[pos + 2] << 8) | nal_ptr[pos + 3];
+				nal_ptr[pos] = nal_ptr[pos + 1] = nal_ptr[pos + 2] = 0;
+				nal_ptr[pos + 3] = 1;
+				pos += 4 + nal_size;
+			}
+			
+			packet.data = trim->packet_buffer_ptr;
+			packet.size = size;
+			packet.pts = enc_trim_sample_pts(trim, sample_index);
+			packet.dts = trim->samples[sample_index].dts;
+		}
+		
+		int frame_available = 0;
+		int error = avcodec_decode_video2(trim->decoder_context_ptr, trim->frame_ptr, &frame_available, &packet);
+		if (error < 0)
+			enc_av_perror("avcodec_decode_video2", error);
+		if (!frame_available){
+			if (flushing)
+				break;
+			continue;
+		}
+		
+		int64_t pts = trim->frame_ptr->pkt_pts;
+		if (pts < start || pts >= end)
+			continue;
+		
+		if (!x264_opened){
+			AVCodecContext *decoder_ptr = trim->decoder_context_ptr;
+			AVRational frame_rate = (AVRational){ .num = trim->timescale, .den = frame_duration };
+			if ( ! enc_x264_open(decoder_ptr, decoder_ptr->width, decoder_ptr->height, trim->sample_aspect_ratio, time_base, time_base, frame_rate,
+				trim->preset, trim->tune, trim->quality, trim->profile, 0, trim->sps_id, false, NULL, &x264) )
+				return false;
+			x264_opened = true;
+		}
+		
+		x264.pic_in.i_type = X264_TYPE_AUTO;
+		x264.pic_in.i_pts = pts;
+		sws_scale(x264.scaler, (const uint8_t * const*)trim->frame_ptr->data, trim->frame_ptr->linesize, 0, trim->decoder_context_ptr->height,
+			x264.pic_in.img.plane, x264.pic_in.img.i_stride);
+		
+		x264.payload_size = x264_encoder_encode(x264.encoder, &x264.nals, &x264.nal_count, &x264.pic_in, &x264.pic_out);
+		if (x264.payload_size > 0)
+			enc_mp4_mux_video(trim->output, trim->output_track, &mux, &x264);
+		else if ( x264.payload_size < 0 )
+			fprintf(stderr, "x264: encoder error\n");
+		trim->frames_encoded++;
+	}
+	
+	if (!x264_opened)
+		return true;
+	
+	while( x264_encoder_delayed_frames(x264.encoder) > 0 ){
+		x264.payload_size = x264_encoder_encode(x264.encoder, &x264.nals, &x264.nal_count, NULL, &x264.pic_out);
+		if (x264.payload_size > 0)
+			enc_mp4_mux_video(trim->output, trim->output_track, &mux, &x264);
+	}
+	x264.payload_size = 0;
+	enc_mp4_mux_video(trim->output, trim->output_track, &mux, &x264);
+	enc_x264_close(&x264);
+	
+	return true;
+}
+
+/**
+ * Copies all samples of an audio track that start within the kept ranges. AAC frames are independent so
+ * the cuts are precise to one frame (1024 samples). Like for the video the ranges are relative to `origin`
+ * (seconds), the presentation time of the first video frame.
+ */
+bool enc_trim_copy_audio(enc_trim_t *trim, int input_track, enc_trim_range_t *ranges, int range_count, double origin){
+	enc_mp4_track_t *input_ptr = &trim->input->tracks[input_track];
+	int output_track = enc_mp4_add_track(trim->output, ENC_MP4_AUDIO, input_ptr->timescale);
+	if ( output_track == ENC_MP4_INVALID_TRACK || ! enc_mp4_copy_track_config(&trim->output->tracks[output_track], input_ptr) )
+		return false;
+	
+	for(uint32_t sample_index = 0; sample_index < input_ptr->sample_count; sample_index++){
+		double time = input_ptr->samples[sample_index].dts / (double)input_ptr->timescale - origin;
+		for(int i = 0; i < range_count; i++){
+			if (time >= ranges[i].start && time < ranges[i].end){
+				enc_trim_copy_sample(trim->input, input_track, trim->output, output_track, sample_index);
+				break;
+			}
+		}
+	}
+	
+	return true;
+}
+
+/**
+ * Writes the parts of the input MP4 file within the ranges into the output file. Whole GOPs are copied as
+ * they are, only the GOPs cut by a range boundary are decoded and encoded again. For best results use the
+ * same x264 options as for the original encode.
+ */
+bool enc_trim(const char *input_file, const char *output_file, const char *ranges_spec,
+	const char *preset, const char *tune, float quality, const char *profile
+){
+	enc_trim_range_t ranges[ENC_MAX_TRIM_RANGES];
+	int range_count = 0;
+	if ( ! enc_trim_parse_ranges(ranges_spec, ranges, &range_count) )
+		return false;
+	
+	enc_result_cache_unlink_output(output_file);
+	
+	enc_trim_t trim = {
+		.preset = preset, .tune = tune, .quality = quality, .profile = profile,
+		.samples_copied = 0, .frames_encoded = 0
+	};
+	
+	if ( ! enc_mp4_read(input_file, &trim.input) )
+		return enc_trim_close(&trim, output_file, true);
+	trim.input_track = enc_mp4_find_track(trim.input, ENC_MP4_VIDEO, 0);
+	if (trim.input_track == ENC_MP4_INVALID_TRACK || trim.input->tracks[trim.input_track].sample_count == 0){
+		fprintf(stderr, "trim: %s has no video track\n", input_file);
+		return enc_trim_close(&trim, output_file, true);
+	}
+	trim.samples = trim.input->tracks[trim.input_track].samples;
+	trim.sample_count = trim.input->tracks[trim.input_track].sample_count;
+	trim.timescale = trim.input->tracks[trim.input_track].timescale;
+	
+	// From here on a failure leaves an incomplete output behind, it's removed on close
+	if ( ! enc_mp4_create(output_file, &trim.output) )
+		return enc_trim_close(&trim, output_file, true);
+	trim.output->audio_profile_level = 0x0f;
+	
+	if ( ! enc_trim_open_video(&trim) )
+		return enc_trim_close(&trim, output_file, true);
+	
+	// The ranges are relative to the presentation time of the first frame
+	int64_t first_pts = enc_trim_sample_pts(&trim, 0);
+	
+	uint32_t gop_first = 0;
+	while (gop_first < trim.sample_count){
+		// A GOP goes until the next sync sample. The GOPs of av_encode are closed so all frames of a GOP are
+		// presented before the first frame of the next GOP.
+		uint32_t gop_last = gop_first;
+		while (gop_last + 1 < trim.sample_count && ! trim.samples[gop_last + 1].sync)
+			gop_last++;
+		
+		int64_t gop_start = INT64_MAX, gop_end = INT64_MIN;
+		for(uint32_t sample_index = gop_first; sample_index <= gop_last; sample_index++){
+			int64_t pts = enc_trim_sample_pts(&trim, sample_index);
+			int64_t duration = trim.samples[sample_index].duration;
+			if (pts < gop_start)
+				gop_start = pts;
+			if (pts + duration > gop_end)
+				gop_end = pts + duration;
+		}
+		
+		for(int i = 0; i < range_count; i++){
+			int64_t range_start = first_pts + ranges[i].start * trim.timescale;
+			int64_t range_end = (ranges[i].end == HUGE_VAL) ? INT64_MAX : first_pts + (int64_t)(ranges[i].end * trim.timescale);
+			if (range_end <= gop_start || range_start >= gop_end)
+				continue;
+			
+			if (range_start <= gop_start && range_end >= gop_end) {
+				for(uint32_t sample_index = gop_first; sample_index <= gop_last; sample_index++)
+					enc_trim_copy_sample(trim.input, trim.input_track, trim.output, trim.output_track, sample_index);
+				trim.samples_copied += gop_last - gop_first + 1;
+			} else {
+				int64_t start = (range_start > gop_start) ? range_start : gop_start;
+				int64_t end = (range_end < gop_end) ? range_end : gop_end;
+				if ( ! enc_trim_encode_gop(&trim, gop_first, gop_last, start, end) )
+					return enc_trim_close(&trim, output_file, true);
+			}
+		}
+		
+		gop_first = gop_last + 1;
+	}
+	
+	// Copy the audio tracks, cut at the same times as the video
+	for(int i = 0; enc_mp4_find_track(trim.input, ENC_MP4_AUDIO, i) != ENC_MP4_INVALID_TRACK; i++){
+		if ( ! enc_trim_copy_audio(&trim, enc_mp4_find_track(trim.input, ENC_MP4_AUDIO, i), ranges, range_count, first_pts / (double)trim.timescale) )
+			return enc_trim_close(&trim, output_file, true);
+	}
+	
+	printf("Trimmed %s: %ld video frames copied, %ld frames encoded again\n", input_file, trim.samples_copied, trim.frames_encoded);
+	return enc_trim_close(&trim, output_file, false);
+}
+
+
+//
+// Input stuff (several input files encoded as one video)
+//
+
+/**
+ * An input file following the first one, with its selected streams and the opened video decoder.
+ */
+typedef struct {
+	AVFormatContext *format_context_ptr;
+	int video_stream_index;
+	int audio_stream_indices[ENC_MAX_AUDIO_TRACKS];
+	int audio_stream_count;
+	AVCodec *video_codec_ptr;
+	AVCodecContext *video_codec_context_ptr;
+} enc_input_t;
+
+/**
+ * Opens the next input file. The stream options given by the user are applied to every input file, if the
+ * streams are selected automatically they're selected for each file on its own.
+ */
+bool enc_input_open(const enc_options_t *opts, const char *filename, enc_input_t *input){
+	input->format_context_ptr = NULL;
+	enc_asf_stream_info_t *asf_stream_infos_ptr = NULL;
+	bool opened = enc_avformat_open_file(filename, opts->probe_size, opts->probe_duration, NULL, &input->format_context_ptr, &asf_stream_infos_ptr);
+	if (opened){
+		av_dump_format(input->format_context_ptr, 0, filename, 0);
+		
+		input->video_stream_index = opts->video_stream_index;
+		input->audio_stream_count = opts->audio_stream_count;
+		memcpy(input->audio_stream_indices, opts->audio_stream_indices, sizeof(int) * opts->audio_stream_count);
+		opened = enc_avformat_select_streams(input->format_context_ptr, asf_stream_infos_ptr, &input->video_stream_index,
+			input->audio_stream_indices, &input->audio_stream_count, opts->all_audio_streams)
+			&& enc_avcodec_open(input->format_context_ptr, input->video_stream_index, AVMEDIA_TYPE_VIDEO,
+			&input->video_codec_context_ptr, &input->video_codec_ptr);
+	}
+	free(asf_stream_infos_ptr);
+	
+	if (!opened && input->format_context_ptr != NULL){
+		av_close_input_file(input->format_context_ptr);
+		input->format_context_ptr = NULL;
+	}
+	return opened;
+}
+
+
+//
+// Session stuff (one encode from the input files to the output file)
+//
+
+/**
+ * Everything an encode needs, from the input format context to the MP4 muxer. Nothing is shared
+ * between sessions so several of them can run in one process (each on its own thread).
+ */
+struct enc_session {
+	// The options of this session. The stream indices are filled in when the streams are selected,
+	// `input_options` keeps them as given for the following input files.
+	enc_options_t options, input_options;
+	// Exit code of the command line tool for the last error, 0 if there was none
+	int error;
+	bool result_cache_hit, flushed;
+	
+	enc_result_cache_t result_cache;
+	enc_result_cache_t *result_cache_ptr;
+	
+	AVFormatContext *format_context_ptr;
+	// Stream information from the header objects of ASF inputs, `NULL` for other files
+	enc_asf_stream_info_t *asf_stream_infos_ptr;
+	int input_index;
+	enc_follow_t follow;
+	AVCodec *video_codec_ptr;
+	AVCodecContext *video_codec_context_ptr;
+	AVFrame *decoded_frame_ptr;
+	// Decoded frames are allocated from this pool and handed to the filter graph without a copy
+	enc_frame_pool_t *frame_pool;
+	
+	// The audio tracks are opened one after the other, `audio_track_count` are the ones opened so far
+	bool loudness_enabled;
+	enc_audio_track_t audio_tracks[ENC_MAX_AUDIO_TRACKS];
+	int audio_track_count;
+	
+	// Time base and frame rate of the input and of the encoded video. They differ if frames are retimed.
+	AVRational sample_aspect_ratio, video_time_base, frame_rate, encoded_time_base, encoded_frame_rate;
+	char video_filter[1024];
+	AVFilterGraph *filter_graph_ptr;
+	AVFilterContext *src_filter_context_ptr, *sink_filter_context_ptr;
+	int video_width, video_height;
+	
+	enc_x264_two_pass_t two_pass;
+	enc_x264_two_pass_t *two_pass_ptr;
+	char stats_file[PATH_MAX];
+	x264_context_t x264;
+	enc_speed_t speed;
+	enc_governor_t governor;
+	enc_affinity_t affinity;
+	bool affinity_opened;
+	enc_metrics_t metrics;
+	bool metrics_opened;
+	enc_dedup_t dedup;
+	bool dedup_opened;
+	enc_live_t live;
+	char first_segment_file[PATH_MAX];
+	
+	enc_mp4_file_t *mp4_container;
+	int mp4_video_track;
+	mp4_video_mux_t mp4_video_mux;
+	
+	// Side outputs
+	enc_snapshots_t snapshots;
+	bool snapshots_opened;
+	x264_context_t preview_x264;
+	int preview_width, preview_height;
+	enc_mp4_file_t *preview_container;
+	int preview_video_track;
+	mp4_video_mux_t preview_video_mux;
+	
+	// Progress information
+	int64_t encoded_video_pts;
+	double duration_sec;
+};
+
+/**
+ * Lock manager for libavcodec. `avcodec_open()` and `avcodec_close()` are not thread safe on their own.
+ */
+static int enc_lock_manager(void **mutex_dptr, enum AVLockOp op){
+	switch(op){
+		case AV_LOCK_CREATE:
+			*mutex_dptr = malloc(sizeof(pthread_mutex_t));
+			return (*mutex_dptr == NULL || pthread_mutex_init(*mutex_dptr, NULL) != 0) ? 1 : 0;
+		case AV_LOCK_OBTAIN:
+			return pthread_mutex_lock(*mutex_dptr) != 0;
+		case AV_LOCK_RELEASE:
+			return pthread_mutex_unlock(*mutex_dptr) != 0;
+		case AV_LOCK_DESTROY:
+			pthread_mutex_destroy(*mutex_dptr);
+			free(*mutex_dptr);
+			return 0;
+	}
+	return 1;
+}
+
+/**
+ * Registers all codecs, formats and filters. Has to be called once before the first session is opened.
+ */
+void enc_init(bool debug){
+	enc_set_debug(debug);
+	enc_governor_init();
+	
+	av_register_all();
+	avfilter_register_all();
+	av_lockmgr_register(enc_lock_manager);
+}
+
+void enc_uninit(){
+	avfilter_uninit();
+	av_lockmgr_register(NULL);
+}
+
+static bool enc_session_fail(enc_session_t *session, int error){
+	session->error = error;
+	return false;
+}
+
+int enc_session_error(enc_session_t *session){
+	return session->error;
+}
+
+bool enc_session_result_cache_hit(enc_session_t *session){
+	return session->result_cache_hit;
+}
+
+/**
+ * Opens the input, analyzes it, opens all decoders and encoders and creates the output file. On a result
+ * cache hit the output is already complete, `enc_session_result_cache_hit()` returns `true` then and
+ * there is nothing to read.
+ *
+ * `*session_dptr` is set even if opening fails (unless there is not enough memory), use
+ * `enc_session_error()` to get the error and `enc_session_close()` to free it.
+ */
+bool enc_session_open(const enc_options_t *options, enc_session_t **session_dptr){
+	enc_session_t *session = calloc(1, sizeof(enc_session_t));
+	*session_dptr = session;
+	if (session == NULL){
+		fprintf(stderr, "failed to allocate encoding session\n");
+		return false;
+	}
+	
+	session->options = *options;
+	enc_options_t *opts = &session->options;
+	
+	// The estimate only looks at the input, an existing output file is left alone
+	if (opts->estimate && (opts->live || opts->follow || opts->input_count > 1)){
+		fprintf(stderr, "--estimate can't be combined with live or follow mode or several input files\n");
+		return enc_session_fail(session, 1);
+	}
+	if (!opts->estimate)
+		enc_result_cache_unlink_output(opts->output_file);
+	
+	// The first pass has to see exactly the same frames as the second one
+	if (opts->target_size > 0 && (opts->live || opts->follow || opts->input_count > 1 || opts->drop_duplicates)){
+		fprintf(stderr, "--target-size can't be combined with live or follow mode, several input files or --drop-duplicates\n");
+		return enc_session_fail(session, 1);
+	}
+	
+	// Look for the result of an identical job. Jobs with side outputs or input that is still growing are
+	// never cached, the cache only restores the MP4 file. A broken cache just means encoding again.
+	if (opts->result_cache != NULL && !opts->estimate){
+		if (opts->live || opts->follow || opts->poster_file != NULL || opts->sprite_file != NULL || opts->preview_file != NULL || opts->loudness_sidecar != NULL || opts->quality_metrics)
+			fprintf(stderr, "--result-cache is not supported with live or follow mode and side outputs, ignoring it\n");
+		else if ( enc_result_cache_open(opts, opts->result_cache, opts->result_cache_size * 1024 * 1024, opts->result_cache_link, &session->result_cache) )
+			session->result_cache_ptr = &session->result_cache;
+	}
+	
+	if (session->result_cache_ptr != NULL && enc_result_cache_fetch(session->result_cache_ptr, opts->output_file)){
+		printf("Result cache hit, %s taken from %s\n", opts->output_file, session->result_cache.entry_file);
+		session->result_cache_hit = true;
+		return true;
+	}
+	
+	// Pin the session before anything is allocated or any thread is started, both stay on the domain then
+	if (opts->affinity != NULL){
+		session->affinity_opened = true;
+		if ( ! enc_affinity_pin(opts->affinity, &session->affinity) )
+			return enc_session_fail(session, 1);
+	}
+	
+	// Open the video to get a format context. A broken probe cache only costs the time to probe the file
+	// again, so it's not fatal.
+	enc_probe_cache_t probe_cache;
+	enc_probe_cache_t *probe_cache_ptr = NULL;
+	if (opts->probe_cache != NULL && !opts->live && enc_probe_cache_open(opts->probe_cache, opts->input_file, &probe_cache))
+		probe_cache_ptr = &probe_cache;
+	
+	// Live input is read from stdin ("-"), a FIFO or a local UDP socket. Only probe a little of it, every
+	// byte probed is latency.
+	const char *input_url = opts->input_file;
+	if (opts->live){
+		if (strcmp(opts->input_file, "-") == 0)
+			input_url = "pipe:0";
+		if (opts->probe_size == 0)
+			opts->probe_size = 500000;
+		if (opts->probe_duration == 0)
+			opts->probe_duration = 0.5;
+		if (opts->drop_duplicates){
+			fprintf(stderr, "--drop-duplicates is not supported in live mode, ignoring it\n");
+			opts->drop_duplicates = false;
+		}
+	}
+	
+	// The stream options as given by the user, they're applied to every following input file
+	session->input_options = *opts;
+	
+	// For ASF files (WMV, WMA) the header objects are read first, they have the bitrates and frame rates libav
+	// often doesn't know. Live input can't be read twice.
+	if ( ! enc_avformat_open_file(input_url, opts->probe_size, opts->probe_duration, probe_cache_ptr, &session->format_context_ptr,
+		opts->live ? NULL : &session->asf_stream_infos_ptr) )
+		return enc_session_fail(session, 2);
+	
+	// Show some nice information about the container and its streams
+	av_dump_format(session->format_context_ptr, 0, opts->input_file, 0);
+	
+	// Select the best video and audio stream if the user didn't select some manually. The probe cache
+	// remembers the automatic selection of the last run.
+	bool auto_video_stream = (opts->video_stream_index == -1);
+	bool auto_audio_streams = (opts->audio_stream_count == 0 && ! opts->all_audio_streams);
+	if (probe_cache_ptr != NULL && probe_cache.hit){
+		if (auto_video_stream && probe_cache.video_stream_index != -1)
+			opts->video_stream_index = probe_cache.video_stream_index;
+		if (auto_audio_streams && probe_cache.audio_stream_count > 0){
+			opts->audio_stream_count = probe_cache.audio_stream_count;
+			memcpy(opts->audio_stream_indices, probe_cache.audio_stream_indices, sizeof(int) * probe_cache.audio_stream_count);
+		}
+	}
+	
+	if ( ! enc_avformat_select_streams(session->format_context_ptr, session->asf_stream_infos_ptr, &opts->video_stream_index, opts->audio_stream_indices, &opts->audio_stream_count, opts->all_audio_streams) )
+		return enc_session_fail(session, 3);
+	
+	if (probe_cache_ptr != NULL && ! probe_cache.hit){
+		enc_probe_cache_store(&probe_cache, session->format_context_ptr,
+			auto_video_stream ? opts->video_stream_index : -1,
+			opts->audio_stream_indices, auto_audio_streams ? opts->audio_stream_count : 0);
+	}
+	
+	// Open the decoder for the selected video stream
+	if ( ! enc_avcodec_open(session->format_context_ptr, opts->video_stream_index, AVMEDIA_TYPE_VIDEO, &session->video_codec_context_ptr, &session->video_codec_ptr) )
+		return enc_session_fail(session, 4);
+	session->frame_pool = enc_frame_pool_new(opts->huge_pages);
+	enc_frame_pool_attach(session->frame_pool, session->video_codec_context_ptr, session->video_codec_ptr);
+	
+	// Open decoder, loudness measurement and FAAC encoder for every selected audio stream
+	session->loudness_enabled = (opts->normalize_loudness || opts->loudness_sidecar != NULL);
+	for(int i = 0; i < opts->audio_stream_count; i++){
+		if ( ! enc_audio_track_open(session->format_context_ptr, opts->audio_stream_indices[i], session->loudness_enabled, opts->normalize_loudness, opts->loudness_target,
+			(opts->target_size > 0) ? ENC_TWO_PASS_AUDIO_BIT_RATE : 0, opts->audio_sample_rate, opts->audio_channels, &session->audio_tracks[i]) )
+			return enc_session_fail(session, 5);
+		session->audio_track_count++;
+	}
+	
+	// Use the sample aspect ratio from the video stream. If it's unknown use the ratio from the container.
+	session->sample_aspect_ratio = session->video_codec_context_ptr->sample_aspect_ratio;
+	if (session->sample_aspect_ratio.num == 0)
+		session->sample_aspect_ratio = session->format_context_ptr->streams[opts->video_stream_index]->sample_aspect_ratio;
+	
+	// Show the streams selected for encoding
+	printf("Streams selected for encoding:\n");
+	printf("  video steam %d: decoder: %s, %dx%d, timebase: (%d/%d), sample aspect ratio: (%d/%d)\n",
+		opts->video_stream_index, session->video_codec_ptr->name, session->video_codec_context_ptr->width, session->video_codec_context_ptr->height,
+		session->video_codec_context_ptr->time_base.num, session->video_codec_context_ptr->time_base.den, session->sample_aspect_ratio.num, session->sample_aspect_ratio.den);
+	for(int i = 0; i < session->audio_track_count; i++){
+		enc_audio_convert_t *conv = &session->audio_tracks[i].convert;
+		printf("  audio steam %d: decoder: %s, %d Hz, %d channels, encoded with %d Hz, %d channels, language: %s\n", session->audio_tracks[i].stream_index, session->audio_tracks[i].codec_ptr->name,
+			conv->input_rate, conv->input_channels, conv->output_rate, conv->output_channels, session->audio_tracks[i].language);
+	}
+	
+	// The decoded frames get the PTS of their packets, so the stream time base is the time base of the frames
+	AVStream *video_stream_ptr = session->format_context_ptr->streams[opts->video_stream_index];
+	session->video_time_base = video_stream_ptr->time_base;
+	session->frame_rate = video_stream_ptr->r_frame_rate;
+	if ( (session->frame_rate.num <= 0 || session->frame_rate.den <= 0) && session->asf_stream_infos_ptr != NULL )
+		session->frame_rate = session->asf_stream_infos_ptr[opts->video_stream_index].frame_rate;
+	if (session->frame_rate.num <= 0 || session->frame_rate.den <= 0)
+		session->frame_rate = (AVRational){ .num = session->video_codec_context_ptr->time_base.den, .den = session->video_codec_context_ptr->time_base.num * session->video_codec_context_ptr->ticks_per_frame };
+	
+	// Time base and frame rate of the encoded video. Only different from the input if frames are retimed.
+	session->encoded_time_base = session->video_time_base;
+	session->encoded_frame_rate = session->frame_rate;
+	
+	// Build the filter chain: crop black borders away before anything else, then remove the interlacing
+	// and append the user defined filters.
+	char *video_filter = session->video_filter;
+	size_t video_filter_size = sizeof(session->video_filter);
+	if (opts->auto_crop){
+		char crop_filter[64];
+		if ( ! enc_cropdetect(session->format_context_ptr, opts->video_stream_index, session->video_codec_context_ptr, crop_filter, sizeof(crop_filter)) )
+			return enc_session_fail(session, 11);
+		
+		snprintf(video_filter, video_filter_size, "%s", crop_filter);
+	}
+	
+	if (opts->auto_deinterlace){
+		enc_field_type_t field_type;
+		if ( ! enc_fielddetect(session->format_context_ptr, opts->video_stream_index, session->video_codec_context_ptr, session->frame_rate, &field_type) )
+			return enc_session_fail(session, 11);
+		
+		const char *field_filter = NULL;
+		if (field_type == ENC_FIELDS_INTERLACED) {
+			field_filter = enc_deinterlace_filter;
+		} else if (field_type == ENC_FIELDS_TELECINED) {
+			// The inverse telecine drops every 5th frame. Encode with a 24p (23.976) time base, then every
+			// frame lasts exactly one tick of the MP4 track (in units of the numerator).
+			field_filter = enc_inverse_telecine_filter;
+			session->encoded_frame_rate = av_mul_q(session->frame_rate, (AVRational){ .num = 4, .den = 5 });
+			session->encoded_time_base = av_inv_q(session->encoded_frame_rate);
+		}
+		
+		if (field_filter != NULL)
+			snprintf(video_filter + strlen(video_filter), video_filter_size - strlen(video_filter), "%s%s",
+				(strlen(video_filter) > 0) ? "," : "", field_filter);
+	}
+	
+	if (opts->video_filter != NULL && strlen(opts->video_filter) > 0)
+		snprintf(video_filter + strlen(video_filter), video_filter_size - strlen(video_filter), "%s%s",
+			(strlen(video_filter) > 0) ? "," : "", opts->video_filter);
+	
+	// Build the filter graph
+	AVRational input_sample_aspect_ratio = session->sample_aspect_ratio;
+	if ( ! enc_avfilter_build_graph(session->video_codec_context_ptr, session->video_time_base, session->sample_aspect_ratio, video_filter,
+		&session->filter_graph_ptr, &session->src_filter_context_ptr, &session->sink_filter_context_ptr) )
+		return enc_session_fail(session, 6);
+	
+	// The filters (e.g. crop or scale) define the size and sample aspect ratio of the encoded video
+	AVFilterLink *filter_output_ptr = session->sink_filter_context_ptr->inputs[0];
+	session->video_width = filter_output_ptr->w;
+	session->video_height = filter_output_ptr->h;
+	if (filter_output_ptr->sample_aspect_ratio.num > 0)
+		session->sample_aspect_ratio = filter_output_ptr->sample_aspect_ratio;
+	printf("  filtered video: %dx%d, sample aspect ratio: (%d/%d), frame rate: (%d/%d), filters: %s\n", session->video_width, session->video_height,
+		session->sample_aspect_ratio.num, session->sample_aspect_ratio.den, session->encoded_frame_rate.num, session->encoded_frame_rate.den, video_filter);
+	
+	// Pick the CRF for this input before the encoder is opened. A target size already defines the bitrate
+	// and live or follow input can't be sampled ahead.
+	if (opts->auto_quality){
+		if (opts->target_size > 0 || opts->live || opts->follow)
+			fprintf(stderr, "--auto-quality is ignored with --target-size and in live or follow mode\n");
+		else if ( ! enc_per_title_quality(session->format_context_ptr, opts->video_stream_index, session->video_codec_context_ptr,
+			session->video_time_base, input_sample_aspect_ratio, video_filter, session->video_width, session->video_height, session->encoded_frame_rate, opts->tune,
+			opts->quality_target_ssim, opts->quality_min_bit_rate, opts->quality_max_bit_rate, &opts->quality) )
+			return enc_session_fail(session, 11);
+	}
+	
+	// Init the x264 encoder. The live mode uses the "zerolatency" tune (no B-frames, no lookahead) and a
+	// keyframe at least at every segment boundary.
+	char x264_tune[64];
+	int x264_keyint_max = 0;
+	snprintf(x264_tune, sizeof(x264_tune), "%s%s", opts->tune, opts->live ? ",zerolatency" : "");
+	if (opts->live && opts->live_segment > 0)
+		x264_keyint_max = opts->live_segment * av_q2d(session->encoded_frame_rate);
+	
+	// Dry run: sample the encode, print the estimate and stop before anything is written
+	if (opts->estimate){
+		if ( ! enc_estimate(session->format_context_ptr, opts->video_stream_index, session->video_codec_context_ptr, session->video_time_base, input_sample_aspect_ratio, video_filter,
+			session->video_width, session->video_height, session->sample_aspect_ratio, session->encoded_time_base, session->encoded_frame_rate,
+			opts->preset, x264_tune, opts->quality, opts->profile, opts->target_size, session->audio_tracks, session->audio_track_count, opts->estimate_file) )
+			return enc_session_fail(session, 15);
+		return true;
+	}
+	
+	// For a target file size run the first pass now, the statistics are kept in /dev/shm if possible. The
+	// session address keeps the name unique if several sessions run in the same process.
+	if (opts->target_size > 0){
+		if (session->format_context_ptr->duration == AV_NOPTS_VALUE || session->format_context_ptr->duration <= 0){
+			fprintf(stderr, "--target-size needs an input with a known duration\n");
+			return enc_session_fail(session, 14);
+		}
+		
+		snprintf(session->stats_file, sizeof(session->stats_file), "%s/av_encode-%d-%p.stats",
+			(access("/dev/shm", W_OK) == 0) ? "/dev/shm" : "/tmp", (int)getpid(), (void*)session);
+		session->two_pass = (enc_x264_two_pass_t){
+			.bit_rate = enc_two_pass_video_bit_rate(opts->target_size * 1024 * 1024, session->format_context_ptr->duration / (double) AV_TIME_BASE, session->audio_tracks, session->audio_track_count),
+			.pass = 1,
+			.stats_file = session->stats_file
+		};
+		if (session->two_pass.bit_rate <= 0){
+			fprintf(stderr, "target size of %.1f MiB is too small for the audio tracks\n", opts->target_size);
+			return enc_session_fail(session, 14);
+		}
+		
+		session->two_pass_ptr = &session->two_pass;
+		if ( ! enc_two_pass_first_pass(session->format_context_ptr, opts->video_stream_index, session->video_codec_context_ptr, session->video_time_base, input_sample_aspect_ratio, video_filter,
+			session->video_width, session->video_height, session->sample_aspect_ratio, session->encoded_time_base, session->encoded_frame_rate, opts->preset, x264_tune, opts->profile, &session->two_pass) )
+			return enc_session_fail(session, 14);
+		session->two_pass.pass = 2;
+	}
+	
+	// Per frame PSNR and SSIM, measured by x264 while encoding
+	if (opts->quality_metrics){
+		if ( ! enc_metrics_open(opts->quality_metrics_file, session->encoded_time_base, &session->metrics) )
+			return enc_session_fail(session, 7);
+		session->metrics_opened = true;
+	}
+	
+	if ( ! enc_x264_open(session->video_codec_context_ptr, session->video_width, session->video_height, session->sample_aspect_ratio,
+		session->video_time_base, session->encoded_time_base, session->encoded_frame_rate, opts->preset, x264_tune, opts->quality, opts->profile, x264_keyint_max, 0, session->metrics_opened, session->two_pass_ptr, &session->x264) )
+		return enc_session_fail(session, 7);
+	
+	if (opts->speed_target > 0)
+		enc_speed_init(opts->speed_target, session->encoded_time_base, session->x264.encoder, &session->speed);
+	
+	// Init the duplicate frame detection
+	if (opts->drop_duplicates){
+		if ( ! enc_dedup_open(session->video_width, session->video_height, opts->duplicate_threshold, opts->max_duplicate_gap, session->encoded_time_base, &session->dedup) )
+			return enc_session_fail(session, 7);
+		session->dedup_opened = true;
+	}
+	
+	// Init the snapshots and the second x264 encoder for the preview
+	if (opts->poster_file != NULL || opts->sprite_file != NULL){
+		if ( ! enc_snapshots_open(session->video_width, session->video_height, session->sample_aspect_ratio, session->encoded_time_base,
+			session->format_context_ptr->duration / (double) AV_TIME_BASE, opts->poster_file, opts->sprite_file, opts->sprite_interval, opts->sprite_width, &session->snapshots) )
+			return enc_session_fail(session, 12);
+		session->snapshots_opened = true;
+	}
+	
+	session->preview_width = opts->preview_width & ~1;
+	session->preview_height = (session->preview_width * session->video_height / session->video_width) & ~1;
+	if ( opts->preview_file != NULL ){
+		if ( ! enc_x264_open(session->video_codec_context_ptr, session->preview_width, session->preview_height, session->sample_aspect_ratio,
+			session->encoded_time_base, session->encoded_time_base, session->encoded_frame_rate, "veryfast", x264_tune, 28, "baseline", 0, 0, false, NULL, &session->preview_x264) )
+			return enc_session_fail(session, 12);
+		if ( ! enc_x264_set_input(&session->preview_x264, session->video_width, session->video_height, PIX_FMT_YUV420P) )
+			return enc_session_fail(session, 12);
+	}
+	
+	// Init the MP4 muxer with one audio track per audio stream (the first one is played by default)
+	session->mp4_video_track = ENC_MP4_INVALID_TRACK;
+	enc_mp4_video_mux_init(&session->mp4_video_mux);
+	
+	// The live mode writes every frame right away (with the nominal frame duration) and into segments
+	const char *output_file = opts->output_file;
+	enc_live_init(opts->live_budget, opts->output_file, opts->live_segment, session->encoded_time_base, &session->live);
+	if (opts->live){
+		session->mp4_video_mux.fixed_duration = av_rescale_q(1, av_inv_q(session->encoded_frame_rate), session->encoded_time_base) * session->encoded_time_base.num;
+		if (opts->live_segment > 0){
+			enc_live_segment_name(opts->output_file, 1, session->first_segment_file, sizeof(session->first_segment_file));
+			output_file = session->first_segment_file;
+		}
+	}
+	
+	if ( ! enc_mp4_open(output_file, session->encoded_time_base, session->video_width, session->video_height, session->sample_aspect_ratio, &session->mp4_container, &session->mp4_video_track) )
+		return enc_session_fail(session, 9);
+	session->mp4_container->write_limit = &session->governor.write;
+	
+	for(int i = 0; i < session->audio_track_count; i++){
+		session->audio_tracks[i].container = session->mp4_container;
+		if ( ! enc_mp4_add_audio_track(session->mp4_container, session->audio_tracks[i].convert.output_rate, session->audio_tracks[i].language, i == 0, &session->audio_tracks[i].mp4_track) )
+			return enc_session_fail(session, 9);
+	}
+	
+	// The preview only gets the first audio track
+	session->preview_video_track = ENC_MP4_INVALID_TRACK;
+	enc_mp4_video_mux_init(&session->preview_video_mux);
+	if ( opts->preview_file != NULL ){
+		if ( ! enc_mp4_open(opts->preview_file, session->encoded_time_base, session->preview_width, session->preview_height, session->sample_aspect_ratio, &session->preview_container, &session->preview_video_track) )
+			return enc_session_fail(session, 12);
+		session->audio_tracks[0].preview_container = session->preview_container;
+		if ( ! enc_mp4_add_audio_track(session->preview_container, session->audio_tracks[0].convert.output_rate, session->audio_tracks[0].language, true, &session->audio_tracks[0].preview_track) )
+			return enc_session_fail(session, 12);
+	}
+	
+	// Video decoder frame
+	session->decoded_frame_ptr = avcodec_alloc_frame();
+	if (session->decoded_frame_ptr == NULL){
+		fprintf(stderr, "failed to allocate decoding buffers\n");
+		return enc_session_fail(session, 10);
+	}
+	
+	session->encoded_video_pts = 0;
+	session->duration_sec = session->format_context_ptr->duration / (double) AV_TIME_BASE;
+	
+	// In follow mode wait for more data at the end of the (last) file
+	enc_follow_init(opts->follow_timeout, opts->follow_sentinel, &session->follow);
+	session->input_index = 0;
+	
+	enc_governor_open(opts->io_limit, &session->governor);
+	
+	return true;
+}
+
+/**
+ * Pulls all frames out of the filter pipeline and encodes them (plus the side outputs). `input_time` is the
+ * time the packet that produced them was read (see `enc_session_push()`).
+ */
+static bool enc_session_encode_filtered(enc_session_t *session, const struct timespec *input_time){
+	enc_options_t *opts = &session->options;
+	x264_context_t *x264_ptr = &session->x264;
+	while( enc_avfilter_pull_to_x264_context(session->sink_filter_context_ptr, session->decoded_frame_ptr, x264_ptr) )
+	{
+		// The side outputs get every frame, even the ones dropped as duplicates
+		if (session->snapshots_opened)
+			enc_snapshots_add_frame(&session->snapshots, &x264_ptr->pic_in);
+		
+		if (session->preview_container != NULL){
+			x264_context_t *preview_ptr = &session->preview_x264;
+			enc_x264_scale_picture(preview_ptr, &x264_ptr->pic_in, session->video_height);
+			preview_ptr->payload_size = x264_encoder_encode(preview_ptr->encoder, &preview_ptr->nals, &preview_ptr->nal_count, &preview_ptr->pic_in, &preview_ptr->pic_out);
+			if (preview_ptr->payload_size > 0)
+				enc_mp4_mux_video(session->preview_container, session->preview_video_track, &session->preview_video_mux, preview_ptr);
+			else if ( preview_ptr->payload_size < 0 )
+				fprintf(stderr, "x264: preview encoder error\n");
+		}
+		
+		if ( opts->drop_duplicates && enc_dedup_drop_frame(&session->dedup, &x264_ptr->pic_in, session->video_width, session->video_height) )
+			continue;
+		
+		if (opts->live)
+			enc_live_frame_in(&session->live, x264_ptr->pic_in.i_pts, input_time);
+		
+		x264_ptr->payload_size = x264_encoder_encode(x264_ptr->encoder, &x264_ptr->nals, &x264_ptr->nal_count, &x264_ptr->pic_in, &x264_ptr->pic_out);
+		if (x264_ptr->payload_size > 0){
+			if ( opts->live && ! enc_live_next_segment(&session->live, &x264_ptr->pic_out, session->video_width, session->video_height, session->sample_aspect_ratio,
+				&session->mp4_container, &session->mp4_video_track, &session->mp4_video_mux, session->audio_tracks, session->audio_track_count) )
+				return enc_session_fail(session, 9);
+			// Each live segment is a new container
+			session->mp4_container->write_limit = &session->governor.write;
+			enc_mp4_mux_video(session->mp4_container, session->mp4_video_track, &session->mp4_video_mux, x264_ptr);
+			if (session->metrics_opened)
+				enc_metrics_frame(&session->metrics, &x264_ptr->pic_out);
+			if (opts->live)
+				enc_live_frame_out(&session->live, x264_ptr->pic_out.i_pts);
+			if (opts->speed_target > 0)
+				enc_speed_frame_out(&session->speed, x264_ptr->encoder, x264_ptr->pic_out.i_pts);
+		} else if ( x264_ptr->payload_size < 0 ) {
+			fprintf(stderr, "x264: encoder error\n");
+		}
+	}
+	
+	// The x264 context contains the latest output picture. In there is the PTS of the latest encoded frame.
+	// Use it to update the video encoding progress.
+	session->encoded_video_pts = x264_ptr->pic_out.i_pts;
+	return true;
+}
+
+/**
+ * Gets the frames the decoder and the filters of the current input still hold (delayed B-frames, the frame
+ * yadif waits on for its next field) and encodes them. Done before switching to the next input, otherwise
+ * those frames would be lost at every join.
+ */
+static bool enc_session_drain_video(enc_session_t *session){
+	AVPacket packet;
+	av_init_packet(&packet);
+	packet.data = NULL;
+	packet.size = 0;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	
+	AVFrame *decoded_frame_ptr = session->decoded_frame_ptr;
+	int decoded_frame_available = 1;
+	while (decoded_frame_available){
+		if ( avcodec_decode_video2(session->video_codec_context_ptr, decoded_frame_ptr, &decoded_frame_available, &packet) < 0 )
+			break;
+		if (decoded_frame_available){
+			// Same PTS fallback as for packets, the packet PTS of a delayed frame is stored in the frame
+			if (decoded_frame_ptr->pts == AV_NOPTS_VALUE || decoded_frame_ptr->pts == 0)
+				decoded_frame_ptr->pts = decoded_frame_ptr->pkt_pts;
+			enc_debug("  drained frame: pts: %ld\n", format_pts(decoded_frame_ptr->pts));
+			enc_frame_pool_add_frame(session->src_filter_context_ptr, session->video_codec_context_ptr, decoded_frame_ptr);
+		}
+		if ( ! enc_session_encode_filtered(session, &now) )
+			return false;
+	}
+	
+	// End of stream for the filter graph. Filters that hold frames back (e.g. yadif) only pass them on when
+	// they're asked for another frame, so request frames until the graph reports its end.
+	int error = av_buffersrc_buffer(session->src_filter_context_ptr, NULL);
+	if (error < 0){
+		enc_av_perror("av_buffersrc_buffer", error);
+		return enc_session_fail(session, 6);
+	}
+	while(true){
+		error = avfilter_request_frame(session->sink_filter_context_ptr->inputs[0]);
+		if (error == AVERROR_EOF)
+			break;
+		if (error < 0){
+			enc_av_perror("avfilter_request_frame", error);
+			return enc_session_fail(session, 6);
+		}
+		if ( ! enc_session_encode_filtered(session, &now) )
+			return false;
+	}
+	
+	return true;
+}
+
+/**
+ * Continues with the next input file. It is put right after the last frame of the previous one, the
+ * audio is cut or padded with silence to start at the same position.
+ */
+static bool enc_session_next_input(enc_session_t *session){
+	enc_options_t *opts = &session->options;
+	if ( ! enc_session_drain_video(session) )
+		return false;
+	
+	session->input_index++;
+	int64_t next_pts = session->x264.last_pts + av_rescale_q(1, av_inv_q(session->encoded_frame_rate), session->encoded_time_base);
+	printf("\nContinuing with input file %s at %.2f s\n", opts->input_files[session->input_index], next_pts * av_q2d(session->encoded_time_base));
+	
+	avfilter_graph_free(&session->filter_graph_ptr);
+	avcodec_close(session->video_codec_context_ptr);
+	session->video_codec_context_ptr = NULL;
+	av_close_input_file(session->format_context_ptr);
+	session->format_context_ptr = NULL;
+	
+	enc_input_t input;
+	if ( ! enc_input_open(&session->input_options, opts->input_files[session->input_index], &input) )
+		return enc_session_fail(session, 2);
+	session->format_context_ptr = input.format_context_ptr;
+	session->video_codec_context_ptr = input.video_codec_context_ptr;
+	session->video_codec_ptr = input.video_codec_ptr;
+	enc_frame_pool_attach(session->frame_pool, session->video_codec_context_ptr, session->video_codec_ptr);
+	opts->video_stream_index = input.video_stream_index;
+	if (session->format_context_ptr->duration != AV_NOPTS_VALUE && session->format_context_ptr->duration > 0)
+		session->duration_sec += session->format_context_ptr->duration / (double) AV_TIME_BASE;
+	
+	if (input.audio_stream_count != session->audio_track_count){
+		fprintf(stderr, "%s has %d instead of %d audio streams\n", opts->input_files[session->input_index], input.audio_stream_count, session->audio_track_count);
+		return enc_session_fail(session, 5);
+	}
+	for(int i = 0; i < session->audio_track_count; i++){
+		int64_t position = av_rescale_q(next_pts, session->encoded_time_base, (AVRational){ .num = 1, .den = session->audio_tracks[i].convert.output_rate });
+		if ( ! enc_audio_track_switch_input(&session->audio_tracks[i], session->format_context_ptr, input.audio_stream_indices[i], position) )
+			return enc_session_fail(session, 5);
+	}
+	
+	// Use the same filters. If the next file has another size scale it to the size of the first one.
+	AVStream *input_stream_ptr = session->format_context_ptr->streams[opts->video_stream_index];
+	AVRational input_sample_aspect_ratio = session->video_codec_context_ptr->sample_aspect_ratio;
+	if (input_sample_aspect_ratio.num == 0)
+		input_sample_aspect_ratio = input_stream_ptr->sample_aspect_ratio;
+	if ( ! enc_avfilter_build_graph(session->video_codec_context_ptr, input_stream_ptr->time_base, input_sample_aspect_ratio, session->video_filter,
+		&session->filter_graph_ptr, &session->src_filter_context_ptr, &session->sink_filter_context_ptr) )
+		return enc_session_fail(session, 6);
+	
+	AVFilterLink *input_output_ptr = session->sink_filter_context_ptr->inputs[0];
+	if (input_output_ptr->w != session->video_width || input_output_ptr->h != session->video_height){
+		char scaled_filter[sizeof(session->video_filter) + 32];
+		snprintf(scaled_filter, sizeof(scaled_filter), "%s%sscale=%d:%d", session->video_filter, (strlen(session->video_filter) > 0) ? "," : "",
+			session->video_width, session->video_height);
+		avfilter_graph_free(&session->filter_graph_ptr);
+		if ( ! enc_avfilter_build_graph(session->video_codec_context_ptr, input_stream_ptr->time_base, input_sample_aspect_ratio, scaled_filter,
+			&session->filter_graph_ptr, &session->src_filter_context_ptr, &session->sink_filter_context_ptr) )
+			return enc_session_fail(session, 6);
+	}
+	
+	// Rebase the PTS of the next file so its first frame follows the last one
+	int64_t input_start_time = (input_stream_ptr->start_time != AV_NOPTS_VALUE) ? input_stream_ptr->start_time : 0;
+	session->x264.input_time_base = input_stream_ptr->time_base;
+	session->x264.pts_offset = next_pts - av_rescale_q(input_start_time, input_stream_ptr->time_base, session->encoded_time_base);
+	if ( ! enc_x264_set_input(&session->x264, session->video_width, session->video_height, session->video_codec_context_ptr->pix_fmt) )
+		return enc_session_fail(session, 7);
+	
+	return true;
+}
+
+/**
+ * Reads the next packet from the input. At the end of an input file the next one is opened, in follow
+ * mode the last one is watched for new data. Returns `false` at the end of the input or on an error
+ * (see `enc_session_error()`).
+ */
+bool enc_session_read(enc_session_t *session, AVPacket *packet_ptr){
+	enc_options_t *opts = &session->options;
+	if (session->result_cache_hit)
+		return false;
+	
+	// A pause doesn't count as waiting for data in follow mode
+	if ( enc_governor_wait_while_paused(&session->governor) )
+		clock_gettime(CLOCK_MONOTONIC, &session->follow.last_data);
+	
+	while(true){
+		bool last_input = (session->input_index == opts->input_count - 1);
+		if ( enc_follow_read_frame(session->format_context_ptr, packet_ptr, (opts->follow && last_input) ? &session->follow : NULL) >= 0 ){
+			enc_io_limit_account(&session->governor.read, packet_ptr->size);
+			return true;
+		}
+		if (last_input || ! enc_session_next_input(session))
+			return false;
+	}
+}
+
+/**
+ * Decodes a packet of the input and encodes the result. Packets of streams that are not encoded are
+ * ignored. `input_time` is the time the packet was read (CLOCK_MONOTONIC), the live mode measures the
+ * latency from there.
+ */
+bool enc_session_push(enc_session_t *session, AVPacket *packet_ptr, const struct timespec *input_time){
+	enc_options_t *opts = &session->options;
+	int error, decoded_frame_available;
+	
+	if (packet_ptr->stream_index == opts->video_stream_index)
+	{
+		enc_debug("video packet: pts: %ld, dts: %ld\n", format_pts(packet_ptr->pts), packet_ptr->dts);
+		
+		AVFrame *decoded_frame_ptr = session->decoded_frame_ptr;
+		int bytes_decompressed = avcodec_decode_video2(session->video_codec_context_ptr, decoded_frame_ptr, &decoded_frame_available, packet_ptr);
+		if (bytes_decompressed < 0)
+			enc_av_perror("avcodec_decode_video2", bytes_decompressed);
+		
+		if (decoded_frame_available){
+			// Use the container (packet) PTS if the frame has no valid PTS on its own. This is the case for
+			// DV video files. We have to use the frame PTS so the filter pipeline gets the right PTS from the
+			// start. The packet PTS and DTS are still stored in the frame but it is unclear if the filter
+			// pipeline uses them.
+			int64_t original_pts = decoded_frame_ptr->pts;
+			if (decoded_frame_ptr->pts == AV_NOPTS_VALUE || decoded_frame_ptr->pts == 0)
+				decoded_frame_ptr->pts = packet_ptr->pts;
+			
+			enc_debug("  decoded frame: pts: %ld, used pts: %ld\n", format_pts(original_pts), format_pts(decoded_frame_ptr->pts));
+			
+			// Put the frame into the filter pipeline
+			enc_frame_pool_add_frame(session->src_filter_context_ptr, session->video_codec_context_ptr, decoded_frame_ptr);
+		}
+		
+		// Pull all finished frames from the filter pipeline and encode them with x264
+		if ( ! enc_session_encode_filtered(session, input_time) )
+			return false;
+	}
+	else
+	{
+		// Every audio stream is decoded and encoded on its own, all from the same pass over the input
+		for(int i = 0; i < session->audio_track_count; i++){
+			if (packet_ptr->stream_index == session->audio_tracks[i].stream_index){
+				enc_audio_track_decode(&session->audio_tracks[i], packet_ptr);
+				break;
+			}
+		}
+	}
+	
+	return true;
+}
+
+/**
+ * Position of the encoded video and audio and the duration of all inputs, all in seconds. All audio tracks
+ * progress at the same speed, the first one is used.
+ */
+void enc_session_progress(enc_session_t *session, enc_progress_t *progress){
+	progress->video_sec = session->encoded_video_pts * av_q2d(session->encoded_time_base);
+	progress->audio_sec = progress->video_sec;
+	if (session->audio_track_count > 0)
+		progress->audio_sec = session->audio_tracks[0].encoded_pts / (double)session->audio_tracks[0].convert.output_rate;
+	progress->duration_sec = session->duration_sec;
+}
+
+/**
+ * Encodes everything still buffered in the encoders and the muxer after the last packet was pushed and
+ * writes the reports (loudness, live latency and speed control).
+ */
+bool enc_session_flush(enc_session_t *session){
+	enc_options_t *opts = &session->options;
+	if (session->result_cache_hit)
+		return true;
+	
+	// If the last frames were dropped as duplicates encode the very last one anyway (it's still in the x264
+	// input picture). Otherwise the duration of the video would end with the last encoded frame.
+	x264_context_t *x264_ptr = &session->x264;
+	if (opts->drop_duplicates){
+		if (session->dedup.last_dropped){
+			enc_debug("encoding last dropped frame\n");
+			x264_ptr->payload_size = x264_encoder_encode(x264_ptr->encoder, &x264_ptr->nals, &x264_ptr->nal_count, &x264_ptr->pic_in, &x264_ptr->pic_out);
+			if (x264_ptr->payload_size > 0){
+				enc_mp4_mux_video(session->mp4_container, session->mp4_video_track, &session->mp4_video_mux, x264_ptr);
+				if (session->metrics_opened)
+					enc_metrics_frame(&session->metrics, &x264_ptr->pic_out);
+			} else if ( x264_ptr->payload_size < 0 ) {
+				fprintf(stderr, "x264: encoder error\n");
+			}
+			session->dedup.dropped_frames--;
+		}
+		
+		printf("Dropped %ld duplicate frames\n", session->dedup.dropped_frames);
+	}
+	
+	// Process any buffered frames that are still in the encoder
+	while( x264_encoder_delayed_frames(x264_ptr->encoder) > 0 ){
+		enc_debug("x264 delayed output frame\n");
+		x264_ptr->payload_size = x264_encoder_encode(x264_ptr->encoder, &x264_ptr->nals, &x264_ptr->nal_count, NULL, &x264_ptr->pic_out);
+		if (x264_ptr->payload_size > 0){
+			enc_mp4_mux_video(session->mp4_container, session->mp4_video_track, &session->mp4_video_mux, x264_ptr);
+			if (session->metrics_opened)
+				enc_metrics_frame(&session->metrics, &x264_ptr->pic_out);
+		} else if ( x264_ptr->payload_size < 0 ) {
+			fprintf(stderr, "x264: encoder error");
+		}
+	}
+	
+	// enc_mp4_mux_video() buffers one frame, flush it
+	enc_debug("flushing mp4 muxer\n");
+	x264_ptr->payload_size = 0;
+	enc_mp4_mux_video(session->mp4_container, session->mp4_video_track, &session->mp4_video_mux, x264_ptr);
+	
+	// Flush the audio encoders and report the loudness of each stream. The sidecar contains a JSON array
+	// with one object per audio stream.
+	FILE *loudness_sidecar_file = NULL;
+	if (opts->loudness_sidecar != NULL){
+		loudness_sidecar_file = fopen(opts->loudness_sidecar, "w");
+		if (loudness_sidecar_file != NULL)
+			fprintf(loudness_sidecar_file, "[\n");
+		else
+			perror(opts->loudness_sidecar);
+	}
+	
+	for(int i = 0; i < session->audio_track_count; i++){
+		enc_audio_track_flush(&session->audio_tracks[i]);
+		if (session->loudness_enabled)
+			enc_loudness_report(&session->audio_tracks[i].loudness, opts->loudness_target, session->audio_tracks[i].stream_index, session->audio_tracks[i].language, loudness_sidecar_file);
+		if (loudness_sidecar_file != NULL)
+			fprintf(loudness_sidecar_file, (i < session->audio_track_count - 1) ? ",\n" : "\n");
+	}
+	
+	if (loudness_sidecar_file != NULL){
+		fprintf(loudness_sidecar_file, "]\n");
+		fclose(loudness_sidecar_file);
+	}
+	
+	// Flush the preview encoder the same way
+	if (session->preview_container != NULL){
+		x264_context_t *preview_ptr = &session->preview_x264;
+		while( x264_encoder_delayed_frames(preview_ptr->encoder) > 0 ){
+			preview_ptr->payload_size = x264_encoder_encode(preview_ptr->encoder, &preview_ptr->nals, &preview_ptr->nal_count, NULL, &preview_ptr->pic_out);
+			if (preview_ptr->payload_size > 0)
+				enc_mp4_mux_video(session->preview_container, session->preview_video_track, &session->preview_video_mux, preview_ptr);
+		}
+		preview_ptr->payload_size = 0;
+		enc_mp4_mux_video(session->preview_container, session->preview_video_track, &session->preview_video_mux, preview_ptr);
+	}
+	
+	if (opts->live)
+		enc_live_report(&session->live);
+	
+	if (opts->speed_target > 0)
+		enc_speed_report(&session->speed);
+	
+	if (session->metrics_opened)
+		enc_metrics_report(&session->metrics);
+	
+	enc_governor_report(&session->governor);
+	
+	session->flushed = true;
+	return true;
+}
+
+/**
+ * Closes the output files and frees everything of the session, also after a failed `enc_session_open()`.
+ * The output of a flushed session is stored in the result cache.
+ */
+void enc_session_close(enc_session_t *session){
+	if (session == NULL)
+		return;
+	
+	if (session->preview_container != NULL)
+		enc_mp4_close(session->preview_container);
+	if (session->preview_x264.encoder != NULL)
+		enc_x264_close(&session->preview_x264);
+	
+	if (session->snapshots_opened)
+		enc_snapshots_close(&session->snapshots);
+	if (session->dedup_opened)
+		enc_dedup_close(&session->dedup);
+	if (session->metrics_opened)
+		enc_metrics_close(&session->metrics);
+	
+	if (session->mp4_container != NULL){
+		bool written = enc_mp4_close(session->mp4_container);
+		
+		if (written && session->flushed && session->result_cache_ptr != NULL)
+			enc_result_cache_store(session->result_cache_ptr, session->options.output_file);
+	}
+	
+	for(int i = 0; i < session->audio_track_count; i++)
+		enc_audio_track_close(&session->audio_tracks[i]);
+	
+	if (session->x264.encoder != NULL)
+		enc_x264_close(&session->x264);
+	if (session->two_pass_ptr != NULL)
+		enc_two_pass_cleanup(session->two_pass_ptr);
+	
+	avfilter_graph_free(&session->filter_graph_ptr);
+	if (session->video_codec_context_ptr != NULL)
+		avcodec_close(session->video_codec_context_ptr);
+	if (session->format_context_ptr != NULL)
+		av_close_input_file(session->format_context_ptr);
+	free(session->asf_stream_infos_ptr);
+	av_free(session->decoded_frame_ptr);
+	// After the decoder and the filter graph, both release their frames on close
+	enc_frame_pool_free(session->frame_pool);
+	
+	if (session->affinity_opened)
+		enc_affinity_unpin(&session->affinity);
+	
+	free(session);
+}
@@ -0,0 +1,229 @@
+/**
+ * libavencode: the encoding pipeline of av_encode as a library. An encoding session reads one or more
+ * input files and writes an MP4 file with H.264 video and AAC audio tracks (plus the optional side
+ * outputs). Sessions don't share any state, several of them can run in one process on different threads.
+ * 
+ * Usage: call `enc_init()` once, then `enc_session_open()`, `enc_session_read()` and `enc_session_push()`
+ * for every packet, `enc_session_flush()` and `enc_session_close()`.
+ */
+
+#ifndef LIBAVENCODE_H
+#define LIBAVENCODE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <libavcodec/avcodec.h>
+
+// Maximum number of audio streams that can be encoded at once
+#define ENC_MAX_AUDIO_TRACKS 16
+// Maximum number of input files that are concatenated
+#define ENC_MAX_INPUTS 64
+
+
+//
+// Options
+//
+
+/**
+ * Structure that contains the options of an encoding session (usually parsed from the command line).
+ */
+typedef struct {
+	// Flag to disable progress output. Per default this is only on for TTYs, we don't want
+	// progress lines flooding log files.
+	bool silent;
+	// Flag to enable debug output.
+	bool debug;
+	
+	// Name of the input file that will be read from. If several input files are given they are encoded one
+	// after the other as one continuous video, `input_file` is the first one.
+	char *input_file;
+	char *input_files[ENC_MAX_INPUTS];
+	int input_count;
+	// Index of the video stream that is encoded
+	int video_stream_index;
+	// Indices of the audio streams that are encoded, each one into its own MP4 track. If no index is
+	// given the audio stream with the highest bitrate is used, if `all_audio_streams` is set all of them.
+	int audio_stream_indices[ENC_MAX_AUDIO_TRACKS];
+	int audio_stream_count;
+	bool all_audio_streams;
+	// The audio is resampled to `audio_sample_rate` (0 = rate of the stream) and streams with more than
+	// `audio_channels` channels are downmixed to stereo (or mono if it's 1, 0 = no downmix).
+	int audio_sample_rate;
+	int audio_channels;
+	
+	// If not negative sets a limit of frames that will be read from the input video. Useful
+	// for testing purpose to encode just the first few hundred frames.
+	int64_t frame_limit;
+	
+	// The text representation of the filter graph the video is piped though. The string
+	// is parsed by avfilter_graph_parse().
+	char *video_filter;
+	// Flag to enable the black border detection. If set a crop filter is put in front of
+	// the user defined filters.
+	bool auto_crop;
+	// Flag to enable the interlace and telecine detection. Depending on the result a
+	// deinterlace or inverse telecine filter is added to the filter graph.
+	bool auto_deinterlace;
+	
+	// Flag to drop frames that are (nearly) identical to the previous frame. The threshold is the
+	// average absolute difference per pixel a 16x16 block may have and still count as identical.
+	// Even identical frames are kept if the last kept frame is older than the max gap (in seconds).
+	bool drop_duplicates;
+	float duplicate_threshold;
+	float max_duplicate_gap;
+	
+	// Side outputs generated from the filtered frames. The poster is a single snapshot taken at 10% of
+	// the video. The sprite sheets contain a thumbnail every `sprite_interval` seconds, the extension of
+	// `sprite_file` (jpg or png) selects the image format. The preview is a small MP4 encoded with a second
+	// x264 encoder. All are disabled if `NULL`.
+	char *poster_file;
+	char *sprite_file;
+	float sprite_interval;
+	int sprite_width;
+	char *preview_file;
+	int preview_width;
+	
+	// EBU R128 loudness measurement and normalization of the audio. If `normalize_loudness` is set the
+	// audio is adjusted to `loudness_target` (LUFS) in the same pass. If `loudness_sidecar` is not `NULL`
+	// the measured values are written to that file (JSON).
+	bool normalize_loudness;
+	float loudness_target;
+	char *loudness_sidecar;
+	
+	// Limits for the stream analysis of `av_find_stream_info()`: number of bytes and seconds read from the
+	// start of the file (0 = libav default). If `probe_cache` is not `NULL` the results of the analysis
+	// are stored in that directory and reused the next time the same file is encoded.
+	int64_t probe_size;
+	float probe_duration;
+	char *probe_cache;
+	
+	// Follow mode for files that are still being recorded: at the end of the file wait for more data. Stop
+	// if the file didn't grow for `follow_timeout` seconds or as soon as `follow_sentinel` exists.
+	bool follow;
+	float follow_timeout;
+	char *follow_sentinel;
+	
+	// Low latency mode for live input (stdin with "-", FIFOs or udp://127.0.0.1:port). The latency from reading
+	// a frame to writing it into the output is measured and compared against `live_budget` (ms). The output
+	// is split into MP4 segments of `live_segment` seconds (0 = one file).
+	bool live;
+	float live_budget;
+	float live_segment;
+	
+	// Trim mode: cut an MP4 file written by av_encode down to the given time ranges (e.g. "60-3540" or
+	// "0-600,900-"). Only the GOPs at the cut points are encoded again, everything else is copied.
+	char *trim;
+	
+	// If not `NULL` the output is stored in this directory and reused when the same job (same input content
+	// and options) is submitted again. The directory is kept below `result_cache_size` MiB. The output is a
+	// copy of the cached file (or a reflink), with `result_cache_link` it's a hardlink to it.
+	char *result_cache;
+	int64_t result_cache_size;
+	bool result_cache_link;
+	
+	// Name of the output file that will be written
+	char *output_file;
+	
+	// x264 configuration options
+	char *preset;
+	char *tune;
+	float quality;
+	char *profile;
+	// Replaces `quality` with a CRF picked per input: a few short segments are encoded at a low resolution
+	// and the highest CRF that still reaches `quality_target_ssim` is used. If the bitrate band (kbit/s,
+	// 0 = no limit) is set the CRF is moved so the estimated bitrate stays inside of it.
+	bool auto_quality;
+	float quality_target_ssim;
+	int quality_min_bit_rate, quality_max_bit_rate;
+	// If greater than 0 the x264 analysis settings are adjusted during the encode so it runs at least
+	// `speed_target` times realtime. The preset is the slowest (best) setting used.
+	float speed_target;
+	// If greater than 0 the video is encoded in two passes so the output file has this size (MiB). The
+	// first pass uses x264's fast first pass settings.
+	float target_size;
+	
+	// Measures the PSNR and SSIM of each encoded frame (x264 compares its reconstruction with the input) and
+	// reports the averages at the end. If `quality_metrics_file` is not `NULL` the values of each frame are
+	// written into it as JSON.
+	bool quality_metrics;
+	char *quality_metrics_file;
+	
+	// Dry run: a few short segments are encoded with the options above and the encode time (for several core
+	// counts) and the output size of the whole input are predicted. The estimate is written as JSON into
+	// `estimate_file` (stdout if `NULL`), nothing else is written. `enc_session_open()` stops after it.
+	bool estimate;
+	char *estimate_file;
+	
+	// Average bandwidth limit (MiB/s) of the input reads and of the output writes, each on its own. 0 = no
+	// limit.
+	float io_limit;
+	
+	// Pins the session to one NUMA node (or L3 cache domain if there's only one node): "auto" or the number
+	// of the domain, `NULL` = no pinning. The thread calling `enc_session_open()` and the encoder threads run
+	// on the CPUs of the domain and the frame buffers are allocated there. "auto" spreads concurrent jobs
+	// across the domains.
+	char *affinity;
+	
+	// Flag to back the decoded frames with transparent huge pages (if the kernel supports them). Saves TLB
+	// misses on large frames.
+	bool huge_pages;
+} enc_options_t;
+
+
+//
+// General output stuff
+//
+
+// Shows or hides the debug output. It's only about logging, so it's shared by all sessions.
+void enc_set_debug(bool show);
+bool enc_debug_enabled();
+
+typedef struct {
+	uint16_t hours;
+	uint8_t minutes, seconds;
+	double entire_seconds;
+} display_time_t;
+
+display_time_t display_time_from_secs(double entire_seconds);
+display_time_t display_time(int64_t time_stamp, AVRational time_base);
+
+
+//
+// Encoding sessions
+//
+
+typedef struct enc_session enc_session_t;
+
+/**
+ * Encoding progress of a session, all in seconds.
+ */
+typedef struct {
+	double video_sec, audio_sec;
+	// Duration of all inputs opened so far
+	double duration_sec;
+} enc_progress_t;
+
+void enc_init(bool debug);
+void enc_uninit();
+
+// CPUs the encoders use (affinity mask and cgroup CPU quota). Pausing and resuming applies to all sessions,
+// `enc_pause()` is safe to call from a signal handler.
+int enc_cpu_count();
+void enc_pause(bool paused);
+
+bool enc_session_open(const enc_options_t *options, enc_session_t **session_dptr);
+bool enc_session_read(enc_session_t *session, AVPacket *packet_ptr);
+bool enc_session_push(enc_session_t *session, AVPacket *packet_ptr, const struct timespec *input_time);
+bool enc_session_flush(enc_session_t *session);
+void enc_session_close(enc_session_t *session);
+
+int enc_session_error(enc_session_t *session);
+bool enc_session_result_cache_hit(enc_session_t *session);
+void enc_session_progress(enc_session_t *session, enc_progress_t *progress);
+
+bool enc_trim(const char *input_file, const char *output_file, const char *ranges_spec,
+	const char *preset, const char *tune, float quality, const char *profile);
+
+#endif